@@ -27,12 +27,12 @@ void debug(const char *format, ...)
 	va_start(ap, format);
 	if (debugging_enabled) {
 		time_t t;
-		struct tm *tm;
+		struct tm tm;
 		char tbuf[128];
 		time(&t);
-		tm = localtime(&t);
+		localtime_r(&t, &tm);
 		tbuf[0] = 0;
-		strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", tm);
+		strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
 		fprintf(stderr, "[%s] ", tbuf);
 		vfprintf(stderr, format, ap);
 		fprintf(stderr, "\n");
@@ -116,9 +116,10 @@ char *ds_leafname(char *pathname)
 
 
 /*
- * Open a securely named hidden temporary file based on the given absolute
- * path, and return the file descriptor, filling in the malloced name into
- * tmpnameptr (*tmpnameptr will need to be freed by the caller).
+ * Open a securely named hidden temporary file based on the given path, in
+ * the same directory, and return the file descriptor, filling in the
+ * malloced name into tmpnameptr (*tmpnameptr will need to be freed by the
+ * caller).  A path with no directory part is in the current directory.
  *
  * Returns -1 on error, in which case nothing is put into tmpnameptr.
  */
@@ -135,7 +136,7 @@ int ds_tmpfile(char *pathname, char **tmpnameptr)
 	leafpos = ds_leafname_pos(pathname);
 
 	if (asprintf
-	    (&temporary_name, "%.*s/.%sXXXXXX", leafpos - 1, pathname,
+	    (&temporary_name, "%.*s.%sXXXXXX", leafpos, pathname,
 	     &(pathname[leafpos])) < 0) {
 		die("%s: %s", "asprintf", strerror(errno));
 		return -1;
@@ -154,6 +155,25 @@ int ds_tmpfile(char *pathname, char **tmpnameptr)
 }
 
 
+/*
+ * Return a pointer to a static buffer describing the given epoch time as
+ * YYYY-MM-DD HH:MM:SS in the local time zone, or "-" if the time is 0.
+ */
+char *dump_time(time_t t)
+{
+	static char tbuf[256];
+	struct tm *tm;
+
+	if (0 == t)
+		return "-";
+
+	tm = localtime(&t);
+	strftime(tbuf, sizeof(tbuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
+
+	return tbuf;
+}
+
+
 #if ENABLE_SETPROCTITLE
 /* For setproctitle */
 #ifndef SPT_BUFSIZE
@@ -8,6 +8,9 @@
 #ifndef _STDINT_H
 #include <stdint.h>
 #endif	/* _STDINT_H */
+#ifndef _TIME_H
+#include <time.h>
+#endif	/* _TIME_H */
 
 #ifndef VERSION
 #define VERSION "0.0.1"
@@ -36,6 +39,7 @@ void die(const char *, ...);
 int ds_leafname_pos(char *pathname);
 char *ds_leafname(char *pathname);
 int ds_tmpfile(char *pathname, char **tmpnameptr);
+char *dump_time(time_t t);
 
 
 #if ENABLE_SETPROCTITLE
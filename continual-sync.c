@@ -34,6 +34,9 @@ static char **config_sections_selected = NULL;
 static int config_sections_selected_count = 0;
 
 static char *pidfile = NULL;		 /* PID file if in daemon mode */
+static flag_t share_all_watchers = 0;	 /* set if one watcher for all */
+static flag_t use_shared_watcher = 0;	 /* set if shared watcher needed */
+static pid_t shared_watcher_pid = 0;	 /* pid of shared watcher or 0 */
 flag_t sync_exit_now = 0;		 /* exit-now flag (on signal) */
 
 
@@ -239,6 +242,8 @@ debug("(cf) %s: %s: %s -> %s", config_sections[idx].name, #x, "using default", c
 		dup_default_string(partial_rsync_opts);
 		dup_default_string(log_file);
 		dup_default_string(status_file);
+		dup_default_string(watcher_status_file);
+		dup_default_string(watcher_snapshot_file);
 #define copy_default_ulong(x) if ((0 == config_sections[idx].set.x) && (0 != config_sections[defaults_idx].set.x)) { \
 config_sections[idx].x = config_sections[defaults_idx].x; \
 debug("(cf) %s: %s: %s -> %lu", config_sections[idx].name, #x, "using default", config_sections[defaults_idx].x); \
@@ -248,11 +253,18 @@ debug("(cf) %s: %s: %s -> %lu", config_sections[idx].name, #x, "using default",
 		copy_default_ulong(partial_interval);
 		copy_default_ulong(partial_retry);
 		copy_default_ulong(recursion_depth);
+		copy_default_ulong(collapse_threshold);
+		copy_default_ulong(scan_threads);
+		copy_default_ulong(rescan_sample);
+		copy_default_ulong(watcher_shards);
 #define copy_default_flag(x) if ((0 == config_sections[idx].set.x) && (0 != config_sections[defaults_idx].set.x)) { \
 config_sections[idx].x = config_sections[defaults_idx].x; \
 debug("(cf) %s: %s: %s -> %s", config_sections[idx].name, #x, "using default", config_sections[defaults_idx].x ? "yes" : "no"); \
 }
 		copy_default_flag(ignore_vanished_files);
+		copy_default_flag(use_io_uring);
+		copy_default_flag(use_fanotify);
+		copy_default_flag(use_close_write);
 
 		if ((0 == config_sections[idx].exclude_count)
 		    && (0 != config_sections[defaults_idx].exclude_count)) {
@@ -288,6 +300,8 @@ debug("(cf) %s: %s: %s -> %s", config_sections[idx].name, #x, "using default", c
 	expand_sequences(partial_rsync_opts);
 	expand_sequences(log_file);
 	expand_sequences(status_file);
+	expand_sequences(watcher_status_file);
+	expand_sequences(watcher_snapshot_file);
 
 	if (NULL != config_sections[idx].change_queue) {
 		struct stat sb;
@@ -340,6 +354,8 @@ debug("(cf) %s: %s: %s -> %s", config_sections[idx].name, #x, "using default", c
 	blank_if_none(sync_lock);
 	blank_if_none(log_file);
 	blank_if_none(status_file);
+	blank_if_none(watcher_status_file);
+	blank_if_none(watcher_snapshot_file);
 
 	debug("(cf valid) %d %s: %s", idx, config_sections[idx].name,
 	      rc == 0 ? "OK" : "FAILED");
@@ -418,6 +434,9 @@ static int parse_config(const char *filename, int depth)
 			section->partial_interval = 30;
 			section->partial_retry = 300;
 			section->recursion_depth = 20;
+			section->scan_threads = 1;
+			section->rescan_sample = 1;
+			section->watcher_shards = 1;
 			section->ignore_vanished_files = 0;
 
 			continue;
@@ -593,12 +612,20 @@ continue; \
 		cf_ulong("partial sync interval = %lu", partial_interval);
 		cf_ulong("partial sync retry = %lu", partial_retry);
 		cf_ulong("recursion depth = %lu", recursion_depth);
+		cf_ulong("change collapse threshold = %lu",
+			 collapse_threshold);
+		cf_ulong("scan threads = %lu", scan_threads);
+		cf_ulong("rescan sample = %lu", rescan_sample);
+		cf_ulong("watcher shards = %lu", watcher_shards);
 		cf_string("full sync marker file = %4095[^\n]",
 			  full_marker);
 		cf_string("partial sync marker file = %4095[^\n]",
 			  partial_marker);
 		cf_flag("ignore vanished files = %4095[^\n]",
 			ignore_vanished_files);
+		cf_flag("use io_uring = %4095[^\n]", use_io_uring);
+		cf_flag("use fanotify = %4095[^\n]", use_fanotify);
+		cf_flag("use close write = %4095[^\n]", use_close_write);
 		cf_string("change queue = %4095[^\n]", change_queue);
 		cf_string("transfer list = %4095[^\n]", transfer_list);
 		cf_string("temporary directory = %4095[^\n]", tempdir);
@@ -609,6 +636,10 @@ continue; \
 			  partial_rsync_opts);
 		cf_string("log file = %4095[^\n]", log_file);
 		cf_string("status file = %4095[^\n]", status_file);
+		cf_string("watcher status file = %4095[^\n]",
+			  watcher_status_file);
+		cf_string("watcher snapshot file = %4095[^\n]",
+			  watcher_snapshot_file);
 
 		if (sscanf(linebuf, " exclude = %4095[^\n]", param_str) ==
 		    1) {
@@ -674,6 +705,9 @@ config_sections[cf_idx].X = NULL; \
 		free_and_clear(partial_rsync_opts);
 		free_and_clear(log_file);
 		free_and_clear(status_file);
+		free_and_clear(watcher_status_file);
+		free_and_clear(watcher_snapshot_file);
+		free_and_clear(watch_subdir);
 		for (excl_idx = 0;
 		     excl_idx < config_sections[cf_idx].exclude_count;
 		     excl_idx++) {
@@ -697,6 +731,166 @@ config_sections[cf_idx].X = NULL; \
 }
 
 
+/*
+ * Return nonzero if the exclude lists of sections "a" and "b" have the
+ * same effect on the source directory of "b", which is "subdir" under the
+ * source directory of "a".  Patterns containing a "/" are anchored to each
+ * section's own source directory, so they only match the same things if
+ * the source directories are the same.
+ */
+static int excludes_compatible(struct sync_set_s *a, struct sync_set_s *b,
+			       const char *subdir)
+{
+	int eidx;
+
+	if (a->exclude_count != b->exclude_count)
+		return 0;
+
+	for (eidx = 0; eidx < a->exclude_count; eidx++) {
+		if (strcmp(a->excludes[eidx], b->excludes[eidx]) != 0)
+			return 0;
+		if (('\0' != subdir[0])
+		    && (NULL != strchr(a->excludes[eidx], '/')))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Return nonzero if the recursion depth of section "a" stops at the same
+ * place as that of section "b", whose source directory is "subdir" under
+ * the source directory of "a", so that a watcher for "a" sees exactly the
+ * directories that "b" would watch, and no deeper ones that "a" would not.
+ */
+static int depths_compatible(struct sync_set_s *a, struct sync_set_s *b,
+			     const char *subdir)
+{
+	unsigned long depth;
+	const char *ptr;
+
+	depth = b->recursion_depth;
+	if ('\0' != subdir[0]) {
+		depth++;
+		for (ptr = subdir; '\0' != *ptr; ptr++) {
+			if ('/' == *ptr)
+				depth++;
+		}
+	}
+
+	return depth == a->recursion_depth ? 1 : 0;
+}
+
+
+/*
+ * Find the selected sections whose source directories are the same as, or
+ * inside, the source directory of another selected section, and arrange
+ * for each of them to share the outermost such section's watcher instead
+ * of watching the same files again, by setting its "watched_by" and
+ * "watch_subdir", and marking both sections as "source_shared".  Returns
+ * the number of sections which will use another section's watcher.
+ *
+ * Sections are only shared if their exclude lists and recursion depths
+ * would have the same effect, and sections with no partial sync interval
+ * have no watcher to share.
+ */
+static int find_shared_sources(void)
+{
+	char *paths[MAX_CONFIG_SECTIONS];
+	int order[MAX_CONFIG_SECTIONS];
+	int order_count, shared_count;
+	int cf_idx, oidx, ridx;
+
+	/*
+	 * Find the real path of each source directory, and list the
+	 * sections outermost first, so that a section's possible sharers
+	 * have all been dealt with by the time it is reached.
+	 */
+	order_count = 0;
+	for (cf_idx = 0; cf_idx < config_sections_count; cf_idx++) {
+		paths[cf_idx] = NULL;
+		if (!config_sections[cf_idx].selected)
+			continue;
+		if (0 == config_sections[cf_idx].partial_interval)
+			continue;
+		paths[cf_idx] = realpath(config_sections[cf_idx].source, NULL);
+		if (NULL == paths[cf_idx]) {
+			debug("(cf) %s: %s: %s", config_sections[cf_idx].name,
+			      config_sections[cf_idx].source,
+			      strerror(errno));
+			continue;
+		}
+		for (oidx = order_count;
+		     (oidx > 0)
+		     && (strlen(paths[order[oidx - 1]]) >
+			 strlen(paths[cf_idx])); oidx--) {
+			order[oidx] = order[oidx - 1];
+		}
+		order[oidx] = cf_idx;
+		order_count++;
+	}
+
+	shared_count = 0;
+
+	for (oidx = 0; oidx < order_count; oidx++) {
+		struct sync_set_s *cf = &(config_sections[order[oidx]]);
+		const char *path = paths[order[oidx]];
+
+		for (ridx = 0; ridx < oidx; ridx++) {
+			struct sync_set_s *root =
+			    &(config_sections[order[ridx]]);
+			const char *root_path = paths[order[ridx]];
+			size_t root_len = strlen(root_path);
+			const char *subdir;
+
+			if (NULL != root->watched_by)
+				continue;
+			if (strncmp(root_path, path, root_len) != 0)
+				continue;
+
+			subdir = path + root_len;
+			if ('/' == subdir[0]) {
+				subdir++;
+			} else if (('\0' != subdir[0]) && (1 < root_len)) {
+				continue;
+			}
+
+			if (!excludes_compatible(root, cf, subdir)) {
+				debug("(cf) %s: %s: %s", cf->name,
+				      "source overlaps but excludes differ",
+				      root->name);
+				continue;
+			}
+
+			if (!depths_compatible(root, cf, subdir)) {
+				debug("(cf) %s: %s: %s", cf->name,
+				      "source overlaps but depths differ",
+				      root->name);
+				continue;
+			}
+
+			cf->watched_by = root;
+			cf->watch_subdir = xstrdup(subdir);
+			cf->source_shared = 1;
+			root->source_shared = 1;
+			shared_count++;
+
+			debug("(cf) %s: %s: %s [%s]", cf->name,
+			      "sharing watcher of", root->name, subdir);
+			break;
+		}
+	}
+
+	for (cf_idx = 0; cf_idx < config_sections_count; cf_idx++) {
+		if (NULL != paths[cf_idx])
+			free(paths[cf_idx]);
+	}
+
+	return shared_count;
+}
+
+
 /*
  * Parse the command line arguments, and read the configuration files. 
  * Returns 0 on success, -1 if the program should exit immediately without
@@ -709,13 +903,14 @@ static int parse_options(int argc, char **argv)
 		{"version", 0, 0, 'V'},
 		{"config", 1, 0, 'c'},
 		{"daemon", 1, 0, 'D'},
+		{"shared-watcher", 0, 0, 'w'},
 #if ENABLE_DEBUGGING
 		{"debug", 0, 0, 'd'},
 #endif
 		{0, 0, 0, 0}
 	};
 	int option_index = 0;
-	char *short_options = "hVc:D:"
+	char *short_options = "hVc:D:w"
 #if ENABLE_DEBUGGING
 	    "d"
 #endif
@@ -754,6 +949,8 @@ static int parse_options(int argc, char **argv)
 			       _("read configuration FILE"));
 			printf("  -D, --daemon %s   %s\n", _("FILE"),
 			       _("run as daemon, write PID to FILE"));
+			printf("  -w, --shared-watcher %s\n",
+			       _("watch all sections in one process"));
 			printf("\n");
 			printf("  -h, --help    %s\n",
 			       _("display this help"));
@@ -786,6 +983,9 @@ static int parse_options(int argc, char **argv)
 		case 'D':
 			pidfile = xstrdup(optarg);
 			break;
+		case 'w':
+			share_all_watchers = 1;
+			break;
 #if ENABLE_DEBUGGING
 		case 'd':
 			debugging_enabled = 1;
@@ -1043,6 +1243,14 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	/*
+	 * Sections watching the same files share one watcher tree, which is
+	 * looked after by the shared watcher process, along with every other
+	 * section if we were asked to share them all.
+	 */
+	if ((find_shared_sources() > 0) || (share_all_watchers))
+		use_shared_watcher = 1;
+
 	/*
 	 * Set a default PATH environment variable if we don't have one.
 	 */
@@ -1072,9 +1280,56 @@ int main(int argc, char **argv)
 	set_signal_handlers();
 
 	/*
-	 * Main loop: maintain a child process for each selected section.
+	 * Set up the sections to be watched by the shared watcher, if we
+	 * are using one.
+	 */
+	if ((use_shared_watcher)
+	    && (shared_watcher_prepare
+		(config_sections, config_sections_count,
+		 share_all_watchers) != 0)) {
+		shared_watcher_cleanup(config_sections,
+				       config_sections_count);
+		if (NULL != pidfile) {
+			remove(pidfile);
+			closelog();
+		}
+		free_options();
+		free(common_program_name);
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Main loop: maintain a child process for each selected section,
+	 * and one for the shared watcher if we are using one.
 	 */
 	while (!sync_exit_now) {
+		/*
+		 * Start the shared watcher if it isn't running, before any
+		 * sync processes that rely on it.
+		 */
+		if ((use_shared_watcher) && (0 >= shared_watcher_pid)) {
+			pid_t child;
+
+			child = fork();
+
+			if (0 == child) {
+				/* Child - run the shared watcher */
+				shared_watcher(config_sections,
+					       config_sections_count);
+				free_options();
+				free(common_program_name);
+				exit(EXIT_SUCCESS);
+			} else if (child < 0) {
+				/* Error - output a warning */
+				error("%s: %s", "fork", strerror(errno));
+			} else {
+				/* Parent - store PID */
+				shared_watcher_pid = child;
+				debug("(master) pid %d spawned [%s]",
+				      child, "shared watcher");
+			}
+		}
+
 		/*
 		 * Spawn any sync processes that need starting.
 		 */
@@ -1125,6 +1380,12 @@ int main(int argc, char **argv)
 				config_sections[cf_idx].pid = 0;
 			}
 		}
+		if ((0 < shared_watcher_pid)
+		    && (waitpid(shared_watcher_pid, NULL, WNOHANG) != 0)) {
+			debug("(master) pid %d exited [%s]",
+			      shared_watcher_pid, "shared watcher");
+			shared_watcher_pid = 0;
+		}
 		usleep(100000);
 	}
 
@@ -1139,6 +1400,16 @@ int main(int argc, char **argv)
 		kill(config_sections[cf_idx].pid, SIGTERM);
 	}
 
+	/*
+	 * Stop the shared watcher, waiting for it to finish writing out
+	 * its changes before removing any change queues we made for it.
+	 */
+	if (0 < shared_watcher_pid) {
+		kill(shared_watcher_pid, SIGTERM);
+		waitpid(shared_watcher_pid, NULL, 0);
+	}
+	shared_watcher_cleanup(config_sections, config_sections_count);
+
 	if (NULL != pidfile) {
 		remove(pidfile);
 		closelog();
@@ -0,0 +1,712 @@
+/*
+ * Functions for matching names against a list of exclude patterns.  The
+ * list is compiled once, sorting the patterns by shape: plain names are
+ * put in a hash table, patterns like "*.ext" in a table of suffixes, and
+ * patterns like ".#*" in a table of prefixes, so that checking a name
+ * against any number of these costs a few hash lookups.  Only the
+ * patterns that are none of these are passed to fnmatch() one by one.
+ *
+ * As with rsync(1), a pattern ending in "/" only matches directories, and
+ * a pattern containing "/" or "**" is matched against the path relative
+ * to the top of the tree - from the top if it starts with "/", otherwise
+ * against the end of the path.  Within such a pattern, a "**" component
+ * matches one or more whole components.  These patterns are compiled into
+ * a trie of path components, which is walked one component at a time.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include "common.h"
+#include "exclude.h"
+
+/* Initial number of slots in each hash table (power of 2) */
+#define EXCLUDE_TABLE_MIN_SLOTS 16
+
+/* Most trie positions tracked without allocating memory */
+#define EXCLUDE_STACK_STATES 64
+
+
+/*
+ * Structure holding one string in an exclude hash table.
+ */
+struct exclude_slot_s {
+	char *text;			 /* the string, or NULL if empty */
+	size_t length;			 /* length of text */
+	unsigned int hash;		 /* hash of text */
+};
+
+
+/*
+ * Structure holding a hash table of strings, with open addressing.  The
+ * table is never more than half full.  The distinct lengths of the strings
+ * are listed too, so a lookup by suffix or prefix knows which lengths to
+ * try.
+ */
+struct exclude_table_s {
+	struct exclude_slot_s *slots;	 /* array of slots */
+	unsigned int size;		 /* number of slots (power of 2) */
+	unsigned int count;		 /* number of slots in use */
+	size_t *lengths;		 /* distinct lengths of strings */
+	unsigned int length_count;	 /* number of entries in lengths */
+};
+
+
+/*
+ * Structure holding compiled patterns that are matched against leafnames.
+ */
+struct exclude_names_s {
+	struct exclude_table_s literals; /* names matched exactly */
+	struct exclude_table_s suffixes; /* from patterns "*suffix" */
+	struct exclude_table_s prefixes; /* from patterns "prefix*" */
+	char **patterns;		 /* the rest, for fnmatch() */
+	unsigned int pattern_count;	 /* number of entries in patterns */
+	flag_t match_all;		 /* set if a pattern is just "*" */
+};
+
+
+/*
+ * Structure holding one node of the trie of path patterns.  Each node
+ * stands for one component of one or more patterns, and its children for
+ * the components that follow it.
+ */
+struct exclude_node_s {
+	char *component;		 /* component to match, or NULL */
+	struct exclude_node_s **children; /* the components after this one */
+	unsigned int child_count;	 /* number of entries in children */
+	flag_t glob;			 /* set if component has wildcards */
+	flag_t any;			 /* set if component matches anything */
+	flag_t ends;			 /* set if a pattern ends here */
+	flag_t ends_dir;		 /* set if a directory pattern ends */
+};
+
+
+/*
+ * Structure holding a compiled list of exclude patterns.
+ */
+struct exclude_s {
+	struct exclude_names_s names;	 /* leafname patterns */
+	struct exclude_names_s dir_names; /* leafname patterns for dirs */
+	struct exclude_node_s anchored;	 /* root for patterns from the top */
+	struct exclude_node_s floating;	 /* root for other path patterns */
+	unsigned int node_count;	 /* number of nodes in the trie */
+};
+
+
+/*
+ * Return a hash of the "length" bytes at "text" (32-bit FNV-1a, as used
+ * for the watcher's name hash tables).
+ */
+static unsigned int exclude_hash(const char *text, size_t length)
+{
+	unsigned int hash = 2166136261U;
+	size_t idx;
+
+	for (idx = 0; idx < length; idx++) {
+		hash ^= (unsigned char) (text[idx]);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+
+/*
+ * Return nonzero if the "length" bytes at "text" are in the given table.
+ */
+static int exclude_table_find(struct exclude_table_s *table,
+			      const char *text, size_t length)
+{
+	unsigned int hash, slot;
+
+	if (0 == table->count)
+		return 0;
+
+	hash = exclude_hash(text, length);
+	slot = hash & (table->size - 1);
+
+	while (NULL != table->slots[slot].text) {
+		if ((table->slots[slot].hash == hash)
+		    && (table->slots[slot].length == length)
+		    && (memcmp(table->slots[slot].text, text, length) == 0))
+			return 1;
+		slot = (slot + 1) & (table->size - 1);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Put a copy of the "length" bytes at "text" into the given table, unless
+ * they are already there, growing the table if needed.
+ */
+static void exclude_table_add(struct exclude_table_s *table,
+			      const char *text, size_t length)
+{
+	unsigned int hash, slot, idx;
+
+	if (exclude_table_find(table, text, length))
+		return;
+
+	/*
+	 * Double the table when it would become more than half full,
+	 * moving the existing strings into their new slots.
+	 */
+	if (2 * (table->count + 1) > table->size) {
+		struct exclude_slot_s *old_slots = table->slots;
+		unsigned int old_size = table->size;
+
+		table->size =
+		    0 ==
+		    old_size ? EXCLUDE_TABLE_MIN_SLOTS : 2 * old_size;
+		table->slots = calloc(table->size, sizeof(table->slots[0]));
+		if (NULL == table->slots) {
+			die("%s: %s", "calloc", strerror(errno));
+			return;
+		}
+
+		for (idx = 0; idx < old_size; idx++) {
+			if (NULL == old_slots[idx].text)
+				continue;
+			slot = old_slots[idx].hash & (table->size - 1);
+			while (NULL != table->slots[slot].text)
+				slot = (slot + 1) & (table->size - 1);
+			table->slots[slot] = old_slots[idx];
+		}
+
+		free(old_slots);
+	}
+
+	hash = exclude_hash(text, length);
+	slot = hash & (table->size - 1);
+	while (NULL != table->slots[slot].text)
+		slot = (slot + 1) & (table->size - 1);
+
+	table->slots[slot].text = strndup(text, length);
+	if (NULL == table->slots[slot].text) {
+		die("%s: %s", "strndup", strerror(errno));
+		return;
+	}
+	table->slots[slot].length = length;
+	table->slots[slot].hash = hash;
+	table->count++;
+
+	/*
+	 * Note the length, if it is a new one.
+	 */
+	for (idx = 0; idx < table->length_count; idx++) {
+		if (table->lengths[idx] == length)
+			return;
+	}
+	table->lengths =
+	    realloc(table->lengths,
+		    (table->length_count + 1) * sizeof(table->lengths[0]));
+	if (NULL == table->lengths) {
+		die("%s: %s", "realloc", strerror(errno));
+		return;
+	}
+	table->lengths[table->length_count++] = length;
+}
+
+
+/*
+ * Free the contents of the given table.
+ */
+static void exclude_table_free(struct exclude_table_s *table)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < table->size; idx++) {
+		if (NULL != table->slots[idx].text)
+			free(table->slots[idx].text);
+	}
+	free(table->slots);
+	free(table->lengths);
+	memset(table, 0, sizeof(*table));
+}
+
+
+/*
+ * Add the leafname pattern "pattern" to the given set.
+ *
+ * A pattern with no special characters at all only matches itself; one
+ * that is "*" followed by ordinary characters matches names ending with
+ * them; and one that is ordinary characters followed by "*" matches names
+ * starting with them.  Anything else is left to fnmatch().
+ */
+static void exclude_names_add(struct exclude_names_s *names,
+			      const char *pattern)
+{
+	size_t length;
+
+	length = strlen(pattern);
+
+	if (NULL == strpbrk(pattern, "*?[\\")) {
+		exclude_table_add(&(names->literals), pattern, length);
+		return;
+	}
+
+	if ((1 == length) && ('*' == pattern[0])) {
+		names->match_all = 1;
+		return;
+	}
+
+	if (('*' == pattern[0]) && (NULL == strpbrk(pattern + 1, "*?[\\"))) {
+		exclude_table_add(&(names->suffixes), pattern + 1,
+				  length - 1);
+		return;
+	}
+
+	if (('*' == pattern[length - 1])
+	    && (strcspn(pattern, "*?[\\") == length - 1)) {
+		exclude_table_add(&(names->prefixes), pattern, length - 1);
+		return;
+	}
+
+	names->patterns =
+	    realloc(names->patterns,
+		    (names->pattern_count + 1) * sizeof(names->patterns[0]));
+	if (NULL == names->patterns) {
+		die("%s: %s", "realloc", strerror(errno));
+		return;
+	}
+	names->patterns[names->pattern_count++] = xstrdup(pattern);
+}
+
+
+/*
+ * Return 1 if "name" matches any of the patterns in the given set, or 0 if
+ * it matches none of them.
+ */
+static int exclude_names_match(struct exclude_names_s *names,
+			       const char *name)
+{
+	unsigned int idx;
+	size_t length;
+
+	if (names->match_all)
+		return 1;
+
+	length = strlen(name);
+
+	if (exclude_table_find(&(names->literals), name, length))
+		return 1;
+
+	for (idx = 0; idx < names->suffixes.length_count; idx++) {
+		size_t suffix_length = names->suffixes.lengths[idx];
+		if (suffix_length > length)
+			continue;
+		if (exclude_table_find
+		    (&(names->suffixes), name + length - suffix_length,
+		     suffix_length))
+			return 1;
+	}
+
+	for (idx = 0; idx < names->prefixes.length_count; idx++) {
+		size_t prefix_length = names->prefixes.lengths[idx];
+		if (prefix_length > length)
+			continue;
+		if (exclude_table_find
+		    (&(names->prefixes), name, prefix_length))
+			return 1;
+	}
+
+	for (idx = 0; idx < names->pattern_count; idx++) {
+		if (fnmatch(names->patterns[idx], name, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Free the contents of the given set of leafname patterns.
+ */
+static void exclude_names_free(struct exclude_names_s *names)
+{
+	unsigned int idx;
+
+	exclude_table_free(&(names->literals));
+	exclude_table_free(&(names->suffixes));
+	exclude_table_free(&(names->prefixes));
+
+	for (idx = 0; idx < names->pattern_count; idx++)
+		free(names->patterns[idx]);
+	free(names->patterns);
+	names->patterns = NULL;
+	names->pattern_count = 0;
+}
+
+
+/*
+ * Return the child of "node" for the path component "component", adding
+ * one if there is none yet.
+ */
+static struct exclude_node_s *exclude_node_child(exclude_t matcher,
+						 struct exclude_node_s *node,
+						 const char *component)
+{
+	struct exclude_node_s *child;
+	unsigned int idx;
+
+	for (idx = 0; idx < node->child_count; idx++) {
+		if (strcmp(node->children[idx]->component, component) == 0)
+			return node->children[idx];
+	}
+
+	child = calloc(1, sizeof(*child));
+	if (NULL == child) {
+		die("%s: %s", "calloc", strerror(errno));
+		return NULL;
+	}
+	child->component = xstrdup(component);
+	child->any = strcmp(component, "**") == 0 ? 1 : 0;
+	child->glob = NULL == strpbrk(component, "*?[\\") ? 0 : 1;
+
+	node->children =
+	    realloc(node->children,
+		    (node->child_count + 1) * sizeof(node->children[0]));
+	if (NULL == node->children) {
+		die("%s: %s", "realloc", strerror(errno));
+		return NULL;
+	}
+	node->children[node->child_count++] = child;
+	matcher->node_count++;
+
+	return child;
+}
+
+
+/*
+ * Add the path pattern "pattern" to the trie, as a pattern that only
+ * matches directories if "dir_only" is set.
+ */
+static void exclude_path_add(exclude_t matcher, const char *pattern,
+			     flag_t dir_only)
+{
+	struct exclude_node_s *node;
+	const char *start;
+
+	node = '/' == pattern[0] ? &(matcher->anchored) : &(matcher->floating);
+
+	for (start = pattern; NULL != start && 0 != start[0];) {
+		const char *end;
+		char *component;
+
+		end = strchr(start, '/');
+		if (end == start) {
+			start++;
+			continue;
+		}
+		component =
+		    NULL == end ? xstrdup(start) : strndup(start,
+							    end - start);
+		if (NULL == component) {
+			die("%s: %s", "strndup", strerror(errno));
+			return;
+		}
+		node = exclude_node_child(matcher, node, component);
+		free(component);
+		start = NULL == end ? NULL : end + 1;
+	}
+
+	if (dir_only) {
+		node->ends_dir = 1;
+	} else {
+		node->ends = 1;
+	}
+}
+
+
+/*
+ * Free the children of the given trie node, and everything under them.
+ */
+static void exclude_node_free(struct exclude_node_s *node)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < node->child_count; idx++) {
+		exclude_node_free(node->children[idx]);
+		free(node->children[idx]->component);
+		free(node->children[idx]);
+	}
+	free(node->children);
+	node->children = NULL;
+	node->child_count = 0;
+}
+
+
+/*
+ * Add "node" to the "count" trie positions in "states", unless it is
+ * already there.
+ */
+static void exclude_state_add(struct exclude_node_s **states,
+			      unsigned int *count,
+			      struct exclude_node_s *node)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < *count; idx++) {
+		if (states[idx] == node)
+			return;
+	}
+	states[(*count)++] = node;
+}
+
+
+/*
+ * Return 1 if "path", a path relative to the top of the tree with no
+ * leading or trailing "/", matches any of the path patterns, or 0 if not.
+ *
+ * The set of trie nodes that the path so far could have reached is kept,
+ * starting with the two roots, and moved on one component at a time; a
+ * "**" node, and the root of the patterns not anchored to the top, stay
+ * in the set as well as moving on, since they can take in any number of
+ * components.
+ */
+static int exclude_path_match(exclude_t matcher, const char *path,
+			      flag_t is_dir)
+{
+	struct exclude_node_s *stack_states[2 * EXCLUDE_STACK_STATES];
+	struct exclude_node_s **states, **next_states, **swap;
+	unsigned int count, next_count, max_states, idx, cidx;
+	char component[NAME_MAX + 1];
+	const char *start;
+	int matched;
+
+	/*
+	 * Every node can be in the set at most once.
+	 */
+	max_states = matcher->node_count + 2;
+	if (max_states <= EXCLUDE_STACK_STATES) {
+		states = stack_states;
+	} else {
+		states = malloc(2 * max_states * sizeof(states[0]));
+		if (NULL == states) {
+			die("%s: %s", "malloc", strerror(errno));
+			return 0;
+		}
+	}
+	next_states = states + max_states;
+
+	count = 0;
+	states[count++] = &(matcher->anchored);
+	states[count++] = &(matcher->floating);
+
+	for (start = path; NULL != start && 0 < count;) {
+		const char *end;
+		size_t length;
+
+		end = strchr(start, '/');
+		length = NULL == end ? strlen(start) : (size_t) (end - start);
+		if (length > NAME_MAX)
+			length = NAME_MAX;
+		memcpy(component, start, length);
+		component[length] = 0;
+		start = NULL == end ? NULL : end + 1;
+		if (0 == length)
+			continue;
+
+		next_count = 0;
+		for (idx = 0; idx < count; idx++) {
+			struct exclude_node_s *node = states[idx];
+
+			if ((node->any) || (node == &(matcher->floating)))
+				exclude_state_add(next_states, &next_count,
+						  node);
+
+			for (cidx = 0; cidx < node->child_count; cidx++) {
+				struct exclude_node_s *child =
+				    node->children[cidx];
+				if ((child->any)
+				    || ((child->glob)
+					&& (fnmatch(child->component,
+						    component, 0) == 0))
+				    || ((!child->glob)
+					&&
+					(strcmp(child->component, component)
+					 == 0)))
+					exclude_state_add(next_states,
+							  &next_count, child);
+			}
+		}
+
+		swap = states;
+		states = next_states;
+		next_states = swap;
+		count = next_count;
+	}
+
+	matched = 0;
+	for (idx = 0; idx < count; idx++) {
+		if ((states[idx]->ends) || ((is_dir) && (states[idx]->ends_dir)))
+			matched = 1;
+	}
+
+	if (max_states > EXCLUDE_STACK_STATES) {
+		if (next_states < states)
+			states = next_states;
+		free(states);
+	}
+
+	return matched;
+}
+
+
+/*
+ * Compile the "count" patterns in "patterns" into a matcher, skipping any
+ * NULL entries, and return it.  The patterns are copied, so the caller
+ * can free them afterwards.
+ */
+exclude_t exclude_compile(char **patterns, unsigned int count)
+{
+	exclude_t matcher;
+	unsigned int idx;
+
+	matcher = calloc(1, sizeof(*matcher));
+	if (NULL == matcher) {
+		die("%s: %s", "calloc", strerror(errno));
+		return NULL;
+	}
+
+	for (idx = 0; idx < count; idx++) {
+		char *pattern;
+		size_t length;
+		flag_t dir_only;
+
+		if (NULL == patterns[idx])
+			continue;
+
+		/*
+		 * A trailing "/" means only directories are matched.
+		 */
+		pattern = xstrdup(patterns[idx]);
+		length = strlen(pattern);
+		dir_only = 0;
+		while ((1 < length) && ('/' == pattern[length - 1])) {
+			pattern[--length] = 0;
+			dir_only = 1;
+		}
+
+		if ((NULL == strchr(pattern, '/'))
+		    && (NULL == strstr(pattern, "**"))) {
+			exclude_names_add(dir_only ? &(matcher->dir_names) :
+					  &(matcher->names), pattern);
+		} else if ((3 < length)
+			   && (strcmp(pattern + length - 4, "/***") == 0)) {
+			/*
+			 * As with rsync, a last component of "***"
+			 * matches both the directory before it and
+			 * everything in it.
+			 */
+			pattern[length - 4] = 0;
+			exclude_path_add(matcher, pattern, dir_only);
+			strcpy(pattern + length - 4, "/**");
+			exclude_path_add(matcher, pattern, dir_only);
+		} else {
+			exclude_path_add(matcher, pattern, dir_only);
+		}
+
+		free(pattern);
+	}
+
+	debug("%s: %u %s, %u %s, %u %s, %u %s, %u %s", "excludes compiled",
+	      matcher->names.literals.count, "names",
+	      matcher->names.suffixes.count, "suffixes",
+	      matcher->names.prefixes.count, "prefixes",
+	      matcher->names.pattern_count, "other patterns",
+	      matcher->node_count, "path pattern components");
+
+	return matcher;
+}
+
+
+/*
+ * Return 1 if "name" matches any of the patterns in the given matcher that
+ * apply to leafnames of any type of file, or 0 if it matches none of them.
+ */
+int exclude_match(exclude_t matcher, const char *name)
+{
+	if (NULL == matcher)
+		return 0;
+
+	return exclude_names_match(&(matcher->names), name);
+}
+
+
+/*
+ * Return 1 if the given matcher has any patterns that exclude_match()
+ * cannot check on its own - patterns that depend on where something is,
+ * or on whether it is a directory - which exclude_match_path() is needed
+ * for.
+ */
+int exclude_uses_paths(exclude_t matcher)
+{
+	if (NULL == matcher)
+		return 0;
+
+	if (0 < matcher->node_count)
+		return 1;
+
+	if ((matcher->dir_names.match_all)
+	    || (0 < matcher->dir_names.literals.count)
+	    || (0 < matcher->dir_names.suffixes.count)
+	    || (0 < matcher->dir_names.prefixes.count)
+	    || (0 < matcher->dir_names.pattern_count))
+		return 1;
+
+	return 0;
+}
+
+
+/*
+ * Return 1 if "path", a path relative to the top of the tree with no
+ * leading "/", which is a directory if "is_dir" is set, matches any of the
+ * patterns in the given matcher, or 0 if it matches none of them.
+ */
+int exclude_match_path(exclude_t matcher, const char *path, flag_t is_dir)
+{
+	const char *leaf;
+
+	if (NULL == matcher)
+		return 0;
+
+	leaf = strrchr(path, '/');
+	leaf = NULL == leaf ? path : leaf + 1;
+
+	if (exclude_names_match(&(matcher->names), leaf))
+		return 1;
+
+	if ((is_dir) && (exclude_names_match(&(matcher->dir_names), leaf)))
+		return 1;
+
+	if (0 == matcher->node_count)
+		return 0;
+
+	return exclude_path_match(matcher, path, is_dir);
+}
+
+
+/*
+ * Free a matcher returned by exclude_compile().
+ */
+void exclude_free(exclude_t matcher)
+{
+	if (NULL == matcher)
+		return;
+
+	exclude_names_free(&(matcher->names));
+	exclude_names_free(&(matcher->dir_names));
+	exclude_node_free(&(matcher->anchored));
+	exclude_node_free(&(matcher->floating));
+
+	free(matcher);
+}
+
+/* EOF */
@@ -0,0 +1,23 @@
+/*
+ * Header for compiled lists of exclude patterns.
+ */
+
+#ifndef EXCLUDE_H
+#define EXCLUDE_H 1
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+struct exclude_s;
+typedef struct exclude_s *exclude_t;
+
+exclude_t exclude_compile(char **patterns, unsigned int count);
+int exclude_match(exclude_t matcher, const char *name);
+int exclude_uses_paths(exclude_t matcher);
+int exclude_match_path(exclude_t matcher, const char *path, flag_t is_dir);
+void exclude_free(exclude_t matcher);
+
+#endif	/* EXCLUDE_H */
+
+/* EOF */
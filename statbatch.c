@@ -0,0 +1,434 @@
+/*
+ * Functions for making stat() calls in batches.  Where the kernel supports
+ * it, each batch is submitted through io_uring, so that many stat() calls
+ * are in progress at once rather than waiting for each one in turn, which
+ * matters on network storage or with a cold cache; otherwise, fstatat() is
+ * called for each entry.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#include "common.h"
+#include "statbatch.h"
+
+/*
+ * IORING_OP_STATX is an enum, so check for a feature flag added in the
+ * same kernel release instead.
+ */
+#if defined(IORING_FEAT_CUR_PERSONALITY) && defined(__NR_io_uring_setup)
+#define STATBATCH_URING 1
+#else
+#define STATBATCH_URING 0
+#endif
+
+/* Number of stat() calls to keep in progress at once */
+#define STATBATCH_QUEUE_DEPTH 256
+
+/* Marker for entries whose result has not arrived yet */
+#define STATBATCH_PENDING (-1)
+
+
+static flag_t statbatch_use_uring = 0;
+
+
+#if STATBATCH_URING
+
+/*
+ * Structure holding an io_uring instance and the memory shared with the
+ * kernel for it.  Each request in progress has a slot in "results" for
+ * the kernel to write into.
+ */
+struct statbatch_ring_s {
+	int fd;				 /* io_uring file descriptor */
+	unsigned int sq_entries;	 /* size of submission queue */
+	void *sq_map;			 /* mapped submission ring */
+	size_t sq_map_size;		 /* size of sq_map */
+	void *cq_map;			 /* mapped completion ring */
+	size_t cq_map_size;		 /* size of cq_map */
+	struct io_uring_sqe *sqes;	 /* mapped submission entries */
+	size_t sqes_size;		 /* size of sqes */
+	unsigned int *sq_head;		 /* submission ring head */
+	unsigned int *sq_tail;		 /* submission ring tail */
+	unsigned int *sq_mask;		 /* submission ring index mask */
+	unsigned int *sq_array;		 /* submission ring array */
+	unsigned int *cq_head;		 /* completion ring head */
+	unsigned int *cq_tail;		 /* completion ring tail */
+	unsigned int *cq_mask;		 /* completion ring index mask */
+	struct io_uring_cqe *cqes;	 /* completion entries */
+	struct statx *results;		 /* one result buffer per slot */
+	unsigned int *free_slots;	 /* stack of unused result slots */
+	unsigned int free_slot_count;	 /* number of slots on the stack */
+};
+
+static __thread struct statbatch_ring_s *statbatch_ring = NULL;
+static __thread flag_t statbatch_ring_failed = 0;
+
+
+/*
+ * Unmap and free the given ring.
+ */
+static void statbatch_ring_close(struct statbatch_ring_s *ring)
+{
+	if (NULL == ring)
+		return;
+	if ((NULL != ring->sqes) && (MAP_FAILED != (void *) ring->sqes))
+		munmap(ring->sqes, ring->sqes_size);
+	if ((NULL != ring->cq_map) && (MAP_FAILED != ring->cq_map)
+	    && (ring->cq_map != ring->sq_map))
+		munmap(ring->cq_map, ring->cq_map_size);
+	if ((NULL != ring->sq_map) && (MAP_FAILED != ring->sq_map))
+		munmap(ring->sq_map, ring->sq_map_size);
+	if (0 <= ring->fd)
+		close(ring->fd);
+	if (NULL != ring->results)
+		free(ring->results);
+	if (NULL != ring->free_slots)
+		free(ring->free_slots);
+	free(ring);
+}
+
+
+/*
+ * Set up and return a new io_uring instance, or return NULL if io_uring is
+ * not available.
+ */
+static struct statbatch_ring_s *statbatch_ring_open(void)
+{
+	struct io_uring_params params;
+	struct statbatch_ring_s *ring;
+	unsigned int slot;
+
+	ring = calloc(1, sizeof(*ring));
+	if (NULL == ring) {
+		die("%s: %s", "calloc", strerror(errno));
+		return NULL;
+	}
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, STATBATCH_QUEUE_DEPTH,
+			   &params);
+	if (0 > ring->fd) {
+		debug("%s: %s", "io_uring_setup", strerror(errno));
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_map_size =
+	    params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size =
+	    params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	/*
+	 * Newer kernels map both rings in one go.
+	 */
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map =
+	    mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_map) {
+		debug("%s: %s", "io_uring: mmap", strerror(errno));
+		statbatch_ring_close(ring);
+		return NULL;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map =
+		    mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_map) {
+			debug("%s: %s", "io_uring: mmap", strerror(errno));
+			statbatch_ring_close(ring);
+			return NULL;
+		}
+	}
+
+	ring->sqes =
+	    mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == (void *) ring->sqes) {
+		debug("%s: %s", "io_uring: mmap", strerror(errno));
+		statbatch_ring_close(ring);
+		return NULL;
+	}
+
+	ring->sq_head =
+	    (void *) ((char *) (ring->sq_map) + params.sq_off.head);
+	ring->sq_tail =
+	    (void *) ((char *) (ring->sq_map) + params.sq_off.tail);
+	ring->sq_mask =
+	    (void *) ((char *) (ring->sq_map) + params.sq_off.ring_mask);
+	ring->sq_array =
+	    (void *) ((char *) (ring->sq_map) + params.sq_off.array);
+	ring->cq_head =
+	    (void *) ((char *) (ring->cq_map) + params.cq_off.head);
+	ring->cq_tail =
+	    (void *) ((char *) (ring->cq_map) + params.cq_off.tail);
+	ring->cq_mask =
+	    (void *) ((char *) (ring->cq_map) + params.cq_off.ring_mask);
+	ring->cqes =
+	    (void *) ((char *) (ring->cq_map) + params.cq_off.cqes);
+
+	ring->results = calloc(ring->sq_entries, sizeof(ring->results[0]));
+	ring->free_slots =
+	    calloc(ring->sq_entries, sizeof(ring->free_slots[0]));
+	if ((NULL == ring->results) || (NULL == ring->free_slots)) {
+		die("%s: %s", "calloc", strerror(errno));
+		statbatch_ring_close(ring);
+		return NULL;
+	}
+	for (slot = 0; slot < ring->sq_entries; slot++) {
+		ring->free_slots[slot] = slot;
+	}
+	ring->free_slot_count = ring->sq_entries;
+
+	debug("%s: %u", "io_uring: queue depth", ring->sq_entries);
+
+	return ring;
+}
+
+
+/*
+ * Fill in the given entry from the result of a completed request.
+ */
+static void statbatch_complete(struct statbatch_entry_s *entry,
+			       const struct statx *result, int res)
+{
+	if (0 > res) {
+		/*
+		 * EINVAL means the kernel doesn't know about statx requests
+		 * at all, so do this one directly, and don't use io_uring
+		 * again in this thread.
+		 */
+		if (-EINVAL == res) {
+			statbatch_ring_failed = 1;
+			entry->rc =
+			    fstatat(entry->dirfd, entry->path, &(entry->sb),
+				    AT_SYMLINK_NOFOLLOW) == 0 ? 0 : errno;
+			return;
+		}
+		entry->rc = -res;
+		return;
+	}
+
+	memset(&(entry->sb), 0, sizeof(entry->sb));
+	entry->sb.st_dev =
+	    makedev(result->stx_dev_major, result->stx_dev_minor);
+	entry->sb.st_ino = result->stx_ino;
+	entry->sb.st_mode = result->stx_mode;
+	entry->sb.st_size = result->stx_size;
+	entry->sb.st_mtim.tv_sec = result->stx_mtime.tv_sec;
+	entry->sb.st_mtim.tv_nsec = result->stx_mtime.tv_nsec;
+	entry->rc = 0;
+}
+
+
+/*
+ * Run the given batch of stat() calls through io_uring, keeping as many
+ * requests in progress as the ring allows.  Returns nonzero if the ring
+ * failed, in which case entries whose "rc" is still STATBATCH_PENDING have
+ * not been done.
+ */
+static int statbatch_run_uring(struct statbatch_ring_s *ring,
+			       struct statbatch_entry_s *entries,
+			       size_t count)
+{
+	size_t next_entry, completed;
+	unsigned int unsubmitted;
+
+	next_entry = 0;
+	completed = 0;
+	unsubmitted = 0;
+
+	for (next_entry = 0; next_entry < count; next_entry++) {
+		entries[next_entry].rc = STATBATCH_PENDING;
+	}
+	next_entry = 0;
+
+	while (completed < count) {
+		unsigned int sq_tail, cq_head, cq_tail;
+		int rc;
+
+		/*
+		 * Fill the submission queue with as many requests as there
+		 * are free result slots.
+		 */
+		sq_tail = *(ring->sq_tail);
+		while ((next_entry < count) && (0 < ring->free_slot_count)) {
+			struct io_uring_sqe *sqe;
+			unsigned int idx, slot;
+
+			slot = ring->free_slots[--ring->free_slot_count];
+			idx = sq_tail & *(ring->sq_mask);
+			sqe = &(ring->sqes[idx]);
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = entries[next_entry].dirfd;
+			sqe->addr = (unsigned long) (entries[next_entry].path);
+			sqe->len = STATX_TYPE | STATX_MTIME | STATX_SIZE;
+			sqe->off = (unsigned long) &(ring->results[slot]);
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->user_data =
+			    ((unsigned long long) slot << 32) | next_entry;
+
+			ring->sq_array[idx] = idx;
+
+			sq_tail++;
+			next_entry++;
+			unsubmitted++;
+		}
+		__atomic_store_n(ring->sq_tail, sq_tail, __ATOMIC_RELEASE);
+
+		/*
+		 * Submit the new requests and wait for at least one to
+		 * complete.
+		 */
+		rc = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1,
+			     IORING_ENTER_GETEVENTS, NULL, 0);
+		if (0 > rc) {
+			if ((EINTR == errno) || (EAGAIN == errno)
+			    || (EBUSY == errno))
+				continue;
+			error("%s: %s", "io_uring_enter", strerror(errno));
+			return 1;
+		}
+		unsubmitted -= rc;
+
+		/*
+		 * Collect the results of the requests that have completed.
+		 */
+		cq_head = *(ring->cq_head);
+		cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (cq_head != cq_tail) {
+			struct io_uring_cqe *cqe;
+			unsigned int slot;
+			size_t entry;
+
+			cqe = &(ring->cqes[cq_head & *(ring->cq_mask)]);
+			slot = cqe->user_data >> 32;
+			entry = cqe->user_data & 0xFFFFFFFF;
+
+			statbatch_complete(&(entries[entry]),
+					   &(ring->results[slot]), cqe->res);
+
+			ring->free_slots[ring->free_slot_count++] = slot;
+			cq_head++;
+			completed++;
+		}
+		__atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+#endif				/* STATBATCH_URING */
+
+
+/*
+ * Choose whether statbatch_run() may use io_uring.  This should be called
+ * before any threads that use statbatch_run() are started.
+ */
+void statbatch_enable(flag_t use_uring)
+{
+	statbatch_use_uring = use_uring;
+}
+
+
+/*
+ * Fill in the "rc" and "sb" fields of each of the "count" entries given,
+ * as if by fstatat() without following symbolic links.  Only the file
+ * type, size, modification time, and device of "sb" are guaranteed to be
+ * filled in.
+ *
+ * Each thread calling this has its own io_uring instance, which should be
+ * freed with statbatch_release() before the thread exits.
+ */
+void statbatch_run(struct statbatch_entry_s *entries, size_t count)
+{
+	size_t idx;
+
+#if STATBATCH_URING
+	/*
+	 * A batch of one gains nothing from io_uring.
+	 */
+	if ((statbatch_use_uring) && (1 < count)
+	    && (!statbatch_ring_failed)) {
+		if (NULL == statbatch_ring) {
+			statbatch_ring = statbatch_ring_open();
+			if (NULL == statbatch_ring)
+				statbatch_ring_failed = 1;
+		}
+		if (NULL != statbatch_ring) {
+			if (statbatch_run_uring(statbatch_ring, entries, count)
+			    == 0)
+				return;
+			/*
+			 * The ring may still have requests in progress that
+			 * refer to its result buffers, so it is left alone
+			 * rather than freed.
+			 */
+			statbatch_ring = NULL;
+			statbatch_ring_failed = 1;
+			for (idx = 0; idx < count; idx++) {
+				if (STATBATCH_PENDING != entries[idx].rc)
+					continue;
+				entries[idx].rc =
+				    fstatat(entries[idx].dirfd,
+					    entries[idx].path,
+					    &(entries[idx].sb),
+					    AT_SYMLINK_NOFOLLOW) ==
+				    0 ? 0 : errno;
+			}
+			return;
+		}
+	}
+#endif				/* STATBATCH_URING */
+
+	for (idx = 0; idx < count; idx++) {
+		entries[idx].rc =
+		    fstatat(entries[idx].dirfd, entries[idx].path,
+			    &(entries[idx].sb),
+			    AT_SYMLINK_NOFOLLOW) == 0 ? 0 : errno;
+	}
+}
+
+
+/*
+ * Free the calling thread's io_uring instance, if it has one.
+ */
+void statbatch_release(void)
+{
+#if STATBATCH_URING
+	statbatch_ring_close(statbatch_ring);
+	statbatch_ring = NULL;
+	statbatch_ring_failed = 0;
+#endif				/* STATBATCH_URING */
+}
+
+/* EOF */
@@ -0,0 +1,33 @@
+/*
+ * Header for batched stat() calls.
+ */
+
+#ifndef STATBATCH_H
+#define STATBATCH_H 1
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Structure describing one stat() call in a batch.  The caller fills in
+ * "dirfd" and "path", which are used as in fstatat() without following
+ * symbolic links, and statbatch_run() fills in "rc" and "sb".
+ */
+struct statbatch_entry_s {
+	int dirfd;			 /* directory fd, or AT_FDCWD */
+	const char *path;		 /* path relative to dirfd */
+	int rc;				 /* 0 on success, or an errno value */
+	struct stat sb;			 /* mode, size, mtime, and device */
+};
+
+void statbatch_enable(flag_t use_uring);
+void statbatch_run(struct statbatch_entry_s *entries, size_t count);
+void statbatch_release(void);
+
+#endif	/* STATBATCH_H */
+
+/* EOF */
@@ -21,6 +21,7 @@
 #include <utime.h>
 #include <search.h>
 #include "sync.h"
+#include "watch.h"
 
 #define ACTION_WAITING "-"
 #define ACTION_VALIDATION_SRC "VALIDATE-SOURCE"
@@ -45,22 +46,18 @@ struct sync_status_s {
 	char *last_partial_sync_status;
 	int full_sync_failures;
 	int partial_sync_failures;
+	int watcher_overflows;
 	char *workdir;
 	char *excludes_file;
 	char *rsync_error_file;
 };
 
-extern int watch_dir(const char *toplevel_path,
-		     const char *changedpath_dir,
-		     unsigned long full_scan_interval,
-		     unsigned long queue_run_interval,
-		     unsigned long queue_run_max_seconds,
-		     unsigned long changedpath_dump_interval,
-		     unsigned int max_dir_depth, char **excludes,
-		     unsigned int exclude_count);
-
 static int run_validation(struct sync_set_s *, const char *, const char *,
 			  struct sync_status_s *, const char *);
+static void set_watcher_options(struct sync_set_s *,
+				struct watch_options_s *);
+static void merge_watcher_options(struct sync_set_s *,
+				  struct watch_options_s *);
 static void run_watcher(struct sync_set_s *);
 static void update_timestamp_file(struct sync_set_s *cf, const char *);
 static int sync_full(struct sync_set_s *, struct sync_status_s *);
@@ -69,25 +66,6 @@ static void log_message(const char *, const char *, ...);
 static void recursively_delete(const char *, int);
 
 
-/*
- * Return a pointer to a static buffer describing the given epoch time as
- * YYYY-MM-DD HH:MM:SS in the local time zone, or "-" if the time is 0.
- */
-static char *dump_time(time_t t)
-{
-	static char tbuf[256];
-	struct tm *tm;
-
-	if (0 == t)
-		return "-";
-
-	tm = localtime(&t);
-	strftime(tbuf, sizeof(tbuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
-
-	return tbuf;
-}
-
-
 /*
  * Update the status file, if we have one.
  */
@@ -121,7 +99,10 @@ static void update_status_file(struct sync_set_s *cf,
 	fprintf(status_fptr,
 		"current action           : %s\n", st->action);
 	fprintf(status_fptr, "sync process             : %d\n", st->pid);
-	if (0 == st->watcher) {
+	if (cf->shared_watcher) {
+		fprintf(status_fptr, "watcher process          : %s\n",
+			"shared");
+	} else if (0 == st->watcher) {
 		fprintf(status_fptr, "watcher process          : -\n");
 	} else {
 		fprintf(status_fptr,
@@ -156,6 +137,8 @@ static void update_status_file(struct sync_set_s *cf,
 		st->partial_sync_failures);
 	fprintf(status_fptr,
 		"full sync failures       : %d\n", st->full_sync_failures);
+	fprintf(status_fptr,
+		"watcher overflows        : %d\n", st->watcher_overflows);
 	fprintf(status_fptr,
 		"working directory        : %s\n", st->workdir);
 
@@ -186,6 +169,7 @@ static void update_status_file(struct sync_set_s *cf,
 void continual_sync(struct sync_set_s *cf)
 {
 	char workdir[4096] = { 0, };
+	char overflow_marker[4096] = { 0, };
 	struct sync_status_s status;
 	struct stat sb;
 	FILE *fptr;
@@ -202,6 +186,7 @@ void continual_sync(struct sync_set_s *cf)
 	status.last_full_sync_status = "-";
 	status.last_partial_sync_status = "-";
 	status.full_sync_failures = 0;
+	status.watcher_overflows = 0;
 	status.partial_sync_failures = 0;
 	status.workdir = workdir;
 	status.excludes_file = NULL;
@@ -306,6 +291,13 @@ void continual_sync(struct sync_set_s *cf)
 		      cf->change_queue);
 	}
 
+	/*
+	 * The watcher creates this file in the change queue directory once
+	 * it has recovered from losing events.
+	 */
+	snprintf(overflow_marker, sizeof(overflow_marker) - 1, "%s/%s",
+		 cf->change_queue, WATCH_OVERFLOW_MARKER);
+
 	log_message(cf->log_file, "[%s] %s", cf->name,
 		    _("process started"));
 
@@ -348,9 +340,11 @@ void continual_sync(struct sync_set_s *cf)
 
 		/*
 		 * If there is no watcher and there should be one, start
-		 * one.
+		 * one, unless the shared watcher is looking after this
+		 * section.
 		 */
-		if ((0 == status.watcher) && (0 < cf->partial_interval)) {
+		if ((0 == status.watcher) && (0 < cf->partial_interval)
+		    && (!cf->shared_watcher)) {
 			pid_t child;
 
 			/*
@@ -450,11 +444,26 @@ void continual_sync(struct sync_set_s *cf)
 			update_status_file(cf, &status);
 		}
 
+		/*
+		 * If the watcher has had to rescan because it lost events,
+		 * don't wait for the next partial sync, since the changes
+		 * it found could have been made a while ago.
+		 */
+		if (((0 != status.watcher) || (cf->shared_watcher))
+		    && (remove(overflow_marker) == 0)) {
+			status.watcher_overflows++;
+			status.next_partial_sync = time(NULL);
+			log_message(cf->log_file, "[%s] %s", cf->name,
+				    _
+				    ("watcher lost events and rescanned - running catch-up sync"));
+			update_status_file(cf, &status);
+		}
+
 		/*
 		 * If it's time for a partial sync and we have a watcher
 		 * process, run a partial sync.
 		 */
-		if ((0 != status.watcher)
+		if (((0 != status.watcher) || (cf->shared_watcher))
 		    && (time(NULL) >= status.next_partial_sync)) {
 
 			check_workdir = 1;
@@ -572,6 +581,141 @@ void continual_sync(struct sync_set_s *cf)
 }
 
 
+/*
+ * Mark every selected section in the "count" sections in "sets" which
+ * needs a watcher as being looked after by the shared watcher - or, if
+ * "all" is not set, only those whose source directories overlap another
+ * section's - and give any of them without a change queue directory a
+ * temporary one, since the shared watcher has to know where each
+ * section's changes go before the section's sync process starts.  Returns
+ * nonzero on error.
+ */
+int shared_watcher_prepare(struct sync_set_s *sets, int count, flag_t all)
+{
+	int idx;
+
+	for (idx = 0; idx < count; idx++) {
+		struct sync_set_s *cf = &(sets[idx]);
+		char *change_queue;
+
+		if ((!cf->selected) || (0 == cf->partial_interval))
+			continue;
+		if ((!all) && (!cf->source_shared))
+			continue;
+
+		cf->shared_watcher = 1;
+
+		if (NULL != cf->change_queue)
+			continue;
+
+		if (asprintf
+		    (&change_queue, "%s/%s",
+		     NULL == cf->tempdir ? "/tmp" : cf->tempdir,
+		     "changesXXXXXX") < 0) {
+			error("%s: %s", "asprintf", strerror(errno));
+			return 1;
+		}
+		if (mkdtemp(change_queue) == NULL) {
+			error("%s: %s: %s", "mkdtemp", change_queue,
+			      strerror(errno));
+			free(change_queue);
+			return 1;
+		}
+		cf->change_queue = change_queue;
+		cf->change_queue_made = 1;
+		debug("%s: %s: %s", cf->name,
+		      "automatically set change queue", cf->change_queue);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Run the shared watcher, watching the source directories of all of the
+ * sections in "sets" marked by shared_watcher_prepare() in one process,
+ * and writing each one's changes to its change queue.
+ *
+ * A section whose source is watched by another section's watcher, as set
+ * up by the configuration parser in "watched_by", gets no tree of its
+ * own; instead, the changes under its source are listed for it from the
+ * other section's tree.
+ */
+void shared_watcher(struct sync_set_s *sets, int count)
+{
+	struct watch_root_s *roots;
+	struct watch_view_s *views;
+	unsigned int root_count, view_count;
+	int idx, member_idx;
+
+	setproctitle("%s %s", common_program_name, _("shared watcher"));
+
+	roots = calloc(count, sizeof(roots[0]));
+	views = calloc(count, sizeof(views[0]));
+	if ((NULL == roots) || (NULL == views)) {
+		error("%s: %s", "calloc", strerror(errno));
+		free(roots);
+		free(views);
+		return;
+	}
+
+	root_count = 0;
+	view_count = 0;
+	for (idx = 0; idx < count; idx++) {
+		struct watch_root_s *root;
+
+		if (!sets[idx].shared_watcher)
+			continue;
+		if (NULL != sets[idx].watched_by)
+			continue;
+
+		root = &(roots[root_count++]);
+		root->toplevel_path = sets[idx].source;
+		root->changedpath_dir = sets[idx].change_queue;
+		set_watcher_options(&(sets[idx]), &(root->options));
+		root->views = &(views[view_count]);
+
+		for (member_idx = 0; member_idx < count; member_idx++) {
+			struct sync_set_s *member = &(sets[member_idx]);
+
+			if ((!member->shared_watcher)
+			    || (member->watched_by != &(sets[idx])))
+				continue;
+
+			views[view_count].subdir = member->watch_subdir;
+			views[view_count].changedpath_dir =
+			    member->change_queue;
+			view_count++;
+			root->view_count++;
+
+			merge_watcher_options(member, &(root->options));
+		}
+	}
+
+	if (0 < root_count)
+		watch_dirs(roots, root_count);
+
+	free(roots);
+	free(views);
+}
+
+
+/*
+ * Remove the change queue directories made by shared_watcher_prepare().
+ */
+void shared_watcher_cleanup(struct sync_set_s *sets, int count)
+{
+	int idx;
+
+	for (idx = 0; idx < count; idx++) {
+		if (!sets[idx].change_queue_made)
+			continue;
+		recursively_delete(sets[idx].change_queue, 0);
+		sets[idx].change_queue_made = 0;
+	}
+}
+
+
 /*
  * Run the given command, if there is one (returns zero if not).  Returns
  * nonzero if the command was run and it failed, and logs the error.
@@ -620,17 +764,67 @@ static int run_validation(struct sync_set_s *cf, const char *command,
 }
 
 
+/*
+ * Fill in the options for watching the source directory of the given
+ * section.
+ */
+static void set_watcher_options(struct sync_set_s *cf,
+				struct watch_options_s *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->full_scan_interval = cf->full_interval;
+	options->queue_run_interval = 2;
+	options->queue_run_max_seconds = 5;
+	options->changedpath_dump_interval = cf->partial_interval;
+	options->max_dir_depth = cf->recursion_depth;
+	options->excludes = cf->excludes;
+	options->exclude_count = cf->exclude_count;
+	options->collapse_threshold = cf->collapse_threshold;
+	options->scan_threads = cf->scan_threads;
+	options->rescan_sample = cf->rescan_sample;
+	options->shards = cf->watcher_shards;
+	options->use_io_uring = cf->use_io_uring;
+	options->use_fanotify = cf->use_fanotify;
+	options->use_close_write = cf->use_close_write;
+	options->status_file = cf->watcher_status_file;
+	options->snapshot_file = cf->watcher_snapshot_file;
+}
+
+
+/*
+ * Widen the options of a watcher so that it also covers what section "cf"
+ * needs, scanning and listing changes at least as often as cf's intervals.
+ * Its depth is left alone, since sections only share a watcher if their
+ * recursion depths already agree (see find_shared_sources()).
+ */
+static void merge_watcher_options(struct sync_set_s *cf,
+				  struct watch_options_s *options)
+{
+	if ((0 < cf->partial_interval)
+	    && (cf->partial_interval < options->changedpath_dump_interval))
+		options->changedpath_dump_interval = cf->partial_interval;
+
+	if ((0 < cf->full_interval)
+	    && ((0 == options->full_scan_interval)
+		|| (cf->full_interval < options->full_scan_interval)))
+		options->full_scan_interval = cf->full_interval;
+}
+
+
 /*
  * Run the watcher on the source directory.
  */
 static void run_watcher(struct sync_set_s *cf)
 {
+	struct watch_options_s options;
 	int rc;
+
 	setproctitle("%s %s [%s]", common_program_name, _("watcher"),
 		     cf->name);
-	rc = watch_dir(cf->source, cf->change_queue, cf->full_interval, 2,
-		       5, cf->partial_interval, cf->recursion_depth,
-		       cf->excludes, cf->exclude_count);
+
+	set_watcher_options(cf, &options);
+
+	rc = watch_dir(cf->source, cf->change_queue, &options);
 }
 
 
@@ -30,6 +30,10 @@ struct sync_set_s {
 	unsigned long partial_interval;
 	unsigned long partial_retry;
 	unsigned long recursion_depth;
+	unsigned long collapse_threshold;
+	unsigned long scan_threads;
+	unsigned long rescan_sample;
+	unsigned long watcher_shards;
 	char *full_marker;
 	char *partial_marker;
 	char *change_queue;
@@ -39,10 +43,20 @@ struct sync_set_s {
 	char *full_rsync_opts;
 	char *partial_rsync_opts;
 	flag_t ignore_vanished_files;
+	flag_t use_io_uring;
+	flag_t use_fanotify;
+	flag_t use_close_write;
 	char *log_file;
 	char *status_file;
+	char *watcher_status_file;
+	char *watcher_snapshot_file;
 	flag_t selected;		 /* set if selected on cmd line */
 	pid_t pid;			 /* pid of sync process or 0 */
+	flag_t shared_watcher;		 /* set if shared watcher used */
+	flag_t change_queue_made;	 /* set if change_queue is ours */
+	flag_t source_shared;		 /* set if source is shared */
+	struct sync_set_s *watched_by;	 /* section watching our source */
+	char *watch_subdir;		 /* our source under watched_by's */
 	/*
 	 * These flags are set by the config parser if the parameters they
 	 * are named for were explicitly set in this section, so we know
@@ -55,13 +69,23 @@ struct sync_set_s {
 		flag_t partial_interval;
 		flag_t partial_retry;
 		flag_t recursion_depth;
+		flag_t collapse_threshold;
+		flag_t scan_threads;
+		flag_t rescan_sample;
+		flag_t watcher_shards;
 		flag_t ignore_vanished_files;
+		flag_t use_io_uring;
+		flag_t use_fanotify;
+		flag_t use_close_write;
 	} set;
 };
 
 extern flag_t sync_exit_now;		 /* exit-now flag (on signal) */
 
 void continual_sync(struct sync_set_s *);
+int shared_watcher_prepare(struct sync_set_s *, int, flag_t);
+void shared_watcher(struct sync_set_s *, int);
+void shared_watcher_cleanup(struct sync_set_s *, int);
 
 #endif	/* SYNC_H */
 
@@ -3,17 +3,116 @@
  * of files changed.
  */
 
-/* File and subdirectory array allocation chunk size */
-#define DIRCONTENTS_ALLOC_CHUNK	128
+/* Initial size of file and subdirectory arrays; they double as they fill */
+#define DIRCONTENTS_MIN_ALLOC	4
 
-/* Directory index array allocation chunk size */
-#define DIR_INDEX_ALLOC_CHUNK 1024
+/* Directories with no more than this many files or subdirs have no hash */
+#define NAME_HASH_LINEAR_MAX 8
+
+/* Initial number of buckets in a directory's name hash tables */
+#define NAME_HASH_MIN_BUCKETS 16
+
+/* Initial number of slots in the watch descriptor index (power of 2) */
+#define DIR_INDEX_MIN_SLOTS 1024
+
+/* Size of the buffer used to read directory entries while scanning */
+#define SCAN_BUFFER_SIZE 262144
+
+/* Maximum number of stat() calls to make at once while scanning */
+#define SCAN_STAT_BATCH 1024
+
+/* Most directories a full scan reads before letting events through */
+#define RESCAN_SLICE_DIRS 256
+
+/* Most milliseconds a full scan runs for before letting events through */
+#define RESCAN_SLICE_MSEC 50
+
+/* Most directory moves waiting for the other half of the move at once */
+#define MOVE_PENDING_MAX 64
+
+/* Milliseconds to wait for the other half of a directory move */
+#define MOVE_PAIR_MSEC 50
+
+/* Size of the buffer that inotify and fanotify events are read into */
+#define EVENT_BUFFER_SIZE 65536
+
+/* Most reads of the event queue in one go, normally */
+#define EVENT_DRAIN_READS 16
+
+/* Number of recent event queue overflows remembered, for the hourly rate */
+#define OVERFLOW_HISTORY 256
+
+/* Seconds after an overflow during which more events are read in one go */
+#define OVERFLOW_DRAIN_SECONDS 60
+
+/* Most reads of the event queue in one go, after an overflow */
+#define OVERFLOW_DRAIN_READS 256
+
+/* Bytes of events the inotify reader thread can hold (a power of 2) */
+#define EVENT_RING_SIZE 4194304
+
+/* Events in the event ring are stored at multiples of this many bytes */
+#define EVENT_RING_ALIGN 16
+
+/* Watch descriptor marking the unused space at the end of the event ring */
+#define EVENT_RING_PAD -2
+
+/* Size of an event in the event ring, padded to keep events aligned */
+#define EVENT_RING_PADDED(length) \
+	(((length) + EVENT_RING_ALIGN - 1) & ~((size_t) EVENT_RING_ALIGN - 1))
+
+/* Most events taken from the event ring per read of the event queue */
+#define EVENT_RING_BATCH 256
+
+/* Milliseconds the reader thread waits for room when the ring is full */
+#define EVENT_RING_FULL_WAIT_MSEC 1
+
+/* Maximum number of queued files to check for changes at once */
+#define CHECK_STAT_BATCH 256
+
+/* Files smaller than this are listed as soon as a change is found */
+#define SETTLE_SMALL_SIZE 1048576
+
+/* Least seconds a larger changed file must stay unchanged to be listed */
+#define SETTLE_MIN_SECONDS 2
+
+/* Bytes of file size for each extra second it must stay unchanged */
+#define SETTLE_BYTES_PER_SECOND 16777216
+
+/* Most seconds a changed file must stay unchanged to be listed */
+#define SETTLE_MAX_SECONDS 60
+
+/* Bytes per second below which a growing file is not waited for */
+#define SETTLE_TRICKLE_RATE 65536
+
+/* Most checks in a row that can put off listing a changing file */
+#define SETTLE_MAX_DEFERRALS 10
 
 /* Change queue allocation chunk size */
 #define CHANGE_QUEUE_ALLOC_CHUNK 1024
 
-/* Changed paths list allocation chunk size */
-#define CHANGEDPATH_ALLOC_CHUNK 1024
+/* Size of each block of memory that slabs hand out items from */
+#define SLAB_CHUNK_SIZE 65536
+
+/* Leafnames are stored in slabs of multiples of this many bytes */
+#define NAME_SLAB_STEP 8
+
+/* Number of leafname slabs; longer names are allocated individually */
+#define NAME_SLAB_CLASSES 32
+
+/* Number of buffers that ds_path() rotates between */
+#define PATH_BUFFERS 4
+
+/* Identification and format version at the start of a snapshot file */
+#define SNAPSHOT_MAGIC "CSYNCSNP"
+#define SNAPSHOT_VERSION 1
+
+/* Record types in a snapshot file */
+#define SNAPSHOT_DIR 1
+#define SNAPSHOT_FILE 2
+
+/* Size of a snapshot record name, padded to keep records 8-byte aligned */
+#define SNAPSHOT_PADDED(length) (((length) + 8) & ~((size_t) 7))
 
 
 #define _GNU_SOURCE
@@ -28,16 +127,42 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <syslog.h>
 #include <limits.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
+#include <sys/fanotify.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <poll.h>
-#include <fnmatch.h>
+#include <pthread.h>
 #include "common.h"
+#include "statbatch.h"
+#include "exclude.h"
+#include "watch.h"
+
+/* Events to watch directories for */
+#define DS_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | \
+	IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* The same events, for a fanotify filesystem mark */
+#define DS_FANOTIFY_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MODIFY | \
+	FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+
+/*
+ * The events to watch for instead when files are checked once they are
+ * closed after writing, rather than after every write.
+ */
+#define DS_WATCH_CLOSE_EVENTS (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | \
+	IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+#define DS_FANOTIFY_CLOSE_EVENTS (FAN_CREATE | FAN_DELETE | \
+	FAN_CLOSE_WRITE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
 
 
 /*
@@ -54,73 +179,347 @@ struct ds_file_s;
 typedef struct ds_file_s *ds_file_t;
 struct ds_dir_s;
 typedef struct ds_dir_s *ds_dir_t;
+struct ds_store_s;
+typedef struct ds_store_s *ds_store_t;
+struct ds_context_s;
+typedef struct ds_context_s *ds_context_t;
+struct ds_scan_s;
+typedef struct ds_scan_s *ds_scan_t;
+struct ds_scan_worker_s;
+typedef struct ds_scan_worker_s *ds_scan_worker_t;
+struct ds_scan_pool_s;
+typedef struct ds_scan_pool_s *ds_scan_pool_t;
 struct ds_watch_index_s;
 typedef struct ds_watch_index_s *ds_watch_index_t;
+struct ds_handle_index_s;
+typedef struct ds_handle_index_s *ds_handle_index_t;
 struct ds_change_queue_s;
 typedef struct ds_change_queue_s *ds_change_queue_t;
+struct ds_event_ring_s;
+typedef struct ds_event_ring_s *ds_event_ring_t;
 
 
 /*
  * Structure holding information about a file.  An example path would be
- * "0/12/12345/foo.txt"; the leaf would be "foo.txt"; the absolute_path
- * would be "/top/dir/0/12/12345/foo.txt" if the top level directory was
- * "/top/dir".
+ * "0/12/12345/foo.txt", and the leaf would be "foo.txt".  Only the leaf is
+ * stored; paths are built when needed by walking up through the parent
+ * directories - see ds_path().
  */
 struct ds_file_s {
-	char *absolute_path;		 /* absolute path to file */
-	char *path;			 /* path relative to top level */
 	char *leaf;			 /* leafname of this file */
+	ds_dir_t parent;		 /* containing directory */
+	ds_file_t hash_next;		 /* next file in parent's hash chain */
 	time_t mtime;			 /* file last-modification time */
 	off_t size;			 /* file size */
-	ds_dir_t parent;		 /* containing directory */
-	flag_t seen_in_rescan;		 /* set during dir rescan */
+	int parent_index;		 /* position in parent's files[] */
+	unsigned int leaf_hash;		 /* hash of leafname */
+	int queue_position;		 /* change queue heap index + 1, or 0 */
+	unsigned int seen_generation;	 /* scan that last saw this, or 0 */
+	flag_t changed;			 /* set if listed as changed */
+	flag_t closed;			 /* closed after writing since check */
+	unsigned char settle_count;	 /* checks put off while it settles */
 };
 
 
 /*
  * Structure holding information about a directory.  An example path would
- * be "0/12/12345" with a leaf of "12345".
+ * be "0/12/12345" with a leaf of "12345".  The top level directory has an
+ * empty leaf and no parent.
  */
 struct ds_dir_s {
-	char *absolute_path;		 /* absolute path to directory */
-	char *path;			 /* path relative to top level */
 	char *leaf;			 /* leafname of this directory */
-	int wd;				 /* inotify watch fd (if dir) */
-	int depth;			 /* subdirs deep from top level */
-	int file_count;			 /* number of files in directory */
-	int subdir_count;		 /* number of immediate subdirs */
+	ds_dir_t parent;		 /* pointer to parent directory */
+	ds_dir_t hash_next;		 /* next subdir in parent's hash chain */
+	ds_context_t context;		 /* the watch this directory is in */
 	ds_file_t *files;		 /* array of files */
 	ds_dir_t *subdirs;		 /* array of subdirectories */
+	ds_file_t *file_hash;		 /* hash table of files by leaf */
+	ds_dir_t *subdir_hash;		 /* hash table of subdirs by leaf */
+	int file_count;			 /* number of files in directory */
+	int subdir_count;		 /* number of immediate subdirs */
 	int file_array_alloced;		 /* file entries allocated */
 	int subdir_array_alloced;	 /* subdir entries allocated */
-	ds_dir_t parent;		 /* pointer to parent directory */
-	ds_dir_t topdir;		 /* pointer to top directory */
-	flag_t seen_in_rescan;		 /* set during dir rescan */
-	flag_t files_unsorted;		 /* set when files need re-sorting */
-	flag_t subdirs_unsorted;	 /* set when dirs need re-sorting */
-	/*
-	 * Items used only in the top level directory:
-	 */
+	int file_hash_size;		 /* number of buckets in file_hash */
+	int subdir_hash_size;		 /* number of buckets in subdir_hash */
+	struct timespec mtime;		 /* mtime when last read, or zero */
+	struct timespec ctime;		 /* ctime when last read, or zero */
+	int wd;				 /* inotify watch fd (if dir) */
+	int depth;			 /* subdirs deep from top level */
+	int parent_index;		 /* position in parent's subdirs[] */
+	unsigned int leaf_hash;		 /* hash of leafname */
+	int queue_position;		 /* change queue heap index + 1, or 0 */
+	int rescan_position;		 /* rescan stack index + 1, or 0 */
+	int changed_files;		 /* number of files marked changed */
+	int changed_subdirs;		 /* subdirs with changes in or under */
+	unsigned int seen_generation;	 /* scan that last saw this, or 0 */
+	flag_t changed;			 /* set if listed as changed */
+	flag_t watch_writes;		 /* also watched for every write */
+	flag_t moved_away;		 /* set while waiting for move target */
+};
+
+
+/*
+ * Structure from which fixed-size items are allocated.  Items are carved
+ * out of large chunks, and freed items are kept on a free list for reuse;
+ * chunks are only given back when the whole slab is destroyed.
+ */
+struct ds_slab_s {
+	size_t item_size;		 /* size of each item */
+	void *free_list;		 /* chain of freed items */
+	char *chunk;			 /* chunk currently being carved up */
+	size_t chunk_used;		 /* bytes used in current chunk */
+	void *chunks;			 /* chain of all chunks, for freeing */
+};
+
+
+/*
+ * Structure holding the slabs that file and directory structures and their
+ * leafnames are allocated from, with counts of what is in them.  A watch
+ * has one store for its tree, and each thread of a parallel scan has its
+ * own, which is merged into the watch's store when the scan finishes.
+ */
+struct ds_store_s {
+	struct ds_slab_s file_slab;	 /* slab for file structures */
+	struct ds_slab_s dir_slab;	 /* slab for directory structures */
+	struct ds_slab_s name_slab[NAME_SLAB_CLASSES]; /* slabs for leaves */
+	unsigned long file_count;	 /* number of files allocated */
+	unsigned long dir_count;	 /* number of directories allocated */
+	size_t memory_used;		 /* bytes allocated */
+};
+
+
+/*
+ * Structure describing a directory that has been moved away, which is
+ * waiting for the event saying where it was moved to.
+ */
+struct ds_pending_move_s {
+	uint32_t cookie;		 /* cookie shared by the two events */
+	ds_dir_t dir;			 /* the directory that was moved */
+	struct timespec when;		 /* when it was moved away */
+};
+
+
+/*
+ * Structure holding the state of one thread's part of a directory scan:
+ * where to allocate new items from, the buffer to read directory entries
+ * into, and how much has been scanned.
+ */
+struct ds_scan_s {
+	ds_store_t store;		 /* store to allocate from, or NULL */
+	char *buffer;			 /* SCAN_BUFFER_SIZE bytes for getdents */
+	struct statbatch_entry_s *stats; /* SCAN_STAT_BATCH stat() calls */
+	size_t stat_count;		 /* number of stat() calls batched */
+	unsigned long file_count;	 /* files seen in this scan */
+	unsigned long dir_count;	 /* directories seen in this scan */
+	unsigned int generation;	 /* number marking entries seen */
+	flag_t trust_mtime;		 /* skip reading unchanged dirs */
+	flag_t report_changes;		 /* mark differences found as changed */
+	flag_t queue_subdirs;		 /* leave subdirs to ds_rescan_continue */
+	flag_t recovery;		 /* finding changes lost by overflow */
+	flag_t new_subdirs_only;	 /* only recurse into new subdirs */
+};
+
+
+/*
+ * Structure holding the state of a whole watch: everything that relates to
+ * the top level directory rather than to any one directory within it.
+ */
+struct ds_context_s {
+	char *absolute_path;		 /* absolute path to top directory */
+	size_t absolute_path_length;	 /* length of absolute_path */
+	ds_dir_t topdir;		 /* top level directory */
 	int fd_inotify;			 /* directory watch file descriptor */
-	ds_watch_index_t watch_index;	 /* array of watch descriptors */
-	int watch_index_length;		 /* number of entries in array */
-	int watch_index_alloced;	 /* number of entries allocated */
-	flag_t watch_index_unsorted;	 /* set if array needs sorting */
-	ds_change_queue_t change_queue;	 /* array of changes needed */
+	int fd_fanotify;		 /* fanotify descriptor, if used */
+	ds_event_ring_t event_ring;	 /* inotify reader thread, if any */
+	ds_watch_index_t watch_index;	 /* hash table of watch descriptors */
+	int watch_index_length;		 /* number of slots in use */
+	int watch_index_alloced;	 /* number of slots (power of 2) */
+	ds_handle_index_t handle_index;	 /* hash table of fanotify handles */
+	int handle_index_length;	 /* number of slots in use */
+	int handle_index_alloced;	 /* number of slots (power of 2) */
+	int next_handle_wd;		 /* next watch descriptor for handle */
+	ds_change_queue_t change_queue;	 /* heap of changes needed */
 	int change_queue_length;	 /* number of changes in queue */
 	int change_queue_alloced;	 /* array size allocated */
-	char **changed_paths;		 /* array of changed paths */
-	int changed_paths_length;	 /* number of paths in array */
-	int changed_paths_alloced;	 /* array size allocated */
+	unsigned long change_queue_sequence; /* counter to order entries */
+	struct ds_store_s store;	 /* where the tree is allocated from */
+	ds_file_t *check_files;		 /* files being checked for changes */
+	struct statbatch_entry_s *check_stats; /* stat() calls for them */
+	int check_count;		 /* number of files being checked */
+	time_t last_scan;		 /* when the last full scan ended */
+	double last_scan_duration;	 /* seconds the last full scan took */
+	unsigned long last_scan_files;	 /* files seen in last full scan */
+	unsigned long last_scan_dirs;	 /* dirs seen in last full scan */
+	flag_t snapshot_loaded;		 /* set until first full scan */
+	unsigned int scan_generation;	 /* generation of the latest scan */
+	unsigned long full_scan_count;	 /* number of full scans started */
+	struct ds_scan_s rescan;	 /* full scan in progress */
+	flag_t rescan_active;		 /* set while "rescan" is in progress */
+	struct stat rescan_topsb;	 /* top directory stat for "rescan" */
+	struct timespec rescan_started;	 /* when "rescan" started */
+	ds_dir_t *rescan_stack;		 /* directories left to scan */
+	int rescan_stack_length;	 /* number of entries in rescan_stack */
+	int rescan_stack_alloced;	 /* array size allocated */
+	flag_t rescan_again;		 /* start another when "rescan" ends */
+	flag_t events_lost;		 /* event queue overflowed */
+	flag_t recovered;		 /* recovery scan ended, tell sync */
+	time_t drain_events_until;	 /* read more events in one go */
+	unsigned long overflow_count;	 /* number of event queue overflows */
+	time_t overflow_times[OVERFLOW_HISTORY]; /* when the latest were */
+	struct ds_pending_move_s pending_moves[MOVE_PENDING_MAX]; /* moves */
+	int pending_move_count;		 /* number of pending_moves in use */
+	unsigned long write_watch_count; /* dirs watched for every write */
+	struct watch_options_s options;	 /* how to watch this directory */
+	exclude_t excludes;		 /* compiled options.excludes */
+	const char *changedpath_dir;	 /* where to write changed paths */
+	struct watch_view_s *views;	 /* subdirectories listed apart */
+	unsigned int view_count;	 /* number of entries in views */
+	time_t next_full_scan;		 /* when to run next full scan */
+	time_t next_change_queue_run;	 /* when to next run changes */
+	time_t next_changedpath_dump;	 /* when to next dump changed paths */
+	flag_t ring_ready;		 /* set when event_ring woke us */
+	char *snapshot_file;		 /* where to keep the tree snapshot */
+	unsigned int shard_index;	 /* which shard of the tree this is */
+	unsigned int shard_count;	 /* number of shards, 1 if unsharded */
+	pthread_t shard_thread;		 /* thread running this shard */
+	pthread_mutex_t shard_lock;	 /* held by that thread while busy */
+	int fd_shard_stop;		 /* eventfd written to stop it */
+	int fd_shard_notify;		 /* eventfd it writes to wake us */
+	flag_t status_wanted;		 /* shard wants status rewritten */
+	flag_t shard_failed;		 /* shard's main loop failed */
+};
+
+
+/*
+ * Structure at the start of a snapshot file, which is followed by
+ * "data_size" bytes of records.  The records are written depth first: each
+ * directory's record is followed by those of its files and then by those
+ * of its subdirectories, so a directory's record always comes before
+ * anything that refers to it.  The first record is the top level
+ * directory, whose name is its absolute path.
+ *
+ * Snapshots are only read back on the same machine, so everything is in
+ * native byte order, which "byte_order" is there to check.
+ */
+struct ds_snapshot_header_s {
+	char magic[8];			 /* SNAPSHOT_MAGIC, unterminated */
+	uint32_t version;		 /* SNAPSHOT_VERSION */
+	uint32_t byte_order;		 /* 0x01020304 */
+	uint64_t dir_count;		 /* number of directory records */
+	uint64_t file_count;		 /* number of file records */
+	uint64_t data_size;		 /* bytes of records after header */
+};
+
+
+/*
+ * Structure of one record in a snapshot file.  It is followed by its name,
+ * null-terminated and padded with nulls to SNAPSHOT_PADDED(name_length)
+ * bytes.  The "dir" field is the number of the directory record, counting
+ * from 0, of the containing directory.
+ */
+struct ds_snapshot_record_s {
+	uint16_t type;			 /* SNAPSHOT_DIR or SNAPSHOT_FILE */
+	uint16_t name_length;		 /* length of name after record */
+	uint32_t dir;			 /* containing directory's record */
+	int64_t size;			 /* file size */
+	int64_t mtime;			 /* modification time */
+	int64_t ctime;			 /* directory change time */
+	int32_t mtime_nsec;		 /* nanoseconds of directory mtime */
+	int32_t ctime_nsec;		 /* nanoseconds of directory ctime */
+};
+
+
+/*
+ * Structure holding one thread of a parallel scan, with its own deque of
+ * directories waiting to be scanned.  The owning thread pushes and pops
+ * at the tail, working depth-first; other threads that run out of work
+ * steal from the head, where the directories nearest the top - and so
+ * likely to have the most under them - are found.
+ */
+struct ds_scan_worker_s {
+	ds_scan_pool_t pool;		 /* the scan this worker is part of */
+	struct ds_scan_s scan;		 /* this worker's scan state */
+	struct ds_store_s store;	 /* where this worker allocates from */
+	pthread_t thread;		 /* thread running this worker */
+	flag_t thread_started;		 /* set if "thread" was created */
+	pthread_mutex_t lock;		 /* lock protecting the deque */
+	ds_dir_t *queue;		 /* deque of directories to scan */
+	size_t queue_head;		 /* index of first entry in deque */
+	size_t queue_tail;		 /* index after last entry in deque */
+	size_t queue_alloced;		 /* array size allocated */
+};
+
+
+/*
+ * Structure holding the state of a parallel scan.  The "pending" counter is
+ * the number of directories queued or being scanned, so the scan is over
+ * when it drops to zero; workers with nothing to do sleep on "wakeup".
+ */
+struct ds_scan_pool_s {
+	ds_context_t context;		 /* watch being scanned */
+	dev_t device;			 /* device of the top directory */
+	struct ds_scan_worker_s *workers; /* array of workers */
+	unsigned int worker_count;	 /* number of workers */
+	pthread_mutex_t lock;		 /* lock for sleeping on "wakeup" */
+	pthread_cond_t wakeup;		 /* signalled when work is added */
+	unsigned long pending;		 /* directories not yet finished */
+	unsigned int idle;		 /* number of workers sleeping */
+};
+
+
+/*
+ * Structure holding the ring that a separate thread reads inotify events
+ * into, so that the kernel's event queue keeps being drained while the
+ * main thread is busy scanning or writing out changes.  The reader thread
+ * is the only one to move "head", and the main thread the only one to move
+ * "tail"; both count bytes from the start and are only reduced to a
+ * position in the buffer when used, so the ring needs no lock.
+ *
+ * Each event is stored as it was read, at the next multiple of
+ * EVENT_RING_ALIGN bytes.  An event that would run past the end of the
+ * buffer is stored at the start instead, after a padding record, whose
+ * watch descriptor is EVENT_RING_PAD, filling the rest of the buffer.
+ */
+struct ds_event_ring_s {
+	char *buffer;			 /* EVENT_RING_SIZE bytes of events */
+	size_t head;			 /* bytes written by reader thread */
+	char head_padding[64];		 /* keeps head and tail apart */
+	size_t tail;			 /* bytes consumed by main thread */
+	size_t high_water;		 /* most bytes ever waiting */
+	unsigned long full_waits;	 /* times the reader found it full */
+	int fd_source;			 /* inotify descriptor to read */
+	int fd_ready;			 /* eventfd written when events added */
+	int fd_stop;			 /* eventfd written to stop reader */
+	pthread_t thread;		 /* the reader thread */
 };
 
 
 /*
- * Structure for indexing directory structures by watch identifier.
+ * Structure for indexing directory structures by watch identifier.  The
+ * index is an open-addressed hash table with linear probing; a slot whose
+ * dir is NULL is empty.
+ *
+ * When fanotify is used, there are no real watch descriptors, so each
+ * directory is given one of our own, and "handle" holds the directory's
+ * file handle, which is what fanotify events identify directories by.
  */
 struct ds_watch_index_s {
 	int wd;
 	ds_dir_t dir;
+	struct file_handle *handle;
+};
+
+
+/*
+ * Structure for finding the watch descriptor of a directory from its file
+ * handle, when fanotify is used.  This is an open-addressed hash table
+ * like the watch index; a slot whose handle is NULL is empty.  The handles
+ * themselves belong to the watch index.
+ */
+struct ds_handle_index_s {
+	unsigned int hash;
+	int wd;
+	struct file_handle *handle;
 };
 
 
@@ -129,1599 +528,6583 @@ struct ds_watch_index_s {
  */
 struct ds_change_queue_s {
 	time_t when;
+	unsigned long sequence;
 	ds_file_t file;
 	ds_dir_t dir;
 };
 
 
-static int ds_filename_valid(const char *name);
+static int ds_filename_valid(ds_context_t context, const char *name);
+static int ds_path_excluded(ds_dir_t dir, const char *name, flag_t is_dir);
 
-static ds_file_t ds_file_add(ds_dir_t dir, const char *name);
-static void ds_file_remove(ds_file_t file);
-static int ds_file_checkchanged(ds_file_t file);
+static void *ds_slab_alloc(ds_store_t store, struct ds_slab_s *slab);
+static void ds_slab_free(struct ds_slab_s *slab, void *item);
+static void ds_slab_destroy(struct ds_slab_s *slab);
+static void ds_slab_merge(struct ds_slab_s *slab, struct ds_slab_s *from);
+static void ds_store_init(ds_store_t store);
+static void ds_store_destroy(ds_store_t store);
+static void ds_store_merge(ds_store_t store, ds_store_t from);
+static char *ds_name_store(ds_store_t store, const char *name);
+static void ds_name_free(ds_store_t store, char *name);
+static const char *ds_path(ds_dir_t dir, const char *leaf,
+			   flag_t absolute);
+static void ds_path_release(void);
 
-static ds_dir_t ds_dir_toplevel(int fd_inotify, const char *top_path);
-static ds_dir_t ds_dir_add(ds_dir_t dir, const char *name);
+static unsigned int ds_name_hash(const char *name);
+
+static ds_file_t ds_file_lookup(ds_dir_t dir, const char *name);
+static ds_file_t ds_file_add(ds_store_t store, ds_dir_t dir,
+			     const char *name);
+static void ds_file_remove(ds_file_t file);
+static void ds_file_unlink(ds_file_t file);
+static int ds_file_statchanged(ds_file_t file, const struct stat *sb);
+static int ds_file_checkstat(ds_file_t file,
+			     const struct statbatch_entry_s *entry);
+static time_t ds_file_settle_delay(ds_file_t file, off_t old_size,
+				   time_t old_mtime, time_t now);
+
+static ds_context_t ds_context_create(int fd_inotify, int fd_fanotify,
+				      const char *top_path);
+static void ds_context_destroy(ds_context_t context);
+static ds_dir_t ds_dir_lookup(ds_dir_t dir, const char *name);
+static ds_dir_t ds_dir_add(ds_store_t store, ds_dir_t dir,
+			   const char *name);
+static int ds_dir_link(ds_store_t store, ds_dir_t dir, ds_dir_t subdir);
+static void ds_dir_unlink(ds_dir_t dir);
 static void ds_dir_remove(ds_dir_t dir);
+static void ds_dir_free(ds_dir_t dir);
+static void ds_dir_scan_entry(ds_scan_t scan, ds_dir_t dir, int dirfd,
+			      const struct stat *dirsb, const char *name,
+			      unsigned char d_type, flag_t no_recurse);
+static void ds_dir_scan_stats(ds_scan_t scan, ds_dir_t dir,
+			      const struct stat *dirsb);
+static void ds_dir_scan_known(ds_scan_t scan, ds_dir_t dir, int dirfd);
+static int ds_dir_scan_at(ds_scan_t scan, ds_dir_t dir, int parent_fd,
+			  const struct stat *parent_sb, flag_t no_recurse);
+static void ds_dir_set_times(ds_dir_t dir, const struct stat *sb);
+static void ds_scan_worker_push(ds_scan_worker_t worker, ds_dir_t dir);
+static ds_dir_t ds_scan_worker_pop(ds_scan_worker_t worker);
+static ds_dir_t ds_scan_worker_steal(ds_scan_worker_t worker);
+static void ds_scan_worker_dir(ds_scan_worker_t worker, ds_dir_t dir);
+static int ds_scan_pool_has_work(ds_scan_pool_t pool);
+static void *ds_scan_worker_run(void *arg);
+static int ds_dir_scan_finish(ds_scan_t scan, ds_dir_t dir,
+			      const struct stat *topsb);
+static int ds_dir_scan_parallel(ds_scan_t scan, ds_context_t context);
+static void ds_rescan_push(ds_context_t context, ds_dir_t dir);
+static ds_dir_t ds_rescan_pop(ds_context_t context);
+static void ds_rescan_finish(ds_context_t context);
+static void ds_rescan_continue(ds_context_t context);
+static void ds_events_lost(ds_context_t context);
+static void ds_dir_move(ds_dir_t dir, ds_dir_t newparent,
+			const char *name);
+static void ds_dir_set_depth(ds_dir_t dir, int depth);
+static void ds_move_hold(ds_context_t context, ds_dir_t dir,
+			 uint32_t cookie);
+static void ds_move_delete(ds_context_t context, int idx);
+static ds_dir_t ds_move_take(ds_context_t context, uint32_t cookie);
+static void ds_move_forget(ds_context_t context, ds_dir_t dir);
+static void ds_moves_expire(ds_context_t context, flag_t all);
+static int ds_moves_timeout(ds_context_t context);
+static unsigned long ds_overflows_last_hour(ds_context_t context);
+static int ds_events_draining(ds_context_t context, int reads);
+static void ds_event_ring_start(ds_context_t context);
+static void ds_event_ring_stop(ds_context_t context);
+static int ds_event_ring_pending(ds_context_t context);
 static int ds_dir_scan(ds_dir_t dir, flag_t no_recurse);
 
-static void ds_watch_index_add(ds_dir_t dir, int wd);
-static void ds_watch_index_remove(ds_dir_t topdir, int wd);
-static ds_dir_t ds_watch_index_lookup(ds_dir_t topdir, int wd);
+static void ds_watch_index_add(ds_dir_t dir, int wd,
+			       struct file_handle *handle);
+static void ds_watch_index_remove(ds_context_t context, int wd);
+static ds_dir_t ds_watch_index_lookup(ds_context_t context, int wd);
+
+static unsigned int ds_handle_hash(const struct file_handle *handle);
+static void ds_handle_index_add(ds_context_t context,
+				struct file_handle *handle, int wd);
+static void ds_handle_index_remove(ds_context_t context,
+				   const struct file_handle *handle, int wd);
+static int ds_handle_index_lookup(ds_context_t context,
+				  const struct file_handle *handle);
+static void ds_dir_watch(ds_dir_t dir, int dirfd);
+static void ds_dir_watch_writes(ds_dir_t dir);
 
 static void ds_change_queue_file_add(ds_file_t file, time_t when);
 static void ds_change_queue_file_remove(ds_file_t file);
 static void ds_change_queue_dir_add(ds_dir_t dir, time_t when);
 static void ds_change_queue_dir_remove(ds_dir_t dir);
 
-static void ds_change_queue_process(ds_dir_t topdir, time_t work_until);
+static void ds_change_queue_check_files(ds_context_t context);
+static void ds_change_queue_process(ds_context_t context,
+				    time_t work_until);
 
-static void mark_path_changed(ds_dir_t topdir, const char *path,
-			      flag_t isdir);
-static void dump_changed_paths(ds_dir_t topdir,
+static int ds_dir_flagged(ds_dir_t dir);
+static int ds_dir_listed(ds_dir_t dir);
+static void ds_dir_flag_parents(ds_dir_t dir);
+static void mark_file_changed(ds_file_t file);
+static void mark_dir_changed(ds_dir_t dir);
+static void dump_changed_paths(ds_context_t *contexts, unsigned int count,
 			       const char *changedpath_dir);
-
-
-
-static unsigned int max_directory_depth = 20;
+static void write_watcher_status(ds_context_t *contexts,
+				 unsigned int count);
+static void ds_status_changed(ds_context_t context);
+static void ds_shard_notify(ds_context_t context);
+static void write_overflow_marker(const char *savedir);
+static void ds_snapshot_save(ds_context_t context);
+static int ds_snapshot_load(ds_context_t context);
+
+
+/* Convenience macros for building paths to directories and files. */
+#define ds_dir_path(d) ds_path((d), NULL, 0)
+#define ds_dir_abspath(d) ds_path((d), NULL, 1)
+#define ds_file_path(f) ds_path((f)->parent, (f)->leaf, 0)
+#define ds_file_abspath(f) ds_path((f)->parent, (f)->leaf, 1)
+
+/* The inotify events to watch directory "d" for */
+#define ds_dir_watch_events(d) \
+	(!(d)->context->options.use_close_write ? DS_WATCH_EVENTS : \
+	(d)->watch_writes ? DS_WATCH_CLOSE_EVENTS | IN_MODIFY : \
+	DS_WATCH_CLOSE_EVENTS)
+
+/* The descriptor and context index of ready epoll event "e" */
+#define watch_dir_epoll_fd(e) ((int) ((e).data.u64 & 0xffffffff))
+#define watch_dir_epoll_idx(e) ((unsigned int) ((e).data.u64 >> 32))
+
+
+
+static __thread char *scan_buffer = NULL;
+static __thread char *event_buffer = NULL;
+static __thread struct statbatch_entry_s *scan_stats = NULL;
+static __thread char *path_buffers[PATH_BUFFERS];
+static __thread size_t path_buffer_sizes[PATH_BUFFERS];
+static __thread int path_next_buffer = 0;
 static flag_t watch_dir_exit_now = 0;
-static char **excludes = NULL;
-static unsigned int exclude_count = 0;
 
 
 /*
- * Add the given watch descriptor to the directory index.
+ * Return a new zero-filled item from the given slab, adding a new chunk to
+ * the slab if there are no free items.
  */
-static void ds_watch_index_add(ds_dir_t dir, int wd)
+static void *ds_slab_alloc(ds_store_t store, struct ds_slab_s *slab)
 {
-	if (NULL == dir)
-		return;
-	if (0 > wd)
-		return;
-	if (NULL == dir->topdir)
-		return;
+	void *item;
+
+	if (NULL != slab->free_list) {
+		item = slab->free_list;
+		slab->free_list = *((void **) item);
+		memset(item, 0, slab->item_size);
+		return item;
+	}
 
 	/*
-	 * Extend the array if we need to.
+	 * The first few bytes of each chunk link it to the previous chunk,
+	 * so they can all be freed when the slab is destroyed.
 	 */
-	if (dir->topdir->watch_index_length >=
-	    dir->topdir->watch_index_alloced) {
-		int new_size;
-		ds_watch_index_t newptr;
-		new_size =
-		    dir->topdir->watch_index_alloced +
-		    DIR_INDEX_ALLOC_CHUNK;
-		newptr =
-		    realloc(dir->topdir->watch_index,
-			    new_size *
-			    sizeof(dir->topdir->watch_index[0]));
-		if (NULL == newptr) {
-			die("%s: %s", "realloc", strerror(errno));
-			return;
+	if ((NULL == slab->chunk)
+	    || (slab->chunk_used + slab->item_size > SLAB_CHUNK_SIZE)) {
+		char *chunk;
+		chunk = malloc(SLAB_CHUNK_SIZE);
+		if (NULL == chunk) {
+			die("%s: %s", "malloc", strerror(errno));
+			return NULL;
 		}
-		dir->topdir->watch_index = newptr;
-		dir->topdir->watch_index_alloced = new_size;
+		*((void **) chunk) = slab->chunks;
+		slab->chunks = chunk;
+		slab->chunk = chunk;
+		slab->chunk_used = sizeof(void *);
+		store->memory_used += SLAB_CHUNK_SIZE;
 	}
 
-	memset(&
-	       (dir->topdir->watch_index[dir->topdir->watch_index_length]),
-	       0, sizeof(dir->topdir->watch_index[0]));
+	item = slab->chunk + slab->chunk_used;
+	slab->chunk_used += slab->item_size;
+
+	memset(item, 0, slab->item_size);
+	return item;
+}
 
-	dir->topdir->watch_index[dir->topdir->watch_index_length].wd = wd;
-	dir->topdir->watch_index[dir->topdir->watch_index_length].dir =
-	    dir;
 
-	dir->topdir->watch_index_length++;
-	dir->topdir->watch_index_unsorted = 1;
+/*
+ * Return the given item to its slab.
+ */
+static void ds_slab_free(struct ds_slab_s *slab, void *item)
+{
+	if (NULL == item)
+		return;
+	*((void **) item) = slab->free_list;
+	slab->free_list = item;
 }
 
 
 /*
- * Remove the given watch descriptor from the directory index.
+ * Free all of the memory belonging to the given slab.
  */
-static void ds_watch_index_remove(ds_dir_t topdir, int wd)
+static void ds_slab_destroy(struct ds_slab_s *slab)
 {
-	int readidx, writeidx;
+	while (NULL != slab->chunks) {
+		void *next;
+		next = *((void **) slab->chunks);
+		free(slab->chunks);
+		slab->chunks = next;
+	}
+	slab->chunk = NULL;
+	slab->chunk_used = 0;
+	slab->free_list = NULL;
+}
 
-	if (NULL == topdir)
-		return;
 
-	for (readidx = 0, writeidx = 0;
-	     readidx < topdir->watch_index_length; readidx++) {
-		if (topdir->watch_index[readidx].wd == wd) {
-			continue;
+/*
+ * Move all of the chunks and free items of slab "from" into "slab", leaving
+ * "from" empty.  Any unused space at the end of the chunk "from" was
+ * carving up is not reused.
+ */
+static void ds_slab_merge(struct ds_slab_s *slab, struct ds_slab_s *from)
+{
+	void **tail;
+
+	if (NULL != from->chunks) {
+		for (tail = from->chunks; NULL != *tail; tail = *tail) {
 		}
-		if (readidx != writeidx) {
-			topdir->watch_index[writeidx] =
-			    topdir->watch_index[readidx];
+		*tail = slab->chunks;
+		slab->chunks = from->chunks;
+	}
+
+	if (NULL != from->free_list) {
+		for (tail = from->free_list; NULL != *tail; tail = *tail) {
 		}
-		writeidx++;
+		*tail = slab->free_list;
+		slab->free_list = from->free_list;
 	}
-	topdir->watch_index_length = writeidx;
-	topdir->watch_index_unsorted = 1;
+
+	from->chunks = NULL;
+	from->chunk = NULL;
+	from->chunk_used = 0;
+	from->free_list = NULL;
 }
 
 
 /*
- * Comparison function for the directory index.
+ * Initialise an empty store.
  */
-static int ds_watch_index_compare(const void *a, const void *b)
+static void ds_store_init(ds_store_t store)
 {
-	if (((ds_watch_index_t) a)->wd < ((ds_watch_index_t) b)->wd)
-		return -1;
-	if (((ds_watch_index_t) a)->wd > ((ds_watch_index_t) b)->wd)
-		return 1;
-	return 0;
+	int slabidx;
+
+	memset(store, 0, sizeof(*store));
+	store->file_slab.item_size = sizeof(struct ds_file_s);
+	store->dir_slab.item_size = sizeof(struct ds_dir_s);
+	for (slabidx = 0; slabidx < NAME_SLAB_CLASSES; slabidx++) {
+		store->name_slab[slabidx].item_size =
+		    (slabidx + 1) * NAME_SLAB_STEP;
+	}
 }
 
 
 /*
- * Return the directory structure associated with the given watch
- * descriptor, or NULL if none.
+ * Free all of the memory belonging to the given store.  Leafnames too long
+ * for the slabs are not freed, so the tree should be emptied first.
  */
-static ds_dir_t ds_watch_index_lookup(ds_dir_t topdir, int wd)
+static void ds_store_destroy(ds_store_t store)
 {
-	struct ds_watch_index_s key;
-	ds_watch_index_t result;
+	int slabidx;
 
-	if (NULL == topdir)
-		return NULL;
-	if (NULL == topdir->watch_index)
-		return NULL;
+	ds_slab_destroy(&(store->file_slab));
+	ds_slab_destroy(&(store->dir_slab));
+	for (slabidx = 0; slabidx < NAME_SLAB_CLASSES; slabidx++) {
+		ds_slab_destroy(&(store->name_slab[slabidx]));
+	}
+}
+
+
+/*
+ * Move everything allocated from store "from" into "store", so that it can
+ * be freed back to "store" later, leaving "from" empty.
+ */
+static void ds_store_merge(ds_store_t store, ds_store_t from)
+{
+	int slabidx;
 
-	if ((topdir->watch_index_unsorted)
-	    && (topdir->watch_index_length > 0)) {
-		qsort(topdir->watch_index, topdir->watch_index_length,
-		      sizeof(topdir->watch_index[0]),
-		      ds_watch_index_compare);
-		topdir->watch_index_unsorted = 0;
+	ds_slab_merge(&(store->file_slab), &(from->file_slab));
+	ds_slab_merge(&(store->dir_slab), &(from->dir_slab));
+	for (slabidx = 0; slabidx < NAME_SLAB_CLASSES; slabidx++) {
+		ds_slab_merge(&(store->name_slab[slabidx]),
+			      &(from->name_slab[slabidx]));
 	}
 
-	key.wd = wd;
-	result =
-	    bsearch(&key, topdir->watch_index, topdir->watch_index_length,
-		    sizeof(topdir->watch_index[0]),
-		    ds_watch_index_compare);
+	store->file_count += from->file_count;
+	store->dir_count += from->dir_count;
+	store->memory_used += from->memory_used;
+
+	from->file_count = 0;
+	from->dir_count = 0;
+	from->memory_used = 0;
+}
+
+
+/*
+ * Return a copy of the given leafname, stored in the slab for its size, or
+ * individually allocated if it is too long for any of the slabs.
+ */
+static char *ds_name_store(ds_store_t store, const char *name)
+{
+	size_t size;
+	int slabidx;
+	char *copy;
+
+	size = strlen(name) + 1;
+	slabidx = (size - 1) / NAME_SLAB_STEP;
+
+	if (slabidx >= NAME_SLAB_CLASSES) {
+		copy = xstrdup(name);
+		store->memory_used += size;
+		return copy;
+	}
 
-	if (NULL == result)
+	copy = ds_slab_alloc(store, &(store->name_slab[slabidx]));
+	if (NULL == copy)
 		return NULL;
+	memcpy(copy, name, size);
 
-	return result->dir;
+	return copy;
 }
 
 
 /*
- * Add an entry to the change queue.
+ * Free a leafname stored by ds_name_store().
  */
-static void _ds_change_queue_add(ds_dir_t topdir, time_t when,
-				 ds_file_t file, ds_dir_t dir)
+static void ds_name_free(ds_store_t store, char *name)
 {
-	int idx;
+	size_t size;
+	int slabidx;
 
-	if (NULL == topdir)
+	if (NULL == name)
 		return;
 
-	if ((NULL == file) && (NULL == dir))
+	size = strlen(name) + 1;
+	slabidx = (size - 1) / NAME_SLAB_STEP;
+
+	if (slabidx >= NAME_SLAB_CLASSES) {
+		free(name);
+		store->memory_used -= size;
 		return;
+	}
+
+	ds_slab_free(&(store->name_slab[slabidx]), name);
+}
+
+
+/*
+ * Return the path of the item called "leaf" inside the directory "dir",
+ * or of "dir" itself if "leaf" is NULL.  The path is relative to the top
+ * level directory, unless "absolute" is nonzero; the relative path of the
+ * top level directory is "".
+ *
+ * The path is built in one of a small rotating set of static buffers, so
+ * it is only valid until ds_path() has been called a few more times; this
+ * lets a single debug() call use more than one path.  Each thread has its
+ * own set of buffers.
+ */
+static const char *ds_path(ds_dir_t dir, const char *leaf, flag_t absolute)
+{
+	ds_dir_t ptr;
+	size_t length, pos, leaflen;
+	char *buf;
+	int bufidx;
+
+	if (NULL == dir)
+		return NULL == leaf ? "" : leaf;
 
 	/*
-	 * Check the change isn't already queued - don't queue it twice.
+	 * Work out how long the path will be.
 	 */
-	for (idx = 0; idx < topdir->change_queue_length; idx++) {
-		if (NULL != file) {
-			if (topdir->change_queue[idx].file == file)
-				return;
-		}
-		if (NULL != dir) {
-			if (topdir->change_queue[idx].dir == dir)
-				return;
-		}
+	length = 0;
+	if (NULL != leaf)
+		length = strlen(leaf);
+	for (ptr = dir; NULL != ptr->parent; ptr = ptr->parent) {
+		if (0 < length)
+			length++;
+		length += strlen(ptr->leaf);
+	}
+	if ((absolute) && (NULL != dir->context)) {
+		if (0 < length)
+			length++;
+		length += dir->context->absolute_path_length;
 	}
 
-	/*
-	 * Extend the array if necessary.
-	 */
-	if (topdir->change_queue_length >= topdir->change_queue_alloced) {
-		int new_size;
-		ds_change_queue_t newptr;
-		new_size =
-		    topdir->change_queue_alloced +
-		    CHANGE_QUEUE_ALLOC_CHUNK;
-		newptr =
-		    realloc(topdir->change_queue,
-			    new_size * sizeof(topdir->change_queue[0]));
+	bufidx = path_next_buffer;
+	path_next_buffer = (path_next_buffer + 1) % PATH_BUFFERS;
+
+	if (path_buffer_sizes[bufidx] < length + 1) {
+		char *newptr;
+		newptr = realloc(path_buffers[bufidx], length + 1);
 		if (NULL == newptr) {
 			die("%s: %s", "realloc", strerror(errno));
-			return;
+			return "";
 		}
-		topdir->change_queue = newptr;
-		topdir->change_queue_alloced = new_size;
+		path_buffers[bufidx] = newptr;
+		path_buffer_sizes[bufidx] = length + 1;
 	}
-
-	debug("%s: %s: %s", "adding to change queue",
-	      NULL == file ? "scan directory" : "check file",
-	      NULL == file ? dir->path : file->path);
+	buf = path_buffers[bufidx];
 
 	/*
-	 * Add the new entry, and extend the length of the array.
+	 * Fill the buffer in from the end backwards.
 	 */
-	topdir->change_queue[topdir->change_queue_length].when = when;
-	topdir->change_queue[topdir->change_queue_length].file = file;
-	topdir->change_queue[topdir->change_queue_length].dir = dir;
+	pos = length;
+	buf[pos] = '\0';
+	if (NULL != leaf) {
+		leaflen = strlen(leaf);
+		pos -= leaflen;
+		memcpy(buf + pos, leaf, leaflen);
+	}
+	for (ptr = dir; NULL != ptr->parent; ptr = ptr->parent) {
+		if (pos < length)
+			buf[--pos] = '/';
+		leaflen = strlen(ptr->leaf);
+		pos -= leaflen;
+		memcpy(buf + pos, ptr->leaf, leaflen);
+	}
+	if ((absolute) && (NULL != dir->context)) {
+		if (pos < length)
+			buf[--pos] = '/';
+		pos -= dir->context->absolute_path_length;
+		memcpy(buf + pos, dir->context->absolute_path,
+		       dir->context->absolute_path_length);
+	}
 
-	topdir->change_queue_length++;
+	return buf;
 }
 
 
 /*
- * Queue a file check.
+ * Free the calling thread's ds_path() buffers.
  */
-static void ds_change_queue_file_add(ds_file_t file, time_t when)
+static void ds_path_release(void)
 {
-	if (NULL == file)
-		return;
-	if (NULL == file->parent)
-		return;
-	if (NULL == file->parent->topdir)
-		return;
+	int bufidx;
+
+	for (bufidx = 0; bufidx < PATH_BUFFERS; bufidx++) {
+		if (NULL != path_buffers[bufidx])
+			free(path_buffers[bufidx]);
+		path_buffers[bufidx] = NULL;
+		path_buffer_sizes[bufidx] = 0;
+	}
+	path_next_buffer = 0;
+}
 
-	if (0 == when)
-		when = time(NULL) + 2;
 
-	/* TODO: delay scan more if the file is big */
-	_ds_change_queue_add(file->parent->topdir, when, file, NULL);
+/*
+ * Return the home slot of the given watch descriptor in a watch index of
+ * the given size, which must be a power of 2.  Watch descriptors are
+ * handed out in sequence by the kernel, so they are scattered with a
+ * multiplicative hash to avoid long runs of occupied slots.
+ */
+static int ds_watch_index_slot(int wd, int size)
+{
+	return (int) (((unsigned int) wd * 2654435761U) & (size - 1));
 }
 
 
 /*
- * Remove a file from the change queue.
+ * Resize the watch index to the given number of slots (a power of 2),
+ * re-inserting all existing entries.
  */
-static void ds_change_queue_file_remove(ds_file_t file)
+static void ds_watch_index_resize(ds_context_t context, int new_size)
 {
-	ds_dir_t topdir;
-	int idx;
+	ds_watch_index_t old_index;
+	ds_watch_index_t new_index;
+	int old_size, idx;
 
-	if (NULL == file)
-		return;
-	if (NULL == file->parent)
-		return;
-	if (NULL == file->parent->topdir)
+	new_index = calloc(new_size, sizeof(context->watch_index[0]));
+	if (NULL == new_index) {
+		die("%s: %s", "calloc", strerror(errno));
 		return;
+	}
 
-	topdir = file->parent->topdir;
+	old_index = context->watch_index;
+	old_size = context->watch_index_alloced;
 
-	for (idx = 0; idx < topdir->change_queue_length; idx++) {
-		if (topdir->change_queue[idx].file == file) {
-			topdir->change_queue[idx].file = NULL;
-		}
+	for (idx = 0; idx < old_size; idx++) {
+		int slot;
+		if (NULL == old_index[idx].dir)
+			continue;
+		slot = ds_watch_index_slot(old_index[idx].wd, new_size);
+		while (NULL != new_index[slot].dir)
+			slot = (slot + 1) & (new_size - 1);
+		new_index[slot] = old_index[idx];
 	}
+
+	if (NULL != old_index)
+		free(old_index);
+
+	context->store.memory_used +=
+	    (new_size - old_size) * sizeof(context->watch_index[0]);
+	context->watch_index = new_index;
+	context->watch_index_alloced = new_size;
 }
 
 
 /*
- * Queue a directory scan.
+ * Add the given watch descriptor to the directory index.  If the watch
+ * descriptor is already present (the kernel hands back the same one if the
+ * same inode is watched twice), its entry is replaced.
+ *
+ * If "handle" is not NULL, it is the directory's fanotify file handle,
+ * which is also added to the handle index; the watch index takes over the
+ * handle, and frees it when the watch descriptor is removed, or when it is
+ * replaced by another handle for the same watch descriptor.
  */
-static void ds_change_queue_dir_add(ds_dir_t dir, time_t when)
+static void ds_watch_index_add(ds_dir_t dir, int wd,
+			       struct file_handle *handle)
 {
+	ds_context_t context;
+	int slot;
+
 	if (NULL == dir)
 		return;
-	if (NULL == dir->topdir)
+	if (0 > wd)
+		return;
+	if (NULL == dir->context)
 		return;
-	if (0 == when)
-		when = time(NULL);
-	_ds_change_queue_add(dir->topdir, when, NULL, dir);
-}
 
+	context = dir->context;
 
-/*
- * Remove a directory from the change queue.
- */
-static void ds_change_queue_dir_remove(ds_dir_t dir)
+	/*
+	 * Keep the table at most half full, so that probe sequences stay
+	 * short.
+	 */
+	if (2 * (context->watch_index_length + 1) >
+	    context->watch_index_alloced) {
+		int new_size;
+		new_size = context->watch_index_alloced * 2;
+		if (new_size < DIR_INDEX_MIN_SLOTS)
+			new_size = DIR_INDEX_MIN_SLOTS;
+		ds_watch_index_resize(context, new_size);
+	}
+
+	slot = ds_watch_index_slot(wd, context->watch_index_alloced);
+	while ((NULL != context->watch_index[slot].dir)
+	       && (context->watch_index[slot].wd != wd)) {
+		slot = (slot + 1) & (context->watch_index_alloced - 1);
+	}
+
+	if (NULL == context->watch_index[slot].dir) {
+		context->watch_index[slot].wd = wd;
+		context->watch_index[slot].handle = NULL;
+		context->watch_index_length++;
+	}
+	context->watch_index[slot].dir = dir;
+
+	if (NULL == handle)
+		return;
+
+	/*
+	 * Drop any handle the entry already had before adding the new one
+	 * to the handle index, so that removing the old one can't remove an
+	 * index entry that already points to the new one.
+	 */
+	if (NULL != context->watch_index[slot].handle) {
+		struct file_handle *old = context->watch_index[slot].handle;
+		ds_handle_index_remove(context, old, wd);
+		context->store.memory_used -=
+		    sizeof(*old) + old->handle_bytes;
+		free(old);
+	}
+
+	context->watch_index[slot].handle = handle;
+	ds_handle_index_add(context, handle, wd);
+}
+
+
+/*
+ * Remove the given watch descriptor from the directory index.
+ *
+ * Instead of leaving a tombstone, later entries in the same probe run are
+ * shifted back into the gap if their home slot allows it, so lookups never
+ * have to step over deleted slots.
+ */
+static void ds_watch_index_remove(ds_context_t context, int wd)
 {
-	int idx;
+	int mask, slot, next;
 
-	if (NULL == dir)
+	if (NULL == context)
 		return;
-	if (NULL == dir->topdir)
+	if (NULL == context->watch_index)
 		return;
 
-	for (idx = 0; idx < dir->topdir->change_queue_length; idx++) {
-		if (dir->topdir->change_queue[idx].dir == dir) {
-			dir->topdir->change_queue[idx].dir = NULL;
-		}
+	mask = context->watch_index_alloced - 1;
+
+	slot = ds_watch_index_slot(wd, context->watch_index_alloced);
+	while (NULL != context->watch_index[slot].dir) {
+		if (context->watch_index[slot].wd == wd)
+			break;
+		slot = (slot + 1) & mask;
+	}
+	if (NULL == context->watch_index[slot].dir)
+		return;
+
+	if (NULL != context->watch_index[slot].handle) {
+		struct file_handle *handle = context->watch_index[slot].handle;
+		ds_handle_index_remove(context, handle, wd);
+		context->store.memory_used -=
+		    sizeof(*handle) + handle->handle_bytes;
+		free(handle);
+	}
+
+	for (next = (slot + 1) & mask;
+	     NULL != context->watch_index[next].dir;
+	     next = (next + 1) & mask) {
+		int home;
+		home =
+		    ds_watch_index_slot(context->watch_index[next].wd,
+					context->watch_index_alloced);
+		/*
+		 * Leave this entry where it is if its home slot lies
+		 * cyclically in (slot, next], since moving it would put it
+		 * before its home.
+		 */
+		if (((next - home) & mask) < ((next - slot) & mask))
+			continue;
+		context->watch_index[slot] = context->watch_index[next];
+		slot = next;
 	}
+
+	context->watch_index[slot].wd = -1;
+	context->watch_index[slot].dir = NULL;
+	context->watch_index[slot].handle = NULL;
+	context->watch_index_length--;
 }
 
 
 /*
- * Add a file to the list of files in the given directory; if the file is
- * already in the list, return the existing file.
- *
- * The "name" string should contain the name of the file relative to the
- * directory (not the full path), e.g. "somefile".
- *
- * Returns the file, or NULL on error.
+ * Return the directory structure associated with the given watch
+ * descriptor, or NULL if none.
  */
-static ds_file_t ds_file_add(ds_dir_t dir, const char *name)
+static ds_dir_t ds_watch_index_lookup(ds_context_t context, int wd)
 {
-	ds_file_t file;
-	int idx;
+	int slot;
 
-	if (NULL == dir)
-		return NULL;
-	if (NULL == name)
+	if (NULL == context)
 		return NULL;
-	if (NULL == dir->absolute_path)
+	if (NULL == context->watch_index)
 		return NULL;
 
-
-	/*
-	 * Check we don't already have this file in this directory - if we
-	 * do, return the existing file.
-	 */
-	for (idx = 0; idx < dir->file_count; idx++) {
-		if (strcmp(dir->files[idx]->leaf, name) == 0) {
-			return dir->files[idx];
-		}
+	slot = ds_watch_index_slot(wd, context->watch_index_alloced);
+	while (NULL != context->watch_index[slot].dir) {
+		if (context->watch_index[slot].wd == wd)
+			return context->watch_index[slot].dir;
+		slot = (slot + 1) & (context->watch_index_alloced - 1);
 	}
 
-	/*
-	 * Extend the file array in the directory structure if we need to.
-	 */
-	if (dir->file_count >= dir->file_array_alloced) {
-		int target_array_alloced;
-		void *newptr;
+	return NULL;
+}
 
-		target_array_alloced = dir->file_array_alloced;
-		while (target_array_alloced <= dir->file_count) {
-			target_array_alloced += DIRCONTENTS_ALLOC_CHUNK;
-		}
-		newptr =
-		    realloc((void *) (dir->files),
-			    target_array_alloced * sizeof(dir->files[0]));
-		if (NULL == newptr) {
-			die("%s: %s", "realloc", strerror(errno));
-			return NULL;
-		}
-		dir->files = newptr;
-		dir->file_array_alloced = target_array_alloced;
+
+/*
+ * Return a hash of the given file handle.
+ */
+static unsigned int ds_handle_hash(const struct file_handle *handle)
+{
+	unsigned int hash = 2166136261U;
+	unsigned int idx;
+
+	hash = (hash ^ (unsigned int) (handle->handle_type)) * 16777619U;
+	for (idx = 0; idx < handle->handle_bytes; idx++) {
+		hash = (hash ^ handle->f_handle[idx]) * 16777619U;
 	}
 
-	/*
-	 * Allocate a new file structure.
-	 */
-	file = calloc(1, sizeof(*file));
-	if (NULL == file) {
+	return hash;
+}
+
+
+/*
+ * Return nonzero if the two file handles are the same.
+ */
+static int ds_handle_equal(const struct file_handle *a,
+			   const struct file_handle *b)
+{
+	if (a->handle_type != b->handle_type)
+		return 0;
+	if (a->handle_bytes != b->handle_bytes)
+		return 0;
+	return memcmp(a->f_handle, b->f_handle, a->handle_bytes) == 0 ? 1 : 0;
+}
+
+
+/*
+ * Resize the handle index to the given number of slots (a power of 2),
+ * re-inserting all existing entries.
+ */
+static void ds_handle_index_resize(ds_context_t context, int new_size)
+{
+	ds_handle_index_t old_index;
+	ds_handle_index_t new_index;
+	int old_size, idx;
+
+	new_index = calloc(new_size, sizeof(context->handle_index[0]));
+	if (NULL == new_index) {
 		die("%s: %s", "calloc", strerror(errno));
-		return NULL;
+		return;
 	}
 
-	/*
-	 * Fill in the file structure.
-	 */
-	if (asprintf
-	    (&(file->absolute_path), "%s/%s", dir->absolute_path,
-	     name) < 0) {
-		die("%s: %s", "asprintf", strerror(errno));
-		free(file);
-		return NULL;
-	}
-	if (NULL != dir->topdir) {
-		file->path =
-		    &(file->absolute_path
-		      [strlen(dir->topdir->absolute_path) + 1]);
-	} else {
-		file->path =
-		    &(file->absolute_path[strlen(dir->absolute_path) + 1]);
+	old_index = context->handle_index;
+	old_size = context->handle_index_alloced;
+
+	for (idx = 0; idx < old_size; idx++) {
+		int slot;
+		if (NULL == old_index[idx].handle)
+			continue;
+		slot = old_index[idx].hash & (new_size - 1);
+		while (NULL != new_index[slot].handle)
+			slot = (slot + 1) & (new_size - 1);
+		new_index[slot] = old_index[idx];
 	}
-	file->leaf = ds_leafname(file->absolute_path);
-	file->parent = dir;
-	file->seen_in_rescan = 0;
 
-	/*
-	 * Add the file to the directory structure, and mark the list as
-	 * unsorted.
-	 */
-	dir->files[dir->file_count] = file;
-	dir->file_count++;
-	dir->files_unsorted = 1;
+	if (NULL != old_index)
+		free(old_index);
 
-	return file;
+	context->store.memory_used +=
+	    (new_size - old_size) * sizeof(context->handle_index[0]);
+	context->handle_index = new_index;
+	context->handle_index_alloced = new_size;
 }
 
 
 /*
- * Free a file information structure and its contents.
- *
- * The parent directory's "files" list is updated to remove this file from
- * it.
+ * Add the given file handle to the handle index, pointing to watch
+ * descriptor "wd".  If the handle is already present, because the
+ * directory is being tracked under a new name before the old one has been
+ * removed, its entry is replaced.
  */
-static void ds_file_remove(ds_file_t file)
+static void ds_handle_index_add(ds_context_t context,
+				struct file_handle *handle, int wd)
 {
-	if (NULL == file)
-		return;
-	if (NULL == file->path)
-		return;
+	unsigned int hash;
+	int slot;
 
-	/*
-	 * Remove this file from our parent directory's file listing, if we
-	 * have a parent.
-	 */
-	if ((NULL != file->parent) && (NULL != file->leaf)) {
-		int readidx, writeidx;
-		for (readidx = 0, writeidx = 0;
-		     readidx < file->parent->file_count; readidx++) {
-			if ((NULL != file->parent->files[readidx]->leaf)
-			    &&
-			    (strcmp
-			     (file->parent->files[readidx]->leaf,
-			      file->leaf) == 0)
-			    ) {
-				continue;
-			}
-			if (readidx != writeidx) {
-				file->parent->files[writeidx] =
-				    file->parent->files[readidx];
-			}
-			writeidx++;
+	if (2 * (context->handle_index_length + 1) >
+	    context->handle_index_alloced) {
+		int new_size;
+		new_size = context->handle_index_alloced * 2;
+		if (new_size < DIR_INDEX_MIN_SLOTS)
+			new_size = DIR_INDEX_MIN_SLOTS;
+		ds_handle_index_resize(context, new_size);
+	}
+
+	hash = ds_handle_hash(handle);
+	slot = hash & (context->handle_index_alloced - 1);
+	while (NULL != context->handle_index[slot].handle) {
+		if ((context->handle_index[slot].hash == hash)
+		    && ds_handle_equal(context->handle_index[slot].handle,
+				       handle)) {
+			context->handle_index[slot].handle = handle;
+			context->handle_index[slot].wd = wd;
+			return;
 		}
-		file->parent->file_count = writeidx;
-		file->parent->files_unsorted = 1;
+		slot = (slot + 1) & (context->handle_index_alloced - 1);
 	}
 
-	/* Remove the file from the change queue. */
-	ds_change_queue_file_remove(file);
+	context->handle_index[slot].hash = hash;
+	context->handle_index[slot].wd = wd;
+	context->handle_index[slot].handle = handle;
+	context->handle_index_length++;
+}
 
-	/*
-	 * Free the memory used by the pathname.
-	 */
-	debug("%s: %s", file->path, "removing from file list");
-	free(file->absolute_path);
-	file->absolute_path = NULL;
-	file->path = NULL;
-	file->leaf = NULL;
 
-	/* Free the file structure itself. */
-	free(file);
+/*
+ * Remove the given file handle from the handle index, if it still points
+ * to watch descriptor "wd".  Later entries in the same probe run are
+ * shifted back into the gap, as in ds_watch_index_remove().
+ */
+static void ds_handle_index_remove(ds_context_t context,
+				   const struct file_handle *handle, int wd)
+{
+	unsigned int hash;
+	int mask, slot, next;
+
+	if (NULL == context->handle_index)
+		return;
+
+	mask = context->handle_index_alloced - 1;
+
+	hash = ds_handle_hash(handle);
+	slot = hash & mask;
+	while (NULL != context->handle_index[slot].handle) {
+		if ((context->handle_index[slot].hash == hash)
+		    && ds_handle_equal(context->handle_index[slot].handle,
+				       handle))
+			break;
+		slot = (slot + 1) & mask;
+	}
+	if (NULL == context->handle_index[slot].handle)
+		return;
+	if (context->handle_index[slot].wd != wd)
+		return;
+
+	for (next = (slot + 1) & mask;
+	     NULL != context->handle_index[next].handle;
+	     next = (next + 1) & mask) {
+		int home;
+		home = context->handle_index[next].hash & mask;
+		if (((next - home) & mask) < ((next - slot) & mask))
+			continue;
+		context->handle_index[slot] = context->handle_index[next];
+		slot = next;
+	}
+
+	context->handle_index[slot].wd = -1;
+	context->handle_index[slot].handle = NULL;
+	context->handle_index_length--;
 }
 
 
 /*
- * Check the given file's mtime and size; if either have changed, return 1.
- *
- * Returns 0 if nothing has changed, 1 if it has, or -1 if the file does not
- * exist or is not a regular file.
- *
- * If the file is successfully opened but there is an error while reading
- * it, 0 is returned as if it had not changed.
+ * Return the watch descriptor of the directory with the given file handle,
+ * or -1 if none.
  */
-static int ds_file_checkchanged(ds_file_t file)
+static int ds_handle_index_lookup(ds_context_t context,
+				  const struct file_handle *handle)
 {
-	struct stat sb;
-
-	if (NULL == file)
-		return -1;
+	unsigned int hash;
+	int slot;
 
-	if (NULL == file->absolute_path)
+	if (NULL == context->handle_index)
 		return -1;
 
-	if (lstat(file->absolute_path, &sb) != 0)
-		return -1;
+	hash = ds_handle_hash(handle);
+	slot = hash & (context->handle_index_alloced - 1);
+	while (NULL != context->handle_index[slot].handle) {
+		if ((context->handle_index[slot].hash == hash)
+		    && ds_handle_equal(context->handle_index[slot].handle,
+				       handle))
+			return context->handle_index[slot].wd;
+		slot = (slot + 1) & (context->handle_index_alloced - 1);
+	}
 
-	if (!S_ISREG(sb.st_mode))
-		return -1;
+	return -1;
+}
 
-	if ((sb.st_mtime == file->mtime) && (sb.st_size == file->size))
-		return 0;
 
-	debug("%s: %s", file->path, "file changed");
+/*
+ * Return nonzero if change queue entry "a" is due before entry "b".  Entries
+ * due at the same time are kept in the order they were added.
+ */
+static int ds_change_queue_before(ds_change_queue_t a, ds_change_queue_t b)
+{
+	if (a->when != b->when)
+		return a->when < b->when ? 1 : 0;
+	return a->sequence < b->sequence ? 1 : 0;
+}
 
-	file->mtime = sb.st_mtime;
-	file->size = sb.st_size;
 
-	return 1;
+/*
+ * Store the given entry at the given position in the change queue heap,
+ * updating the queue position recorded in its file or directory.
+ */
+static void ds_change_queue_put(ds_context_t context, int idx,
+				ds_change_queue_t entry)
+{
+	if (&(context->change_queue[idx]) != entry)
+		context->change_queue[idx] = *entry;
+	if (NULL != entry->file)
+		entry->file->queue_position = idx + 1;
+	if (NULL != entry->dir)
+		entry->dir->queue_position = idx + 1;
 }
 
 
 /*
- * Allocate and return a new top-level directory absolutely rooted at
- * "top_path".  All reported paths within the structure will be relative to
- * "top_path".
- *
- * The "fd_inotify" parameter should be the file descriptor to add directory
- * watches to for inoitfy, or -1 if inotify is not being used.
+ * Move the change queue entry at the given heap position up or down until
+ * the heap is back in order.
  */
-static ds_dir_t ds_dir_toplevel(int fd_inotify, const char *top_path)
+static void ds_change_queue_reheap(ds_context_t context, int idx)
 {
-	ds_dir_t dir;
+	struct ds_change_queue_s entry;
 
-	dir = calloc(1, sizeof(*dir));
-	if (NULL == dir) {
-		die("%s: %s", "calloc", strerror(errno));
-		return NULL;
+	entry = context->change_queue[idx];
+
+	/*
+	 * Move the entry up towards the root while it is due before its
+	 * parent.
+	 */
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+		if (!ds_change_queue_before
+		    (&entry, &(context->change_queue[parent])))
+			break;
+		ds_change_queue_put(context, idx,
+				    &(context->change_queue[parent]));
+		idx = parent;
 	}
 
-	dir->absolute_path = realpath(top_path, NULL);
-	if (NULL == dir->absolute_path) {
-		die("%s: %s", "realpath", strerror(errno));
-		free(dir);
-		return NULL;
+	/*
+	 * Move the entry down towards the leaves while either child is due
+	 * before it.
+	 */
+	while (1) {
+		int child = 2 * idx + 1;
+		if (child >= context->change_queue_length)
+			break;
+		if ((child + 1 < context->change_queue_length)
+		    &&
+		    ds_change_queue_before(&(context->change_queue[child + 1]),
+					   &(context->change_queue[child])))
+			child++;
+		if (!ds_change_queue_before
+		    (&(context->change_queue[child]), &entry))
+			break;
+		ds_change_queue_put(context, idx,
+				    &(context->change_queue[child]));
+		idx = child;
 	}
 
-	dir->path = &(dir->absolute_path[strlen(dir->absolute_path)]);
-	dir->leaf = dir->path;
-	dir->wd = -1;
-	dir->depth = 0;
-	dir->parent = NULL;
-	dir->topdir = dir;
-	dir->seen_in_rescan = 0;
+	ds_change_queue_put(context, idx, &entry);
+}
 
-	dir->fd_inotify = fd_inotify;
 
-	return dir;
+/*
+ * Remove the entry at the given position from the change queue heap.
+ */
+static void ds_change_queue_delete(ds_context_t context, int idx)
+{
+	ds_change_queue_t entry;
+
+	entry = &(context->change_queue[idx]);
+	if (NULL != entry->file)
+		entry->file->queue_position = 0;
+	if (NULL != entry->dir)
+		entry->dir->queue_position = 0;
+
+	context->change_queue_length--;
+	if (idx == context->change_queue_length)
+		return;
+
+	context->change_queue[idx] =
+	    context->change_queue[context->change_queue_length];
+	ds_change_queue_reheap(context, idx);
 }
 
 
 /*
- * Add a subdirectory to the list of subdirectories in the given parent
- * directory; if the subdirectory is already in the list, just return the
- * existing subdirectory.
- *
- * The "name" string should contain the name of the directory relative to
- * the parent directory (not the full path), e.g. "somedir".
+ * Add an entry to the change queue.
  *
- * Returns the subdirectory, or NULL on error.
+ * The queue is a binary heap ordered by the time each entry is due, and
+ * every queued file or directory records its position in the heap, so
+ * duplicates can be spotted and entries removed without searching.
  */
-static ds_dir_t ds_dir_add(ds_dir_t dir, const char *name)
+static void _ds_change_queue_add(ds_context_t context, time_t when,
+				 ds_file_t file, ds_dir_t dir)
 {
-	ds_dir_t subdir;
+	ds_change_queue_t entry;
 	int idx;
 
-	if (NULL == dir)
-		return NULL;
-	if (NULL == name)
-		return NULL;
+	if (NULL == context)
+		return;
 
-	/*
-	 * Check that this subdirectory wouldn't be too deep.
-	 */
-	if (dir->depth >= max_directory_depth) {
-		debug("%s/%s: %s", dir->path, name,
-		      "too deep - not adding");
-		return NULL;
-	}
+	if ((NULL == file) && (NULL == dir))
+		return;
 
 	/*
-	 * Check we don't already have this subdirectory in the directory
-	 * structure - if we do, return the existing structure.
+	 * Check the change isn't already queued - don't queue it twice, but
+	 * if it is now wanted sooner, move it forward.
 	 */
-	for (idx = 0; idx < dir->subdir_count; idx++) {
-		if (strcmp(dir->subdirs[idx]->leaf, name) == 0) {
-			return dir->subdirs[idx];
+	if ((NULL != file) && (0 != file->queue_position))
+		idx = file->queue_position - 1;
+	else if ((NULL != dir) && (0 != dir->queue_position))
+		idx = dir->queue_position - 1;
+	else
+		idx = -1;
+	if (0 <= idx) {
+		if (when < context->change_queue[idx].when) {
+			context->change_queue[idx].when = when;
+			ds_change_queue_reheap(context, idx);
 		}
+		return;
 	}
 
 	/*
-	 * Extend the subdirectory array in the directory structure if we
-	 * need to.
+	 * Extend the array if necessary.
 	 */
-	if (dir->subdir_count >= dir->subdir_array_alloced) {
-		int target_array_alloced;
-		void *newptr;
-
-		target_array_alloced = dir->subdir_array_alloced;
-		while (target_array_alloced <= dir->subdir_count) {
-			target_array_alloced += DIRCONTENTS_ALLOC_CHUNK;
-		}
+	if (context->change_queue_length >= context->change_queue_alloced) {
+		int new_size;
+		ds_change_queue_t newptr;
+		new_size =
+		    context->change_queue_alloced +
+		    CHANGE_QUEUE_ALLOC_CHUNK;
 		newptr =
-		    realloc((void *) (dir->subdirs),
-			    target_array_alloced *
-			    sizeof(dir->subdirs[0]));
+		    realloc(context->change_queue,
+			    new_size * sizeof(context->change_queue[0]));
 		if (NULL == newptr) {
 			die("%s: %s", "realloc", strerror(errno));
-			return NULL;
+			return;
 		}
-		dir->subdirs = newptr;
-		dir->subdir_array_alloced = target_array_alloced;
+		context->store.memory_used +=
+		    (new_size -
+		     context->change_queue_alloced) *
+		    sizeof(context->change_queue[0]);
+		context->change_queue = newptr;
+		context->change_queue_alloced = new_size;
 	}
 
-	/*
-	 * Allocate a new directory structure for the subdirectory.
-	 */
-	subdir = calloc(1, sizeof(*subdir));
-	if (NULL == subdir) {
-		die("%s: %s", "calloc", strerror(errno));
-		return NULL;
-	}
+	debug("%s: %s: %s", "adding to change queue",
+	      NULL == file ? "scan directory" : "check file",
+	      NULL == file ? ds_dir_path(dir) : ds_file_path(file));
 
 	/*
-	 * Fill in the new subdirectory structure.
+	 * Add the new entry to the end of the array, and then move it up
+	 * the heap to where it belongs.
 	 */
-	if (asprintf
-	    (&(subdir->absolute_path), "%s/%s", dir->absolute_path,
-	     name) < 0) {
+	entry = &(context->change_queue[context->change_queue_length]);
+	entry->when = when;
+	entry->sequence = context->change_queue_sequence++;
+	entry->file = file;
+	entry->dir = dir;
+
+	context->change_queue_length++;
+
+	ds_change_queue_reheap(context, context->change_queue_length - 1);
+}
+
+
+/*
+ * Queue a file check.
+ */
+static void ds_change_queue_file_add(ds_file_t file, time_t when)
+{
+	if (NULL == file)
+		return;
+	if (NULL == file->parent)
+		return;
+	if (NULL == file->parent->context)
+		return;
+
+	/*
+	 * Give writes a moment to finish; if the file is still changing
+	 * when it is checked, ds_file_settle_delay() decides how much
+	 * longer to wait for it.
+	 */
+	if (0 == when)
+		when = time(NULL) + 2;
+
+	_ds_change_queue_add(file->parent->context, when, file, NULL);
+}
+
+
+/*
+ * Remove a file from the change queue.
+ */
+static void ds_change_queue_file_remove(ds_file_t file)
+{
+	if (NULL == file)
+		return;
+	if (0 == file->queue_position)
+		return;
+	if (NULL == file->parent)
+		return;
+	if (NULL == file->parent->context)
+		return;
+
+	ds_change_queue_delete(file->parent->context,
+			       file->queue_position - 1);
+}
+
+
+/*
+ * Queue a directory scan.
+ */
+static void ds_change_queue_dir_add(ds_dir_t dir, time_t when)
+{
+	if (NULL == dir)
+		return;
+	if (NULL == dir->context)
+		return;
+	if (0 == when)
+		when = time(NULL);
+	_ds_change_queue_add(dir->context, when, NULL, dir);
+}
+
+
+/*
+ * Remove a directory from the change queue.
+ */
+static void ds_change_queue_dir_remove(ds_dir_t dir)
+{
+	if (NULL == dir)
+		return;
+	if (0 == dir->queue_position)
+		return;
+	if (NULL == dir->context)
+		return;
+
+	ds_change_queue_delete(dir->context, dir->queue_position - 1);
+}
+
+
+/*
+ * Return a hash of the given leafname, for the per-directory name hash
+ * tables (this is 32-bit FNV-1a).
+ */
+static unsigned int ds_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (name[0] != 0) {
+		hash ^= (unsigned char) (name[0]);
+		hash *= 16777619U;
+		name++;
+	}
+
+	return hash;
+}
+
+
+/*
+ * Rebuild the given directory's file hash table with enough buckets for
+ * its current number of files, accounting for the memory in the given
+ * store.  Directories with only a few files have no hash table at all, and
+ * are searched linearly instead.
+ */
+static void ds_file_hash_rebuild(ds_store_t store, ds_dir_t dir)
+{
+	int new_size, idx;
+	ds_file_t *newptr;
+
+	new_size = NAME_HASH_MIN_BUCKETS;
+	while (new_size <= dir->file_count)
+		new_size *= 2;
+
+	newptr = calloc(new_size, sizeof(dir->file_hash[0]));
+	if (NULL == newptr) {
+		die("%s: %s", "calloc", strerror(errno));
+		return;
+	}
+
+	if (NULL != dir->file_hash)
+		free(dir->file_hash);
+	store->memory_used +=
+	    (new_size - dir->file_hash_size) * sizeof(dir->file_hash[0]);
+	dir->file_hash = newptr;
+	dir->file_hash_size = new_size;
+
+	for (idx = 0; idx < dir->file_count; idx++) {
+		ds_file_t file = dir->files[idx];
+		int bucket = file->leaf_hash & (new_size - 1);
+		file->hash_next = dir->file_hash[bucket];
+		dir->file_hash[bucket] = file;
+	}
+}
+
+
+/*
+ * Rebuild the given directory's subdirectory hash table with enough
+ * buckets for its current number of subdirectories.
+ */
+static void ds_subdir_hash_rebuild(ds_store_t store, ds_dir_t dir)
+{
+	int new_size, idx;
+	ds_dir_t *newptr;
+
+	new_size = NAME_HASH_MIN_BUCKETS;
+	while (new_size <= dir->subdir_count)
+		new_size *= 2;
+
+	newptr = calloc(new_size, sizeof(dir->subdir_hash[0]));
+	if (NULL == newptr) {
+		die("%s: %s", "calloc", strerror(errno));
+		return;
+	}
+
+	if (NULL != dir->subdir_hash)
+		free(dir->subdir_hash);
+	store->memory_used +=
+	    (new_size - dir->subdir_hash_size) * sizeof(dir->subdir_hash[0]);
+	dir->subdir_hash = newptr;
+	dir->subdir_hash_size = new_size;
+
+	for (idx = 0; idx < dir->subdir_count; idx++) {
+		ds_dir_t subdir = dir->subdirs[idx];
+		int bucket = subdir->leaf_hash & (new_size - 1);
+		subdir->hash_next = dir->subdir_hash[bucket];
+		dir->subdir_hash[bucket] = subdir;
+	}
+}
+
+
+/*
+ * Return the file with the given leafname in the given directory, or NULL
+ * if there is no such file.
+ */
+static ds_file_t ds_file_lookup(ds_dir_t dir, const char *name)
+{
+	unsigned int hash;
+	ds_file_t file;
+
+	if (NULL == dir)
+		return NULL;
+	if (NULL == name)
+		return NULL;
+
+	hash = ds_name_hash(name);
+
+	if (NULL == dir->file_hash) {
+		int idx;
+		for (idx = 0; idx < dir->file_count; idx++) {
+			file = dir->files[idx];
+			if (file->leaf_hash != hash)
+				continue;
+			if (strcmp(file->leaf, name) != 0)
+				continue;
+			return file;
+		}
+		return NULL;
+	}
+
+	for (file = dir->file_hash[hash & (dir->file_hash_size - 1)];
+	     NULL != file; file = file->hash_next) {
+		if (file->leaf_hash != hash)
+			continue;
+		if (strcmp(file->leaf, name) != 0)
+			continue;
+		return file;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Return the subdirectory with the given leafname in the given directory,
+ * or NULL if there is no such subdirectory.  A subdirectory that has been
+ * moved away, and is waiting to see where to, no longer has that name, so
+ * it is never returned.
+ */
+static ds_dir_t ds_dir_lookup(ds_dir_t dir, const char *name)
+{
+	unsigned int hash;
+	ds_dir_t subdir;
+
+	if (NULL == dir)
+		return NULL;
+	if (NULL == name)
+		return NULL;
+
+	hash = ds_name_hash(name);
+
+	if (NULL == dir->subdir_hash) {
+		int idx;
+		for (idx = 0; idx < dir->subdir_count; idx++) {
+			subdir = dir->subdirs[idx];
+			if (subdir->leaf_hash != hash)
+				continue;
+			if (strcmp(subdir->leaf, name) != 0)
+				continue;
+			if (subdir->moved_away)
+				continue;
+			return subdir;
+		}
+		return NULL;
+	}
+
+	for (subdir = dir->subdir_hash[hash & (dir->subdir_hash_size - 1)];
+	     NULL != subdir; subdir = subdir->hash_next) {
+		if (subdir->leaf_hash != hash)
+			continue;
+		if (strcmp(subdir->leaf, name) != 0)
+			continue;
+		if (subdir->moved_away)
+			continue;
+		return subdir;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Add a file to the list of files in the given directory; if the file is
+ * already in the list, return the existing file.
+ *
+ * The "name" string should contain the name of the file relative to the
+ * directory (not the full path), e.g. "somefile".
+ *
+ * The file is allocated from the given store, or from the watch's own
+ * store if "store" is NULL.
+ *
+ * Returns the file, or NULL on error.
+ */
+static ds_file_t ds_file_add(ds_store_t store, ds_dir_t dir,
+			     const char *name)
+{
+	ds_file_t file;
+	int bucket;
+
+	if (NULL == dir)
+		return NULL;
+	if (NULL == name)
+		return NULL;
+	if (NULL == dir->context)
+		return NULL;
+
+	if (NULL == store)
+		store = &(dir->context->store);
+
+	/*
+	 * Check we don't already have this file in this directory - if we
+	 * do, return the existing file.
+	 */
+	file = ds_file_lookup(dir, name);
+	if (NULL != file)
+		return file;
+
+	if (ds_path_excluded(dir, name, 0))
+		return NULL;
+
+	/*
+	 * Extend the file array in the directory structure if we need to,
+	 * doubling its size each time.
+	 */
+	if (dir->file_count >= dir->file_array_alloced) {
+		int target_array_alloced;
+		void *newptr;
+
+		target_array_alloced = dir->file_array_alloced * 2;
+		if (target_array_alloced < DIRCONTENTS_MIN_ALLOC)
+			target_array_alloced = DIRCONTENTS_MIN_ALLOC;
+		newptr =
+		    realloc((void *) (dir->files),
+			    target_array_alloced * sizeof(dir->files[0]));
+		if (NULL == newptr) {
+			die("%s: %s", "realloc", strerror(errno));
+			return NULL;
+		}
+		store->memory_used +=
+		    (target_array_alloced -
+		     dir->file_array_alloced) * sizeof(dir->files[0]);
+		dir->files = newptr;
+		dir->file_array_alloced = target_array_alloced;
+	}
+
+	/*
+	 * Allocate a new file structure.
+	 */
+	file = ds_slab_alloc(store, &(store->file_slab));
+	if (NULL == file)
+		return NULL;
+
+	/*
+	 * Fill in the file structure.
+	 */
+	file->leaf = ds_name_store(store, name);
+	if (NULL == file->leaf) {
+		ds_slab_free(&(store->file_slab), file);
+		return NULL;
+	}
+	file->leaf_hash = ds_name_hash(file->leaf);
+	file->parent = dir;
+	file->seen_generation = 0;
+
+	/*
+	 * Add the file to the directory structure.
+	 */
+	file->parent_index = dir->file_count;
+	dir->files[dir->file_count] = file;
+	dir->file_count++;
+	store->file_count++;
+
+	/*
+	 * Add the file to the directory's name hash, creating or growing
+	 * the hash table first if it is getting full.
+	 */
+	if (dir->file_count > dir->file_hash_size) {
+		if (dir->file_count > NAME_HASH_LINEAR_MAX)
+			ds_file_hash_rebuild(store, dir);
+	} else {
+		bucket = file->leaf_hash & (dir->file_hash_size - 1);
+		file->hash_next = dir->file_hash[bucket];
+		dir->file_hash[bucket] = file;
+	}
+
+	return file;
+}
+
+
+/*
+ * Free a file information structure and its contents.
+ *
+ * The parent directory's "files" list is updated to remove this file from
+ * it.
+ */
+static void ds_file_remove(ds_file_t file)
+{
+	ds_context_t context;
+
+	if (NULL == file)
+		return;
+	if (NULL == file->leaf)
+		return;
+	if (NULL == file->parent)
+		return;
+
+	context = file->parent->context;
+
+	/*
+	 * If this file was listed as changed, list the directory instead,
+	 * since the file is going away.
+	 */
+	if (file->changed) {
+		mark_dir_changed(file->parent);
+		file->parent->changed_files--;
+	}
+
+	/* Remove the file from the change queue. */
+	ds_change_queue_file_remove(file);
+
+	debug("%s: %s", ds_file_path(file), "removing from file list");
+
+	/*
+	 * Remove this file from our parent directory's file listing.  The
+	 * last file in the list is moved into the gap left behind, so the
+	 * list is not kept in any particular order.
+	 */
+	ds_file_unlink(file);
+
+	/* Free the leafname and the file structure itself. */
+	ds_name_free(&(context->store), file->leaf);
+	file->leaf = NULL;
+	ds_slab_free(&(context->store.file_slab), file);
+	context->store.file_count--;
+}
+
+
+/*
+ * Remove the given file from its parent directory's arrays, without
+ * freeing it.
+ */
+static void ds_file_unlink(ds_file_t file)
+{
+	ds_dir_t dir = file->parent;
+	ds_file_t last;
+
+	if (NULL != dir->file_hash) {
+		ds_file_t *chain;
+		chain =
+		    &(dir->file_hash
+		      [file->leaf_hash & (dir->file_hash_size - 1)]);
+		while ((NULL != *chain) && (*chain != file))
+			chain = &((*chain)->hash_next);
+		if (NULL != *chain)
+			*chain = file->hash_next;
+	}
+
+	dir->file_count--;
+	last = dir->files[dir->file_count];
+	dir->files[file->parent_index] = last;
+	last->parent_index = file->parent_index;
+}
+
+
+/*
+ * Compare the given stat information with the file's recorded mtime and
+ * size, updating them; returns 1 if either have changed, 0 if not.
+ */
+static int ds_file_statchanged(ds_file_t file, const struct stat *sb)
+{
+	if ((sb->st_mtime == file->mtime) && (sb->st_size == file->size))
+		return 0;
+
+	debug("%s: %s", ds_file_path(file), "file changed");
+
+	file->mtime = sb->st_mtime;
+	file->size = sb->st_size;
+
+	return 1;
+}
+
+
+/*
+ * Check the given file's mtime and size against the result of a stat()
+ * call on it; if either have changed, return 1.
+ *
+ * Returns 0 if nothing has changed, 1 if it has, or -1 if the file does not
+ * exist or is not a regular file.
+ */
+static int ds_file_checkstat(ds_file_t file,
+			     const struct statbatch_entry_s *entry)
+{
+	if (NULL == file)
+		return -1;
+
+	if (NULL == file->leaf)
+		return -1;
+
+	if (0 != entry->rc)
+		return -1;
+
+	if (!S_ISREG(entry->sb.st_mode))
+		return -1;
+
+	return ds_file_statchanged(file, &(entry->sb));
+}
+
+
+/*
+ * Return how many seconds to wait before checking "file" again, instead of
+ * listing it as changed now, given that a check at "now" has just found it
+ * changed from "old_size" bytes with an mtime of "old_mtime".  Larger files
+ * have to stay unchanged for a quiet period that grows with their size
+ * before they are listed, so that a file still being written is not
+ * transferred part way through and then again once it is complete.
+ *
+ * Returns 0, to list the file now, if it is small, if it has been closed
+ * after writing, if it has already been quiet for long enough, if it is
+ * growing too slowly for waiting to help, or if listing it has already been
+ * put off too many times in a row.
+ */
+static time_t ds_file_settle_delay(ds_file_t file, off_t old_size,
+				   time_t old_mtime, time_t now)
+{
+	time_t quiet;
+
+	if (file->closed)
+		return 0;
+	if (file->size < SETTLE_SMALL_SIZE)
+		return 0;
+	if (file->settle_count >= SETTLE_MAX_DEFERRALS)
+		return 0;
+
+	/*
+	 * A file that has grown slowly since the last check, such as a log
+	 * file, may never stop growing, so there is no point waiting.
+	 */
+	if ((0 != old_mtime) && (file->mtime > old_mtime)
+	    && (file->size > old_size)
+	    && ((file->size - old_size) / (file->mtime - old_mtime) <
+		SETTLE_TRICKLE_RATE))
+		return 0;
+
+	quiet = SETTLE_MIN_SECONDS + file->size / SETTLE_BYTES_PER_SECOND;
+	if (quiet > SETTLE_MAX_SECONDS)
+		quiet = SETTLE_MAX_SECONDS;
+
+	if (now - file->mtime >= quiet)
+		return 0;
+
+	return file->mtime + quiet - now;
+}
+
+
+/*
+ * Allocate and return a new watch context, with a top-level directory
+ * absolutely rooted at "top_path".  All reported paths within the
+ * structure will be relative to "top_path".
+ *
+ * The "fd_inotify" parameter should be the file descriptor to add directory
+ * watches to for inoitfy, or -1 if inotify is not being used.  If
+ * "fd_fanotify" is not -1, it is a fanotify descriptor with a mark on the
+ * filesystem containing "top_path", and is used instead of inotify.
+ */
+static ds_context_t ds_context_create(int fd_inotify, int fd_fanotify,
+				      const char *top_path)
+{
+	ds_context_t context;
+	ds_dir_t dir;
+	context = calloc(1, sizeof(*context));
+	if (NULL == context) {
+		die("%s: %s", "calloc", strerror(errno));
+		return NULL;
+	}
+
+	context->absolute_path = realpath(top_path, NULL);
+	if (NULL == context->absolute_path) {
+		die("%s: %s", "realpath", strerror(errno));
+		free(context);
+		return NULL;
+	}
+	context->absolute_path_length = strlen(context->absolute_path);
+
+	context->fd_inotify = fd_inotify;
+	context->fd_fanotify = fd_fanotify;
+	context->shard_count = 1;
+	context->fd_shard_stop = -1;
+	context->fd_shard_notify = -1;
+
+	ds_store_init(&(context->store));
+
+	context->check_files =
+	    calloc(CHECK_STAT_BATCH, sizeof(context->check_files[0]));
+	context->check_stats =
+	    calloc(CHECK_STAT_BATCH, sizeof(context->check_stats[0]));
+	if ((NULL == context->check_files)
+	    || (NULL == context->check_stats)) {
+		die("%s: %s", "calloc", strerror(errno));
+		return NULL;
+	}
+
+	dir = ds_slab_alloc(&(context->store), &(context->store.dir_slab));
+	if (NULL == dir)
+		return NULL;
+
+	dir->leaf = "";
+	dir->wd = -1;
+	dir->depth = 0;
+	dir->parent = NULL;
+	dir->context = context;
+	dir->seen_generation = 0;
+
+	context->topdir = dir;
+	context->store.dir_count = 1;
+
+	return context;
+}
+
+
+/*
+ * Free a watch context and everything in it.
+ */
+static void ds_context_destroy(ds_context_t context)
+{
+	if (NULL == context)
+		return;
+
+	ds_dir_free(context->topdir);
+	context->topdir = NULL;
+
+	if (NULL != context->watch_index) {
+		free(context->watch_index);
+		context->watch_index = NULL;
+	}
+
+	if (NULL != context->handle_index) {
+		free(context->handle_index);
+		context->handle_index = NULL;
+	}
+
+	if (NULL != context->change_queue) {
+		free(context->change_queue);
+		context->change_queue = NULL;
+	}
+
+	if (NULL != context->rescan_stack) {
+		free(context->rescan_stack);
+		context->rescan_stack = NULL;
+	}
+
+	ds_store_destroy(&(context->store));
+
+	free(context->check_files);
+	free(context->check_stats);
+	exclude_free(context->excludes);
+	free(context->snapshot_file);
+	free(context->absolute_path);
+	free(context);
+}
+
+
+/*
+ * Add a subdirectory to the list of subdirectories in the given parent
+ * directory; if the subdirectory is already in the list, just return the
+ * existing subdirectory.
+ *
+ * The "name" string should contain the name of the directory relative to
+ * the parent directory (not the full path), e.g. "somedir".
+ *
+ * The subdirectory is allocated from the given store, or from the watch's
+ * own store if "store" is NULL.
+ *
+ * Returns the subdirectory, or NULL on error.
+ */
+static ds_dir_t ds_dir_add(ds_store_t store, ds_dir_t dir,
+			   const char *name)
+{
+	ds_dir_t subdir;
+
+	if (NULL == dir)
+		return NULL;
+	if (NULL == name)
+		return NULL;
+	if (NULL == dir->context)
+		return NULL;
+
+	if (NULL == store)
+		store = &(dir->context->store);
+
+	/*
+	 * Check that this subdirectory wouldn't be too deep.
+	 */
+	if (dir->depth >= dir->context->options.max_dir_depth) {
+		debug("%s/%s: %s", ds_dir_path(dir), name,
+		      "too deep - not adding");
+		return NULL;
+	}
+
+	/*
+	 * Check we don't already have this subdirectory in the directory
+	 * structure - if we do, return the existing structure.
+	 */
+	subdir = ds_dir_lookup(dir, name);
+	if (NULL != subdir)
+		return subdir;
+
+	/*
+	 * Check that the subdirectory isn't excluded, so that nothing under
+	 * it is ever scanned or watched.
+	 */
+	if (ds_path_excluded(dir, name, 1))
+		return NULL;
+
+	/*
+	 * Allocate a new directory structure for the subdirectory.
+	 */
+	subdir = ds_slab_alloc(store, &(store->dir_slab));
+	if (NULL == subdir)
+		return NULL;
+
+	/*
+	 * Fill in the new subdirectory structure.
+	 */
+	subdir->leaf = ds_name_store(store, name);
+	if (NULL == subdir->leaf) {
+		ds_slab_free(&(store->dir_slab), subdir);
+		return NULL;
+	}
+	subdir->leaf_hash = ds_name_hash(subdir->leaf);
+
+	subdir->wd = -1;
+	subdir->depth = dir->depth + 1;
+	subdir->context = dir->context;
+	subdir->seen_generation = 0;
+
+	if (ds_dir_link(store, dir, subdir) != 0) {
+		ds_name_free(store, subdir->leaf);
+		ds_slab_free(&(store->dir_slab), subdir);
+		return NULL;
+	}
+	store->dir_count++;
+
+	return subdir;
+}
+
+
+/*
+ * Add the directory structure "subdir" to the end of the subdirectory
+ * array of "dir", and to its name hash, and make "dir" its parent.  Any
+ * memory needed is accounted to "store".  Returns nonzero on error.
+ */
+static int ds_dir_link(ds_store_t store, ds_dir_t dir, ds_dir_t subdir)
+{
+	int bucket;
+
+	/*
+	 * Extend the subdirectory array in the directory structure if we
+	 * need to, doubling its size each time.
+	 */
+	if (dir->subdir_count >= dir->subdir_array_alloced) {
+		int target_array_alloced;
+		void *newptr;
+
+		target_array_alloced = dir->subdir_array_alloced * 2;
+		if (target_array_alloced < DIRCONTENTS_MIN_ALLOC)
+			target_array_alloced = DIRCONTENTS_MIN_ALLOC;
+		newptr =
+		    realloc((void *) (dir->subdirs),
+			    target_array_alloced *
+			    sizeof(dir->subdirs[0]));
+		if (NULL == newptr) {
+			die("%s: %s", "realloc", strerror(errno));
+			return 1;
+		}
+		store->memory_used +=
+		    (target_array_alloced -
+		     dir->subdir_array_alloced) * sizeof(dir->subdirs[0]);
+		dir->subdirs = newptr;
+		dir->subdir_array_alloced = target_array_alloced;
+	}
+
+	/*
+	 * Add the subdirectory to the directory structure.
+	 */
+	subdir->parent = dir;
+	subdir->parent_index = dir->subdir_count;
+	subdir->hash_next = NULL;
+	dir->subdirs[dir->subdir_count] = subdir;
+	dir->subdir_count++;
+
+	/*
+	 * Add the subdirectory to the directory's name hash, creating or
+	 * growing the hash table first if it is getting full.
+	 */
+	if (dir->subdir_count > dir->subdir_hash_size) {
+		if (dir->subdir_count > NAME_HASH_LINEAR_MAX)
+			ds_subdir_hash_rebuild(store, dir);
+	} else {
+		bucket = subdir->leaf_hash & (dir->subdir_hash_size - 1);
+		subdir->hash_next = dir->subdir_hash[bucket];
+		dir->subdir_hash[bucket] = subdir;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Free a directory information structure.  This includes all files and
+ * directories it contains.
+ *
+ * The parent directory's "subdirs" list is updated to remove this
+ * subdirectory from it.  The top level directory is only emptied, not
+ * freed, since it belongs to the context.
+ */
+static void ds_dir_remove(ds_dir_t dir)
+{
+
+	if (NULL == dir)
+		return;
+	if (NULL == dir->context)
+		return;
+
+	/*
+	 * The top level directory structure lasts as long as the context,
+	 * so if asked to remove it, just empty it instead.
+	 */
+	if (NULL == dir->parent) {
+		while (0 < dir->subdir_count)
+			ds_dir_remove(dir->subdirs[0]);
+		while (0 < dir->file_count)
+			ds_file_remove(dir->files[0]);
+		return;
+	}
+
+	/*
+	 * If anything in this subdirectory was listed as changed, list the
+	 * parent directory instead.
+	 */
+	if (ds_dir_flagged(dir)) {
+		mark_dir_changed(dir->parent);
+		dir->parent->changed_subdirs--;
+	}
+
+	debug("%s: %s", ds_dir_path(dir), "removing from directory list");
+
+	ds_dir_unlink(dir);
+
+	ds_dir_free(dir);
+}
+
+
+/*
+ * Remove the directory "dir" from its parent's subdirectory array and name
+ * hash, without freeing it.  As with files, the last subdirectory in the
+ * array is moved into the gap.
+ */
+static void ds_dir_unlink(ds_dir_t dir)
+{
+	ds_dir_t parent, last;
+
+	parent = dir->parent;
+	if (NULL != parent->subdir_hash) {
+		ds_dir_t *chain;
+		chain =
+		    &(parent->subdir_hash
+		      [dir->leaf_hash & (parent->subdir_hash_size - 1)]);
+		while ((NULL != *chain) && (*chain != dir))
+			chain = &((*chain)->hash_next);
+		if (NULL != *chain)
+			*chain = dir->hash_next;
+	}
+
+	parent->subdir_count--;
+	last = parent->subdirs[parent->subdir_count];
+	parent->subdirs[dir->parent_index] = last;
+	last->parent_index = dir->parent_index;
+}
+
+
+/*
+ * Free a directory structure and everything below it, once it has been
+ * removed from its parent.  Files and subdirectories are freed without
+ * being unlinked from the arrays one by one, since the arrays themselves
+ * are about to be freed.
+ */
+static void ds_dir_free(ds_dir_t dir)
+{
+	ds_context_t context;
+	int item;
+
+	context = dir->context;
+
+	if (dir->watch_writes)
+		context->write_watch_count--;
+
+	/*
+	 * Remove the watch on this directory.  A fanotify mark for writes
+	 * to its files is left alone, since the path could now lead to a
+	 * different directory; events from it are ignored once the handle
+	 * is removed, and it goes when the directory does.
+	 */
+	if ((0 <= dir->wd) && (0 <= context->fd_fanotify)) {
+		debug("%s: %s", ds_dir_path(dir), "removing handle");
+		ds_watch_index_remove(context, dir->wd);
+		dir->wd = -1;
+	} else if ((0 <= dir->wd) && (0 <= context->fd_inotify)) {
+		debug("%s: %s", ds_dir_path(dir), "removing watch");
+		if (inotify_rm_watch(context->fd_inotify, dir->wd) != 0) {
+			/*
+			 * We can get EINVAL if the directory was deleted,
+			 * so just ignore that.
+			 */
+			if (errno != EINVAL) {
+				error("%s: %s", "inotify_rm_watch",
+				      strerror(errno));
+			}
+		}
+		ds_watch_index_remove(context, dir->wd);
+		dir->wd = -1;
+	}
+
+	/*
+	 * Free all files in this directory.
+	 */
+	for (item = 0; item < dir->file_count; item++) {
+		ds_file_t file = dir->files[item];
+		ds_change_queue_file_remove(file);
+		ds_name_free(&(context->store), file->leaf);
+		ds_slab_free(&(context->store.file_slab), file);
+	}
+	context->store.file_count -= dir->file_count;
+	if (NULL != dir->files) {
+		free(dir->files);
+		context->store.memory_used -=
+		    dir->file_array_alloced * sizeof(dir->files[0]);
+	}
+	if (NULL != dir->file_hash) {
+		free(dir->file_hash);
+		context->store.memory_used -=
+		    dir->file_hash_size * sizeof(dir->file_hash[0]);
+	}
+
+	/*
+	 * Free all subdirectories of this directory (recursive).
+	 */
+	for (item = 0; item < dir->subdir_count; item++) {
+		ds_dir_free(dir->subdirs[item]);
+	}
+	if (NULL != dir->subdirs) {
+		free(dir->subdirs);
+		context->store.memory_used -=
+		    dir->subdir_array_alloced * sizeof(dir->subdirs[0]);
+	}
+	if (NULL != dir->subdir_hash) {
+		free(dir->subdir_hash);
+		context->store.memory_used -=
+		    dir->subdir_hash_size * sizeof(dir->subdir_hash[0]);
+	}
+
+	/* Remove the directory from the change queue. */
+	ds_change_queue_dir_remove(dir);
+
+	/* Forget about it if it was moved away and we're waiting to see where. */
+	if (0 < context->pending_move_count)
+		ds_move_forget(context, dir);
+
+	/* Make sure a full scan in progress doesn't try to scan it. */
+	if (0 < dir->rescan_position) {
+		context->rescan_stack[dir->rescan_position - 1] = NULL;
+		dir->rescan_position = 0;
+	}
+
+	/* Free the leafname and the directory structure itself. */
+	if (NULL != dir->parent)
+		ds_name_free(&(context->store), dir->leaf);
+	dir->leaf = NULL;
+	ds_slab_free(&(context->store.dir_slab), dir);
+	context->store.dir_count--;
+}
+
+
+/*
+ * Filter for any filename.
+ *
+ * Ignore anything ending in .tmp or ~ by default, or if there is a list
+ * of exclude patterns, ignore anything matching any of them.
+ *
+ * Returns 1 if the file should be included, 0 if it should be ignored.
+ */
+static int ds_filename_valid(ds_context_t context, const char *leafname)
+{
+	if (leafname[0] == 0)
+		return 0;
+	if ((leafname[0] == '.') && (leafname[1] == 0))
+		return 0;
+	if ((leafname[0] == '.') && (leafname[1] == '.')
+	    && (leafname[2] == 0))
+		return 0;
+
+	if (NULL != context->excludes) {
+		/*
+		 * If given an exclusion list, use it.
+		 */
+		if (exclude_match(context->excludes, leafname))
+			return 0;
+	} else {
+		/*
+		 * Default is to exclude *~ and *.tmp
+		 */
+		int namelen;
+		namelen = strlen(leafname);
+		if ((1 <= namelen) && (leafname[namelen - 1] == '~'))
+			return 0;
+		if ((namelen > 4)
+		    && (strcmp(&(leafname[namelen - 4]), ".tmp") == 0))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Return nonzero if the entry "name" in the top level directory of the
+ * given context, which is a directory if "is_dir" is set, belongs to that
+ * context's shard of the tree.  Each subdirectory of the top level belongs
+ * to one shard, chosen by the top bits of the hash of its name, so that
+ * the low bits still spread each shard's names over its name hash table,
+ * and the files in the top level belong to the first shard.
+ */
+static int ds_shard_owns(ds_context_t context, const char *name,
+			 flag_t is_dir)
+{
+	if (2 > context->shard_count)
+		return 1;
+	if (!is_dir)
+		return 0 == context->shard_index ? 1 : 0;
+	return (ds_name_hash(name) >> 16) % context->shard_count ==
+	    context->shard_index ? 1 : 0;
+}
+
+
+/*
+ * Return 1 if the entry "name" in directory "dir", which is a directory if
+ * "is_dir" is set, is excluded by a pattern that depends on where it is or
+ * on whether it is a directory, or by belonging to another shard, or 0 if
+ * not.  Patterns that only look at the leafname are left to
+ * ds_filename_valid().
+ */
+static int ds_path_excluded(ds_dir_t dir, const char *name, flag_t is_dir)
+{
+	if ((NULL == dir->parent)
+	    && (!ds_shard_owns(dir->context, name, is_dir)))
+		return 1;
+
+	if (!exclude_uses_paths(dir->context->excludes))
+		return 0;
+
+	if (!exclude_match_path
+	    (dir->context->excludes, ds_path(dir, name, 0), is_dir))
+		return 0;
+
+	debug("%s: %s", ds_path(dir, name, 0), "excluded");
+
+	return 1;
+}
+
+
+/*
+ * Process one entry called "name", of directory entry type "d_type", found
+ * while scanning directory "dir", which is open as "dirfd" and has the
+ * stat information "dirsb".  The entry is added to the directory's arrays,
+ * allocated from the scan's store, if it is not already present, and
+ * marked as seen in this scan.
+ *
+ * The d_type is used to avoid calling stat on subdirectories, and each
+ * regular file is stat()ed exactly once.  The stat() calls are batched in
+ * the scan structure, so "name" must stay valid until the batch is passed
+ * to ds_dir_scan_stats(), which happens here if the batch is full.
+ */
+static void ds_dir_scan_entry(ds_scan_t scan, ds_dir_t dir, int dirfd,
+			      const struct stat *dirsb, const char *name,
+			      unsigned char d_type, flag_t no_recurse)
+{
+	struct statbatch_entry_s *entry;
+
+	if (ds_filename_valid(dir->context, name) == 0)
+		return;
+
+	/*
+	 * If the filesystem tells us this is a directory, add it without
+	 * calling stat; the filesystem check is done when we open it to
+	 * scan it.  If we're not recursing, there will be no such scan, so
+	 * fall through to stat it.
+	 */
+	if ((DT_DIR == d_type) && (!no_recurse)) {
+		ds_dir_t subdir;
+		int known_subdirs = dir->subdir_count;
+		subdir = ds_dir_add(scan->store, dir, name);
+		if (NULL == subdir)
+			return;
+		subdir->seen_generation = scan->generation;
+		if ((scan->report_changes)
+		    && (dir->subdir_count > known_subdirs)
+		    && (!ds_dir_listed(dir)))
+			mark_dir_changed(subdir);
+		return;
+	}
+
+	/*
+	 * Skip anything that is known not to be a file or directory, such
+	 * as symbolic links, without a stat.
+	 */
+	if ((DT_UNKNOWN != d_type) && (DT_REG != d_type)
+	    && (DT_DIR != d_type))
+		return;
+
+	entry = &(scan->stats[scan->stat_count++]);
+	entry->dirfd = dirfd;
+	entry->path = name;
+
+	if (scan->stat_count >= SCAN_STAT_BATCH)
+		ds_dir_scan_stats(scan, dir, dirsb);
+}
+
+
+/*
+ * Record the stat information "sb" found by a scan for "file", in directory
+ * "dir", marking the file as changed if it has changed and the scan is
+ * reporting changes.  If a check is queued for the file, it will now find
+ * nothing, so it is told to list the file once it has settled instead.
+ *
+ * When files are checked once they are closed after writing, a file that
+ * was known before and has changed with no check queued for it has been
+ * written to without being closed, so the change is listed anyway, since
+ * nothing else will list it, and its directory is watched for every write
+ * from now on.
+ */
+static void ds_file_scanned(ds_scan_t scan, ds_dir_t dir, ds_file_t file,
+			    const struct stat *sb)
+{
+	flag_t queued, unnoticed;
+
+	queued = (0 != file->queue_position);
+	unnoticed = dir->context->options.use_close_write
+	    && (!scan->report_changes)
+	    && (0 != file->mtime) && (!queued);
+
+	file->seen_generation = scan->generation;
+
+	if (!ds_file_statchanged(file, sb))
+		return;
+
+	if (unnoticed)
+		ds_dir_watch_writes(dir);
+
+	if ((queued) && (!scan->report_changes)) {
+		if (0 == file->settle_count)
+			file->settle_count = 1;
+		return;
+	}
+
+	if ((scan->report_changes || unnoticed) && (!ds_dir_listed(dir)))
+		mark_file_changed(file);
+}
+
+
+/*
+ * Make the batch of stat() calls queued by ds_dir_scan_entry() for entries
+ * of directory "dir", whose stat information is "dirsb", and add the
+ * regular files and subdirectories found to the directory's arrays.
+ */
+static void ds_dir_scan_stats(ds_scan_t scan, ds_dir_t dir,
+			      const struct stat *dirsb)
+{
+	size_t idx;
+
+	statbatch_run(scan->stats, scan->stat_count);
+
+	for (idx = 0; idx < scan->stat_count; idx++) {
+		struct statbatch_entry_s *entry = &(scan->stats[idx]);
+
+		if (0 != entry->rc)
+			continue;
+
+		if (S_ISREG(entry->sb.st_mode)) {
+			ds_file_t file;
+			file = ds_file_add(scan->store, dir, entry->path);
+			if (NULL != file)
+				ds_file_scanned(scan, dir, file, &(entry->sb));
+			scan->file_count++;
+		} else if (S_ISDIR(entry->sb.st_mode)) {
+			ds_dir_t subdir;
+			if (entry->sb.st_dev == dirsb->st_dev) {
+				int known_subdirs = dir->subdir_count;
+				subdir =
+				    ds_dir_add(scan->store, dir,
+					       entry->path);
+				if (NULL == subdir)
+					continue;
+				subdir->seen_generation = scan->generation;
+				if ((scan->report_changes)
+				    && (dir->subdir_count > known_subdirs)
+				    && (!ds_dir_listed(dir)))
+					mark_dir_changed(subdir);
+			} else {
+				debug("%s/%s: %s", ds_dir_path(dir),
+				      entry->path,
+				      "skipping - different filesystem");
+			}
+		}
+	}
+
+	scan->stat_count = 0;
+}
+
+
+/*
+ * Check the files already known in directory "dir", which is open as
+ * "dirfd", instead of reading the directory.  This is used when the
+ * directory's timestamps show that nothing has been added to it or removed
+ * from it since it was last read, so nothing needs to be done to its
+ * subdirectories here, and the only thing that can have happened to its
+ * files is that their contents have changed.
+ *
+ * If "rescan_sample" is more than 1, only about one in that many files is
+ * checked, chosen so that each file is checked once every that many
+ * scans, unless this scan is reporting changes, as it does after loading a
+ * snapshot or losing events, since a change it misses would never be
+ * listed.  Files that can no longer be stat()ed are removed.  The files are worked through from
+ * the end of the array, so that a removal, which moves the last file into
+ * the gap, only moves one already dealt with.
+ */
+static void ds_dir_scan_known(ds_scan_t scan, ds_dir_t dir, int dirfd)
+{
+	ds_file_t batch[SCAN_STAT_BATCH];
+	int fileidx;
+
+	scan->file_count += dir->file_count;
+
+	fileidx = dir->file_count - 1;
+	while (0 <= fileidx) {
+		size_t count, idx;
+
+		for (count = 0; (0 <= fileidx) && (count < SCAN_STAT_BATCH);
+		     fileidx--) {
+			ds_file_t file = dir->files[fileidx];
+
+			if ((1 < dir->context->options.rescan_sample)
+			    && (!scan->report_changes)
+			    && (0 !=
+				(file->leaf_hash +
+				 dir->context->full_scan_count) %
+				dir->context->options.rescan_sample))
+				continue;
+
+			batch[count] = file;
+			scan->stats[count].dirfd = dirfd;
+			scan->stats[count].path = file->leaf;
+			count++;
+		}
+
+		statbatch_run(scan->stats, count);
+
+		for (idx = 0; idx < count; idx++) {
+			struct statbatch_entry_s *entry = &(scan->stats[idx]);
+			ds_file_t file = batch[idx];
+
+			if ((0 == entry->rc) && (S_ISREG(entry->sb.st_mode))) {
+				ds_file_scanned(scan, dir, file, &(entry->sb));
+				continue;
+			}
+
+			if (scan->report_changes)
+				mark_dir_changed(dir);
+			ds_file_remove(file);
+		}
+	}
+}
+
+
+/*
+ * Scan the directory "dir", which is opened relative to the directory file
+ * descriptor "parent_fd" - using its leafname if "parent_fd" is an open
+ * directory, or its absolute path if it is AT_FDCWD.  Also checks files
+ * for changes, and recurses into subdirectories relative to this
+ * directory's own descriptor, so no full pathnames are built while
+ * scanning.
+ *
+ * If "parent_sb" is not NULL, it is the parent directory's stat
+ * information, and the scan is abandoned if this directory is on a
+ * different filesystem from its parent.
+ *
+ * Entries are processed in the order the filesystem returns them, one
+ * buffer at a time, using the scan's buffer.  The buffer is only needed
+ * while this directory's entries are being read, which finishes before any
+ * subdirectory is scanned, so one buffer serves the whole recursive scan.
+ *
+ * Entries seen are marked with the scan's generation number, and those
+ * left with an older one afterwards have gone.  If the scan has
+ * "trust_mtime" set, and the directory's modification and change times
+ * are the same as when it was last read, it is not read again, and only
+ * the files already known in it are checked (see ds_dir_scan_known()), so
+ * nothing in an unchanged directory has to be marked.  If the scan has
+ * "report_changes" set, anything found to be new, changed, or gone is
+ * marked as changed.
+ *
+ * Returns nonzero if the scan failed, in which case the directory will have
+ * been deleted from the lists.
+ */
+static int ds_dir_scan_at(ds_scan_t scan, ds_dir_t dir, int parent_fd,
+			  const struct stat *parent_sb, flag_t no_recurse)
+{
+	int dirfd;
+	int diridx, fileidx;
+	struct stat dirsb;
+	flag_t unchanged;
+
+	if (NULL == dir)
+		return 1;
+	if (NULL == dir->leaf)
+		return 1;
+
+	if (dir->depth > dir->context->options.max_dir_depth) {
+		debug("%s: %s", ds_dir_path(dir), "too deep - removing");
+		ds_dir_remove(dir);
+		return 1;
+	}
+
+	dirfd =
+	    openat(parent_fd,
+		   AT_FDCWD == parent_fd ? ds_dir_abspath(dir) : dir->leaf,
+		   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (0 > dirfd) {
+		error("%s: %s: %s", ds_dir_abspath(dir), "open",
+		      strerror(errno));
+		ds_dir_remove(dir);
+		return 1;
+	}
+
+	if (fstat(dirfd, &dirsb) != 0) {
+		error("%s: %s: %s", ds_dir_path(dir), "fstat",
+		      strerror(errno));
+		close(dirfd);
+		ds_dir_remove(dir);
+		return 1;
+	}
+
+	if ((NULL != parent_sb) && (dirsb.st_dev != parent_sb->st_dev)) {
+		debug("%s: %s", ds_dir_path(dir),
+		      "skipping - different filesystem");
+		close(dirfd);
+		ds_dir_remove(dir);
+		return 1;
+	}
+
+	scan->dir_count++;
+
+	unchanged = 0;
+	if ((scan->trust_mtime)
+	    && (dir->mtime.tv_sec == dirsb.st_mtim.tv_sec)
+	    && (dir->mtime.tv_nsec == dirsb.st_mtim.tv_nsec)
+	    && (dir->ctime.tv_sec == dirsb.st_ctim.tv_sec)
+	    && (dir->ctime.tv_nsec == dirsb.st_ctim.tv_nsec))
+		unchanged = 1;
+
+	if (unchanged)
+		ds_dir_scan_known(scan, dir, dirfd);
+
+	/*
+	 * Otherwise, read the directory in large batches, adding new items
+	 * to the arrays and marking existing ones as seen as we go, so that
+	 * memory use is bounded by the buffer size however big the directory
+	 * is.
+	 */
+	while (!unchanged) {
+		long got, pos;
+
+		got =
+		    syscall(SYS_getdents64, dirfd, scan->buffer,
+			    SCAN_BUFFER_SIZE);
+		if (0 == got)
+			break;
+
+		if (0 > got) {
+			if (EINTR == errno)
+				continue;
+			/*
+			 * We can't tell what we missed, so rather than
+			 * deleting everything we didn't get to, discard
+			 * this directory; it will be picked up again on
+			 * the next rescan of its parent.
+			 */
+			error("%s: %s: %s", ds_dir_abspath(dir),
+			      "getdents64", strerror(errno));
+			close(dirfd);
+			ds_dir_remove(dir);
+			return 1;
+		}
+
+		for (pos = 0; pos < got;) {
+			struct dirent64 *d;
+			d = (struct dirent64 *) &(scan->buffer[pos]);
+			pos += d->d_reclen;
+			ds_dir_scan_entry(scan, dir, dirfd, &dirsb,
+					  d->d_name, d->d_type, no_recurse);
+		}
+
+		/*
+		 * The names are in the buffer, so finish the stat() calls
+		 * for this batch before reading the next.
+		 */
+		ds_dir_scan_stats(scan, dir, &dirsb);
+	}
+
+	ds_dir_set_times(dir, &dirsb);
+
+	/*
+	 * Delete any subdirectories that we did not see on rescan, and
+	 * recursively scan those that we did, or leave them on the stack of
+	 * directories still to be scanned if this is part of a full scan
+	 * that is being done a slice at a time.
+	 */
+	for (diridx = 0; diridx < dir->subdir_count; diridx++) {
+		if ((unchanged)
+		    || (dir->subdirs[diridx]->seen_generation ==
+			scan->generation)) {
+			if (no_recurse)
+				continue;
+			if ((scan->new_subdirs_only)
+			    && (0 <= dir->subdirs[diridx]->wd))
+				continue;
+			if (scan->queue_subdirs) {
+				ds_rescan_push(dir->context,
+					       dir->subdirs[diridx]);
+				continue;
+			}
+			if (ds_dir_scan_at
+			    (scan, dir->subdirs[diridx], dirfd, &dirsb,
+			     0) != 0) {
+				/* Go back one, as this diridx has now gone */
+				diridx--;
+			}
+		} else {
+			if (scan->report_changes)
+				mark_dir_changed(dir);
+			ds_dir_remove(dir->subdirs[diridx]);
+			/* Go back one, as this diridx has now gone */
+			diridx--;
+		}
+	}
+
+	/*
+	 * Delete any files that we did not see on rescan - this includes
+	 * any that are no longer regular files.
+	 */
+	for (fileidx = 0; (!unchanged) && (fileidx < dir->file_count);
+	     fileidx++) {
+		if (dir->files[fileidx]->seen_generation == scan->generation)
+			continue;
+		if (scan->report_changes)
+			mark_dir_changed(dir);
+		ds_file_remove(dir->files[fileidx]);
+		/* Go back one, as this fileidx has now gone */
+		fileidx--;
+	}
+
+	/*
+	 * Add a watch to this directory if there isn't one already.
+	 */
+	if (0 > dir->wd)
+		ds_dir_watch(dir, dirfd);
+
+	close(dirfd);
+
+	return 0;
+}
+
+
+/*
+ * Record the timestamps "sb" that the directory "dir" had when it was
+ * read, so that a later scan can tell whether it needs to be read again.
+ * If the directory changed within the last second, a further change could
+ * leave its timestamps the same, so they are recorded as zero instead, to
+ * make sure it is read again next time.
+ */
+static void ds_dir_set_times(ds_dir_t dir, const struct stat *sb)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	if (sb->st_ctim.tv_sec >= now.tv_sec - 1) {
+		memset(&(dir->mtime), 0, sizeof(dir->mtime));
+		memset(&(dir->ctime), 0, sizeof(dir->ctime));
+		return;
+	}
+
+	dir->mtime = sb->st_mtim;
+	dir->ctime = sb->st_ctim;
+}
+
+
+/*
+ * Start watching the directory "dir" for changes, and add it to the
+ * directory index so that we can find this directory structure when an
+ * event arrives.  If "dirfd" is not AT_FDCWD, it is an open descriptor for
+ * the directory.
+ *
+ * With inotify, a watch is added to the directory itself.  With fanotify,
+ * the whole filesystem is already marked, so all that is needed is the
+ * directory's file handle, which is what its events will carry; it is
+ * given a watch descriptor of our own so that the directory index can be
+ * used in the same way.
+ */
+static void ds_dir_watch(ds_dir_t dir, int dirfd)
+{
+	ds_context_t context;
+
+	context = dir->context;
+
+	if (0 <= context->fd_fanotify) {
+		struct file_handle *handle;
+		int mount_id, rc;
+
+		handle = malloc(sizeof(*handle) + MAX_HANDLE_SZ);
+		if (NULL == handle) {
+			die("%s: %s", "malloc", strerror(errno));
+			return;
+		}
+		handle->handle_bytes = MAX_HANDLE_SZ;
+
+		if (AT_FDCWD == dirfd) {
+			rc = name_to_handle_at(AT_FDCWD, ds_dir_abspath(dir),
+					       handle, &mount_id, 0);
+		} else {
+			rc = name_to_handle_at(dirfd, "", handle, &mount_id,
+					       AT_EMPTY_PATH);
+		}
+		if (0 != rc) {
+			error("%s: %s: %s", ds_dir_path(dir),
+			      "name_to_handle_at", strerror(errno));
+			free(handle);
+			return;
+		}
+
+		/*
+		 * Shrink the handle to the size actually used, since there
+		 * will be one per directory.
+		 */
+		{
+			struct file_handle *shrunk;
+			shrunk =
+			    realloc(handle,
+				    sizeof(*handle) + handle->handle_bytes);
+			if (NULL != shrunk)
+				handle = shrunk;
+		}
+		context->store.memory_used +=
+		    sizeof(*handle) + handle->handle_bytes;
+
+		debug("%s: %s", ds_dir_path(dir), "adding handle");
+		dir->wd = context->next_handle_wd++;
+		ds_watch_index_add(dir, dir->wd, handle);
+		return;
+	}
+
+	if (0 > context->fd_inotify)
+		return;
+
+	debug("%s: %s", ds_dir_path(dir), "adding watch");
+	dir->wd =
+	    inotify_add_watch(context->fd_inotify, ds_dir_abspath(dir),
+			      ds_dir_watch_events(dir));
+	if (0 > dir->wd) {
+		error("%s: %s: %s", ds_dir_path(dir), "inotify_add_watch",
+		      strerror(errno));
+		return;
+	}
+
+	ds_watch_index_add(dir, dir->wd, NULL);
+}
+
+
+/*
+ * Start watching the directory "dir" for every write to its files, and not
+ * just for files being closed after writing.  This is for when a file in
+ * it has been seen to change without being closed, such as a log file held
+ * open by a long-running process, or a file written through a shared
+ * memory map and then truncated or written to directly.
+ *
+ * With fanotify, the directory is given a mark of its own for writes to
+ * its children, on top of the filesystem mark.
+ */
+static void ds_dir_watch_writes(ds_dir_t dir)
+{
+	ds_context_t context;
+
+	if (!dir->context->options.use_close_write)
+		return;
+	if (dir->watch_writes)
+		return;
+
+	context = dir->context;
+
+	debug("%s: %s", ds_dir_path(dir),
+	      "file changed while open - watching for writes");
+
+	dir->watch_writes = 1;
+	context->write_watch_count++;
+
+	if (0 > dir->wd)
+		return;
+
+	if (0 <= context->fd_fanotify) {
+		if (fanotify_mark
+		    (context->fd_fanotify, FAN_MARK_ADD,
+		     FAN_MODIFY | FAN_EVENT_ON_CHILD, AT_FDCWD,
+		     ds_dir_abspath(dir)) != 0) {
+			error("%s: %s: %s", ds_dir_path(dir),
+			      "fanotify_mark", strerror(errno));
+		}
+	} else if (0 <= context->fd_inotify) {
+		if (inotify_add_watch
+		    (context->fd_inotify, ds_dir_abspath(dir),
+		     ds_dir_watch_events(dir)) < 0) {
+			error("%s: %s: %s", ds_dir_path(dir),
+			      "inotify_add_watch", strerror(errno));
+		}
+	}
+}
+
+
+/*
+ * Add the directory "dir" to the tail of the given worker's deque, so it
+ * will be scanned by this worker or stolen by another.
+ */
+static void ds_scan_worker_push(ds_scan_worker_t worker, ds_dir_t dir)
+{
+	ds_scan_pool_t pool = worker->pool;
+
+	/*
+	 * Count the directory as pending before anyone can take it, so the
+	 * count cannot drop to zero while there is still work to do.
+	 */
+	__atomic_add_fetch(&(pool->pending), 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&(worker->lock));
+
+	if (worker->queue_tail >= worker->queue_alloced) {
+		/*
+		 * Move the entries back to the start of the array, and
+		 * extend it if that didn't make enough room.
+		 */
+		if (0 < worker->queue_head) {
+			memmove(worker->queue,
+				worker->queue + worker->queue_head,
+				(worker->queue_tail -
+				 worker->queue_head) *
+				sizeof(worker->queue[0]));
+			worker->queue_tail -= worker->queue_head;
+			worker->queue_head = 0;
+		}
+		if (worker->queue_tail >= worker->queue_alloced) {
+			size_t target_alloced;
+			ds_dir_t *newptr;
+
+			target_alloced = worker->queue_alloced * 2;
+			if (target_alloced < DIRCONTENTS_MIN_ALLOC)
+				target_alloced = DIRCONTENTS_MIN_ALLOC;
+			newptr =
+			    realloc(worker->queue,
+				    target_alloced *
+				    sizeof(worker->queue[0]));
+			if (NULL == newptr) {
+				die("%s: %s", "realloc", strerror(errno));
+				pthread_mutex_unlock(&(worker->lock));
+				return;
+			}
+			worker->queue = newptr;
+			worker->queue_alloced = target_alloced;
+		}
+	}
+
+	worker->queue[worker->queue_tail++] = dir;
+
+	pthread_mutex_unlock(&(worker->lock));
+
+	if (0 < __atomic_load_n(&(pool->idle), __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&(pool->lock));
+		pthread_cond_signal(&(pool->wakeup));
+		pthread_mutex_unlock(&(pool->lock));
+	}
+}
+
+
+/*
+ * Remove and return the directory at the tail of the given worker's deque,
+ * or NULL if it is empty.
+ */
+static ds_dir_t ds_scan_worker_pop(ds_scan_worker_t worker)
+{
+	ds_dir_t dir = NULL;
+
+	pthread_mutex_lock(&(worker->lock));
+	if (worker->queue_tail > worker->queue_head) {
+		dir = worker->queue[--worker->queue_tail];
+		if (worker->queue_tail == worker->queue_head) {
+			worker->queue_head = 0;
+			worker->queue_tail = 0;
+		}
+	}
+	pthread_mutex_unlock(&(worker->lock));
+
+	return dir;
+}
+
+
+/*
+ * Remove and return the directory at the head of another worker's deque,
+ * trying each of the other workers in turn, or return NULL if all of their
+ * deques are empty.
+ */
+static ds_dir_t ds_scan_worker_steal(ds_scan_worker_t worker)
+{
+	ds_scan_pool_t pool = worker->pool;
+	unsigned int self, offset;
+	ds_dir_t dir = NULL;
+
+	self = worker - pool->workers;
+
+	for (offset = 1; offset < pool->worker_count && NULL == dir;
+	     offset++) {
+		ds_scan_worker_t victim;
+
+		victim = &(pool->workers[(self + offset) % pool->worker_count]);
+
+		pthread_mutex_lock(&(victim->lock));
+		if (victim->queue_tail > victim->queue_head) {
+			dir = victim->queue[victim->queue_head++];
+			if (victim->queue_tail == victim->queue_head) {
+				victim->queue_head = 0;
+				victim->queue_tail = 0;
+			}
+		}
+		pthread_mutex_unlock(&(victim->lock));
+	}
+
+	return dir;
+}
+
+
+/*
+ * Scan the directory "dir" as part of a parallel scan: read its entries,
+ * adding them to the tree from the worker's own store, queue its
+ * subdirectories on the worker's deque, and add an inotify watch for it.
+ *
+ * Nothing is reported or removed here, since that is not safe to do from
+ * more than one thread; instead the directory is left without the scan's
+ * generation number if it could not be scanned, and ds_dir_scan_finish()
+ * deals with it afterwards.  The watch descriptor is also added to the
+ * watch index later, by ds_dir_scan_finish().
+ */
+static void ds_scan_worker_dir(ds_scan_worker_t worker, ds_dir_t dir)
+{
+	ds_scan_pool_t pool = worker->pool;
+	ds_scan_t scan = &(worker->scan);
+	struct stat dirsb;
+	int dirfd, diridx;
+
+	dir->seen_generation = 0;
+
+	dirfd =
+	    open(ds_dir_abspath(dir),
+		 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (0 > dirfd)
+		return;
+
+	if ((fstat(dirfd, &dirsb) != 0) || (dirsb.st_dev != pool->device)) {
+		close(dirfd);
+		return;
+	}
+
+	while (1) {
+		long got, pos;
+
+		got =
+		    syscall(SYS_getdents64, dirfd, scan->buffer,
+			    SCAN_BUFFER_SIZE);
+		if (0 == got)
+			break;
+
+		if (0 > got) {
+			if (EINTR == errno)
+				continue;
+			close(dirfd);
+			return;
+		}
+
+		for (pos = 0; pos < got;) {
+			struct dirent64 *d;
+			d = (struct dirent64 *) &(scan->buffer[pos]);
+			pos += d->d_reclen;
+			ds_dir_scan_entry(scan, dir, dirfd, &dirsb,
+					  d->d_name, d->d_type, 0);
+		}
+
+		ds_dir_scan_stats(scan, dir, &dirsb);
+	}
+
+	close(dirfd);
+
+	dir->seen_generation = scan->generation;
+	ds_dir_set_times(dir, &dirsb);
+	scan->dir_count++;
+
+	for (diridx = 0; diridx < dir->subdir_count; diridx++) {
+		ds_scan_worker_push(worker, dir->subdirs[diridx]);
+	}
+
+	if (0 <= pool->context->fd_inotify) {
+		dir->wd =
+		    inotify_add_watch(pool->context->fd_inotify,
+				      ds_dir_abspath(dir),
+				      ds_dir_watch_events(dir));
+	}
+}
+
+
+/*
+ * Return nonzero if any worker in the pool has a directory queued.  The
+ * caller must hold the pool lock.
+ */
+static int ds_scan_pool_has_work(ds_scan_pool_t pool)
+{
+	unsigned int idx;
+	int found = 0;
+
+	for (idx = 0; idx < pool->worker_count && !found; idx++) {
+		ds_scan_worker_t worker = &(pool->workers[idx]);
+		pthread_mutex_lock(&(worker->lock));
+		if (worker->queue_tail > worker->queue_head)
+			found = 1;
+		pthread_mutex_unlock(&(worker->lock));
+	}
+
+	return found;
+}
+
+
+/*
+ * Main loop of a parallel scan worker: scan directories from our own
+ * deque, or stolen from others, until no directories are pending anywhere.
+ * The first worker is run by the thread that started the scan; the others
+ * each have a thread of their own.
+ */
+static void *ds_scan_worker_run(void *arg)
+{
+	ds_scan_worker_t worker = arg;
+	ds_scan_pool_t pool = worker->pool;
+	ds_dir_t dir;
+
+	while (1) {
+		dir = ds_scan_worker_pop(worker);
+		if (NULL == dir)
+			dir = ds_scan_worker_steal(worker);
+
+		if (NULL != dir) {
+			ds_scan_worker_dir(worker, dir);
+			if (0 ==
+			    __atomic_sub_fetch(&(pool->pending), 1,
+					       __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&(pool->lock));
+				pthread_cond_broadcast(&(pool->wakeup));
+				pthread_mutex_unlock(&(pool->lock));
+			}
+			continue;
+		}
+
+		/*
+		 * Nothing to do - sleep until more work is queued or the
+		 * scan is over.
+		 */
+		pthread_mutex_lock(&(pool->lock));
+		if (0 == __atomic_load_n(&(pool->pending), __ATOMIC_SEQ_CST)) {
+			pthread_mutex_unlock(&(pool->lock));
+			break;
+		}
+		__atomic_add_fetch(&(pool->idle), 1, __ATOMIC_SEQ_CST);
+		if (!ds_scan_pool_has_work(pool))
+			pthread_cond_wait(&(pool->wakeup), &(pool->lock));
+		__atomic_sub_fetch(&(pool->idle), 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&(pool->lock));
+	}
+
+	if (worker != pool->workers) {
+		ds_path_release();
+		statbatch_release();
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Complete a parallel scan of the directory "dir" and everything below it,
+ * in the main thread: directories that a worker could not scan are scanned
+ * again normally, so that errors are reported and failed directories are
+ * removed in the usual way, and every watch descriptor the workers added
+ * is put into the watch index.  The device of "topsb" is used to check
+ * that rescanned subdirectories are on the same filesystem.
+ *
+ * Returns nonzero if the directory has been deleted from the lists.
+ */
+static int ds_dir_scan_finish(ds_scan_t scan, ds_dir_t dir,
+			      const struct stat *topsb)
+{
+	int diridx;
+
+	if (dir->seen_generation != scan->generation) {
+		return ds_dir_scan_at(scan, dir, AT_FDCWD,
+				      NULL == dir->parent ? NULL : topsb, 0);
+	}
+
+	/*
+	 * Workers only add inotify watches; if one failed, or if fanotify
+	 * is in use, the watch is added here instead.
+	 */
+	if (0 <= dir->wd) {
+		ds_watch_index_add(dir, dir->wd, NULL);
+	} else {
+		ds_dir_watch(dir, AT_FDCWD);
+	}
+
+	for (diridx = 0; diridx < dir->subdir_count; diridx++) {
+		if (ds_dir_scan_finish(scan, dir->subdirs[diridx], topsb) !=
+		    0) {
+			/* Go back one, as this diridx has now gone */
+			diridx--;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Scan the whole tree of the given watch, which must be empty, using
+ * scan_threads threads.  Each thread allocates from a store of its own,
+ * which is merged into the watch's store afterwards, and the files and
+ * directories scanned are added to the counts in "scan".
+ *
+ * Returns nonzero if the scan failed.
+ */
+static int ds_dir_scan_parallel(ds_scan_t scan, ds_context_t context)
+{
+	struct ds_scan_pool_s pool;
+	struct stat topsb;
+	unsigned int idx;
+	int rc;
+
+	if (stat(context->absolute_path, &topsb) != 0) {
+		return ds_dir_scan_at(scan, context->topdir, AT_FDCWD, NULL,
+				      0);
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.context = context;
+	pool.device = topsb.st_dev;
+	pool.worker_count = context->options.scan_threads;
+	pool.workers = calloc(pool.worker_count, sizeof(pool.workers[0]));
+	if (NULL == pool.workers) {
+		die("%s: %s", "calloc", strerror(errno));
+		return 1;
+	}
+	pthread_mutex_init(&(pool.lock), NULL);
+	pthread_cond_init(&(pool.wakeup), NULL);
+
+	for (idx = 0; idx < pool.worker_count; idx++) {
+		ds_scan_worker_t worker = &(pool.workers[idx]);
+		worker->pool = &pool;
+		ds_store_init(&(worker->store));
+		worker->scan.store = &(worker->store);
+		worker->scan.generation = scan->generation;
+		if (0 == idx) {
+			worker->scan.buffer = scan->buffer;
+			worker->scan.stats = scan->stats;
+		} else {
+			worker->scan.buffer = malloc(SCAN_BUFFER_SIZE);
+			worker->scan.stats =
+			    calloc(SCAN_STAT_BATCH,
+				   sizeof(worker->scan.stats[0]));
+			if ((NULL == worker->scan.buffer)
+			    || (NULL == worker->scan.stats)) {
+				die("%s: %s", "malloc", strerror(errno));
+				return 1;
+			}
+		}
+		pthread_mutex_init(&(worker->lock), NULL);
+	}
+
+	debug("%s: %u %s", "full scan", pool.worker_count, "threads");
+
+	ds_scan_worker_push(&(pool.workers[0]), context->topdir);
+
+	for (idx = 1; idx < pool.worker_count; idx++) {
+		ds_scan_worker_t worker = &(pool.workers[idx]);
+		rc = pthread_create(&(worker->thread), NULL,
+				    ds_scan_worker_run, worker);
+		if (0 != rc) {
+			error("%s: %s", "pthread_create", strerror(rc));
+			continue;
+		}
+		worker->thread_started = 1;
+	}
+
+	ds_scan_worker_run(&(pool.workers[0]));
+
+	for (idx = 1; idx < pool.worker_count; idx++) {
+		if (pool.workers[idx].thread_started)
+			pthread_join(pool.workers[idx].thread, NULL);
+	}
+
+	for (idx = 0; idx < pool.worker_count; idx++) {
+		ds_scan_worker_t worker = &(pool.workers[idx]);
+		ds_store_merge(&(context->store), &(worker->store));
+		scan->file_count += worker->scan.file_count;
+		scan->dir_count += worker->scan.dir_count;
+		if (0 != idx) {
+			free(worker->scan.buffer);
+			free(worker->scan.stats);
+		}
+		if (NULL != worker->queue)
+			free(worker->queue);
+		pthread_mutex_destroy(&(worker->lock));
+	}
+
+	pthread_cond_destroy(&(pool.wakeup));
+	pthread_mutex_destroy(&(pool.lock));
+	free(pool.workers);
+
+	return ds_dir_scan_finish(scan, context->topdir, &topsb);
+}
+
+
+/*
+ * Add the directory "dir" to the stack of directories left to scan in the
+ * full scan in progress, unless it is already on it.
+ */
+static void ds_rescan_push(ds_context_t context, ds_dir_t dir)
+{
+	if (0 < dir->rescan_position)
+		return;
+
+	if (context->rescan_stack_length >= context->rescan_stack_alloced) {
+		int target_alloced;
+		ds_dir_t *newptr;
+
+		target_alloced = context->rescan_stack_alloced * 2;
+		if (target_alloced < DIRCONTENTS_MIN_ALLOC)
+			target_alloced = DIRCONTENTS_MIN_ALLOC;
+		newptr =
+		    realloc(context->rescan_stack,
+			    target_alloced *
+			    sizeof(context->rescan_stack[0]));
+		if (NULL == newptr) {
+			die("%s: %s", "realloc", strerror(errno));
+			return;
+		}
+		context->store.memory_used +=
+		    (target_alloced -
+		     context->rescan_stack_alloced) *
+		    sizeof(context->rescan_stack[0]);
+		context->rescan_stack = newptr;
+		context->rescan_stack_alloced = target_alloced;
+	}
+
+	context->rescan_stack[context->rescan_stack_length++] = dir;
+	dir->rescan_position = context->rescan_stack_length;
+}
+
+
+/*
+ * Remove and return the directory at the top of the stack of directories
+ * left to scan in the full scan in progress, skipping the slots of any
+ * that have been removed from the tree since they were added, or return
+ * NULL if there are none left.
+ */
+static ds_dir_t ds_rescan_pop(ds_context_t context)
+{
+	while (0 < context->rescan_stack_length) {
+		ds_dir_t dir;
+
+		dir = context->rescan_stack[--context->rescan_stack_length];
+		if (NULL == dir)
+			continue;
+		dir->rescan_position = 0;
+		return dir;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Record the results of the full scan that has just ended, report them,
+ * and save a snapshot of the tree.
+ */
+static void ds_rescan_finish(ds_context_t context)
+{
+	struct timespec ended;
+	double duration;
+
+	clock_gettime(CLOCK_MONOTONIC, &ended);
+	duration =
+	    (double) (ended.tv_sec - context->rescan_started.tv_sec) +
+	    (double) (ended.tv_nsec -
+		      context->rescan_started.tv_nsec) / 1000000000.0;
+
+	context->rescan_active = 0;
+	context->rescan_stack_length = 0;
+
+	if (context->rescan.recovery)
+		context->recovered = 1;
+
+	time(&(context->last_scan));
+	context->last_scan_duration = duration;
+	context->last_scan_files = context->rescan.file_count;
+	context->last_scan_dirs = context->rescan.dir_count;
+
+	debug("%s: %lu %s, %lu %s, %.3f %s, %.0f %s", "full scan",
+	      context->last_scan_files, "files", context->last_scan_dirs,
+	      "directories", duration, "seconds",
+	      duration > 0 ? context->last_scan_files / duration : 0.0,
+	      "files/sec");
+
+	ds_status_changed(context);
+
+	ds_snapshot_save(context);
+
+	/*
+	 * If events were lost while this scan was in progress, the part of
+	 * the tree it had already done could have missed them, so go round
+	 * again.
+	 */
+	if (context->rescan_again) {
+		context->rescan_again = 0;
+		ds_change_queue_dir_add(context->topdir, 0);
+	}
+}
+
+
+/*
+ * Carry on with the full scan in progress, if there is one, scanning
+ * directories from the stack until either RESCAN_SLICE_DIRS have been
+ * scanned or RESCAN_SLICE_MSEC milliseconds have passed, so that events
+ * can be read in between slices instead of waiting for the whole tree to
+ * be scanned.  When the stack is empty, the scan is finished.
+ */
+static void ds_rescan_continue(ds_context_t context)
+{
+	struct timespec started, now;
+	int scanned;
+
+	if (!context->rescan_active)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	for (scanned = 0; scanned < RESCAN_SLICE_DIRS; scanned++) {
+		ds_dir_t dir;
+		long elapsed;
+
+		dir = ds_rescan_pop(context);
+		if (NULL == dir) {
+			ds_rescan_finish(context);
+			return;
+		}
+
+		ds_dir_scan_at(&(context->rescan), dir, AT_FDCWD,
+			       NULL == dir->parent ? NULL :
+			       &(context->rescan_topsb), 0);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed =
+		    (now.tv_sec - started.tv_sec) * 1000 +
+		    (now.tv_nsec - started.tv_nsec) / 1000000;
+		if (elapsed >= RESCAN_SLICE_MSEC)
+			break;
+	}
+
+	if (0 == context->rescan_stack_length)
+		ds_rescan_finish(context);
+}
+
+
+/*
+ * Scan the given directory.  Also checks files for changes.  Returns
+ * nonzero if the scan failed, in which case the directory will have been
+ * deleted from the lists.
+ *
+ * If no_recurse is true, then no subdirectories are scanned, though
+ * subdirectories are still added and removed as necessary.  Otherwise,
+ * below the top level, only subdirectories that have not been scanned
+ * before - which have no watch yet - are scanned, and so on down through
+ * them; a scan queued because of an event in one directory need not read
+ * everything under it again, since changes there have events of their
+ * own.
+ *
+ * When the top level directory is scanned without no_recurse, a full scan
+ * is started, which is carried on a slice at a time by ds_rescan_continue()
+ * so that events are not left waiting while a large tree is scanned; the
+ * number of files and directories scanned and the time taken are recorded
+ * when it ends, so that the scan rate can be reported.  If the tree is
+ * empty, as it is on startup, and more than one scan thread has been
+ * configured, the scan is instead done in parallel, all at once.
+ */
+static int ds_dir_scan(ds_dir_t dir, flag_t no_recurse)
+{
+	struct ds_scan_s scan;
+	ds_context_t context;
+	ds_scan_t full;
+	int rc;
+
+	if (NULL == dir)
+		return 1;
+	if (NULL == dir->context)
+		return 1;
+
+	if (NULL == scan_buffer) {
+		scan_buffer = malloc(SCAN_BUFFER_SIZE);
+		scan_stats = calloc(SCAN_STAT_BATCH, sizeof(scan_stats[0]));
+		if ((NULL == scan_buffer) || (NULL == scan_stats)) {
+			die("%s: %s", "malloc", strerror(errno));
+			return 1;
+		}
+	}
+
+	context = dir->context;
+
+	if ((dir == context->topdir) && (!no_recurse)
+	    && (context->rescan_active)) {
+		debug("%s: %s", "full scan", "already in progress");
+		return 0;
+	}
+
+	/*
+	 * Give this scan a new generation number, never 0, which is what
+	 * new entries start with.
+	 */
+	context->scan_generation++;
+	if (0 == context->scan_generation)
+		context->scan_generation++;
+
+	if ((dir != context->topdir) || (no_recurse)) {
+		memset(&scan, 0, sizeof(scan));
+		scan.store = NULL;
+		scan.buffer = scan_buffer;
+		scan.stats = scan_stats;
+		scan.generation = context->scan_generation;
+		scan.new_subdirs_only = 1;
+		return ds_dir_scan_at(&scan, dir, AT_FDCWD, NULL, no_recurse);
+	}
+
+	/*
+	 * Full scans skip reading directories whose timestamps haven't
+	 * changed since they were last read.  The first full scan after
+	 * loading a snapshot also marks anything it finds to be different
+	 * as changed, since that changed while we weren't watching, and so
+	 * does a scan after the event queue overflowed, which also checks
+	 * every file instead of a sample.
+	 */
+	full = &(context->rescan);
+	memset(full, 0, sizeof(*full));
+	full->store = NULL;
+	full->buffer = scan_buffer;
+	full->stats = scan_stats;
+	full->generation = context->scan_generation;
+	full->trust_mtime = 1;
+	full->report_changes = context->snapshot_loaded;
+	context->snapshot_loaded = 0;
+	if (context->events_lost) {
+		full->report_changes = 1;
+		full->recovery = 1;
+		context->events_lost = 0;
+	}
+	context->full_scan_count++;
+
+	clock_gettime(CLOCK_MONOTONIC, &(context->rescan_started));
+
+	if ((1 < context->options.scan_threads) && (0 == dir->file_count)
+	    && (0 == dir->subdir_count)) {
+		rc = ds_dir_scan_parallel(full, context);
+		if (0 != rc)
+			return rc;
+		ds_rescan_finish(context);
+		return 0;
+	}
+
+	if (stat(context->absolute_path, &(context->rescan_topsb)) != 0) {
+		error("%s: %s: %s", context->absolute_path, "stat",
+		      strerror(errno));
+		return 1;
+	}
+
+	full->queue_subdirs = 1;
+	context->rescan_stack_length = 0;
+	ds_rescan_push(context, dir);
+	context->rescan_active = 1;
+
+	debug("%s: %s", "full scan", "started");
+
+	ds_rescan_continue(context);
+
+	return 0;
+}
+
+
+/*
+ * Check the files taken off the change queue by ds_change_queue_process()
+ * for changes, all at once.
+ *
+ * A changed file is only listed once it has settled - see
+ * ds_file_settle_delay() - and until then it is queued to be checked
+ * again; it is listed when a check finds it unchanged since the last one.
+ */
+static void ds_change_queue_check_files(ds_context_t context)
+{
+	time_t now;
+	int idx;
+
+	statbatch_run(context->check_stats, context->check_count);
+
+	time(&now);
+
+	for (idx = 0; idx < context->check_count; idx++) {
+		ds_file_t file = context->check_files[idx];
+		off_t old_size;
+		time_t old_mtime, delay;
+		int changed;
+
+		old_size = file->size;
+		old_mtime = file->mtime;
+
+		changed = ds_file_checkstat(file, &(context->check_stats[idx]));
+
+		if (0 > changed) {
+			mark_dir_changed(file->parent);
+			ds_file_remove(file);
+		} else if (0 < changed) {
+			delay =
+			    ds_file_settle_delay(file, old_size, old_mtime,
+						 now);
+			if (0 < delay) {
+				debug("%s: %s: %ld", ds_file_path(file),
+				      "waiting for file to settle",
+				      (long) delay);
+				file->settle_count++;
+				_ds_change_queue_add(context, now + delay,
+						     file, NULL);
+			} else {
+				file->settle_count = 0;
+				mark_file_changed(file);
+			}
+		} else if (0 < file->settle_count) {
+			file->settle_count = 0;
+			mark_file_changed(file);
+		}
+
+		if (0 <= changed)
+			file->closed = 0;
+
+		free((char *) (context->check_stats[idx].path));
+		context->check_stats[idx].path = NULL;
+	}
+
+	context->check_count = 0;
+}
+
+
+/*
+ * Process queued changes until the given time or until all queue entries
+ * we're ready to process have been done.  Files due to be checked are
+ * collected into batches, so that the stat() calls can be made together.
+ */
+static void ds_change_queue_process(ds_context_t context, time_t work_until)
+{
+	if (NULL == context)
+		return;
+
+	if (0 >= context->change_queue_length)
+		return;
+
+	debug("%s: %d", "change queue: starting run, queue length",
+	      context->change_queue_length);
+
+	/*
+	 * The entry at the top of the heap is always the one due soonest,
+	 * so keep taking entries off the top until we reach one that isn't
+	 * due yet, or we reach our work_until time.
+	 */
+	while (0 < context->change_queue_length) {
+		ds_change_queue_t entry;
+		ds_file_t file;
+		ds_dir_t dir;
+		time_t now;
+
+		entry = &(context->change_queue[0]);
+
+		time(&now);
+
+		if ((entry->when > now) || (now >= work_until))
+			break;
+
+		file = entry->file;
+		dir = entry->dir;
+
+		ds_change_queue_delete(context, 0);
+
+		if (NULL != file) {
+			debug("%s: %s", ds_file_path(file),
+			      "checking for changes");
+			context->check_files[context->check_count] = file;
+			context->check_stats[context->check_count].dirfd =
+			    AT_FDCWD;
+			context->check_stats[context->check_count].path =
+			    xstrdup(ds_file_abspath(file));
+			context->check_count++;
+			if (context->check_count >= CHECK_STAT_BATCH)
+				ds_change_queue_check_files(context);
+		} else if (NULL != dir) {
+			/*
+			 * The scan could remove files we are about to
+			 * check, so check them first.
+			 */
+			ds_change_queue_check_files(context);
+			debug("%s: %s", ds_dir_path(dir), "triggering scan");
+			ds_dir_scan(dir, 0);
+		}
+	}
+
+	ds_change_queue_check_files(context);
+
+	debug("%s: %d", "change queue: run ended, queue length",
+	      context->change_queue_length);
+}
+
+
+/*
+ * Move the directory "dir", and everything under it, to be a subdirectory
+ * called "name" of "newparent", as if it had been removed and then added
+ * again, but without having to read any of it again.  Watches are on the
+ * directories themselves, so they are unaffected.
+ */
+static void ds_dir_move(ds_dir_t dir, ds_dir_t newparent, const char *name)
+{
+	ds_context_t context = dir->context;
+	ds_dir_t oldparent = dir->parent;
+	flag_t flagged;
+
+	debug("%s: %s: %s", ds_dir_path(dir), "moving to",
+	      ds_path(newparent, name, 0));
+
+	/*
+	 * As on removal, anything listed as changed under the directory no
+	 * longer counts towards the old parent, which is listed instead.
+	 */
+	flagged = ds_dir_flagged(dir);
+	mark_dir_changed(oldparent);
+	if (flagged)
+		oldparent->changed_subdirs--;
+
+	ds_dir_unlink(dir);
+
+	if (0 != strcmp(dir->leaf, name)) {
+		char *leaf;
+		leaf = ds_name_store(&(context->store), name);
+		if (NULL == leaf) {
+			ds_dir_free(dir);
+			return;
+		}
+		ds_name_free(&(context->store), dir->leaf);
+		dir->leaf = leaf;
+		dir->leaf_hash = ds_name_hash(leaf);
+	}
+
+	if (ds_dir_link(&(context->store), newparent, dir) != 0) {
+		ds_dir_free(dir);
+		return;
+	}
+
+	/*
+	 * Count anything listed under it towards its new parents before
+	 * its depth changes, since that can remove things under it, and
+	 * list the directory itself as new.
+	 */
+	if (flagged)
+		ds_dir_flag_parents(dir);
+
+	ds_dir_set_depth(dir, newparent->depth + 1);
+
+	mark_dir_changed(dir);
+}
+
+
+/*
+ * Set the depth of the directory "dir" to "depth", and that of everything
+ * under it to match.  As in a scan, subdirectories that are now too deep
+ * are removed, and a directory that was too deep to have its own
+ * subdirectories added, but no longer is, is queued to be read again so
+ * that they are.
+ */
+static void ds_dir_set_depth(ds_dir_t dir, int depth)
+{
+	int max_depth = dir->context->options.max_dir_depth;
+	int idx;
+
+	if (dir->depth == depth)
+		return;
+
+	if ((dir->depth >= max_depth) && (depth < max_depth))
+		ds_change_queue_dir_add(dir, 0);
+
+	dir->depth = depth;
+	for (idx = 0; idx < dir->subdir_count; idx++) {
+		if (depth >= max_depth) {
+			debug("%s: %s", ds_dir_path(dir->subdirs[idx]),
+			      "too deep - removing");
+			ds_dir_remove(dir->subdirs[idx]);
+			/* Go back one, as this idx has now gone */
+			idx--;
+			continue;
+		}
+		ds_dir_set_depth(dir->subdirs[idx], depth + 1);
+	}
+}
+
+
+/*
+ * Hold on to the directory "dir", which has been moved away in a move
+ * event with the given cookie, until the event saying where it was moved
+ * to arrives.  If too many moves are already waiting, the oldest is given
+ * up on first.
+ */
+static void ds_move_hold(ds_context_t context, ds_dir_t dir,
+			 uint32_t cookie)
+{
+	struct ds_pending_move_s *move;
+
+	if (context->pending_move_count >= MOVE_PENDING_MAX)
+		ds_moves_expire(context, 1);
+
+	move = &(context->pending_moves[context->pending_move_count++]);
+	move->cookie = cookie;
+	move->dir = dir;
+	clock_gettime(CLOCK_MONOTONIC, &(move->when));
+
+	/*
+	 * Its old name is free for something else to be created under
+	 * while we wait, so lookups must not find it there.
+	 */
+	dir->moved_away = 1;
+}
+
+
+/*
+ * Remove the pending move at index "idx", keeping the rest in the order
+ * they were added.
+ */
+static void ds_move_delete(ds_context_t context, int idx)
+{
+	context->pending_move_count--;
+	memmove(&(context->pending_moves[idx]),
+		&(context->pending_moves[idx + 1]),
+		(context->pending_move_count -
+		 idx) * sizeof(context->pending_moves[0]));
+}
+
+
+/*
+ * Return the directory waiting to be moved with the given cookie, no
+ * longer holding on to it, or NULL if there isn't one.
+ */
+static ds_dir_t ds_move_take(ds_context_t context, uint32_t cookie)
+{
+	int idx;
+
+	for (idx = 0; idx < context->pending_move_count; idx++) {
+		ds_dir_t dir;
+		if (context->pending_moves[idx].cookie != cookie)
+			continue;
+		dir = context->pending_moves[idx].dir;
+		ds_move_delete(context, idx);
+		dir->moved_away = 0;
+		return dir;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Stop waiting to see where the directory "dir" was moved to, because it
+ * is being freed.
+ */
+static void ds_move_forget(ds_context_t context, ds_dir_t dir)
+{
+	int idx;
+
+	for (idx = 0; idx < context->pending_move_count; idx++) {
+		if (context->pending_moves[idx].dir != dir)
+			continue;
+		ds_move_delete(context, idx);
+		idx--;
+	}
+}
+
+
+/*
+ * Give up waiting for the other half of the oldest directory move if
+ * "all" is set, or of any that have waited MOVE_PAIR_MSEC milliseconds,
+ * and treat those directories as removed, since they must have been moved
+ * out of the tree.
+ */
+static void ds_moves_expire(ds_context_t context, flag_t all)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (0 < context->pending_move_count) {
+		struct ds_pending_move_s *move = &(context->pending_moves[0]);
+		ds_dir_t dir, parent;
+		long waited;
+
+		waited =
+		    (now.tv_sec - move->when.tv_sec) * 1000 +
+		    (now.tv_nsec - move->when.tv_nsec) / 1000000;
+		if ((!all) && (waited < MOVE_PAIR_MSEC))
+			break;
+
+		dir = move->dir;
+		parent = dir->parent;
+		ds_move_delete(context, 0);
+
+		debug("%s: %s", ds_dir_path(dir), "moved away - removing");
+		ds_dir_remove(dir);
+		mark_dir_changed(parent);
+
+		if (all)
+			break;
+	}
+}
+
+
+/*
+ * Return the number of milliseconds until the oldest pending directory
+ * move should be given up on, or -1 if there are none.
+ */
+static int ds_moves_timeout(ds_context_t context)
+{
+	struct timespec now;
+	long waited;
+
+	if (0 >= context->pending_move_count)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	waited =
+	    (now.tv_sec - context->pending_moves[0].when.tv_sec) * 1000 +
+	    (now.tv_nsec - context->pending_moves[0].when.tv_nsec) / 1000000;
+
+	if (waited >= MOVE_PAIR_MSEC)
+		return 0;
+
+	return MOVE_PAIR_MSEC - waited;
+}
+
+
+/*
+ * Process a change to a directory inside a watched directory.
+ *
+ * A directory moved from one place in the tree to another gives a move
+ * away event followed by a move here event with the same cookie.  The
+ * directory is held on to after the first, and when the second arrives, it
+ * is moved in memory along with everything under it, instead of being
+ * removed and then read again from scratch.  If the second never arrives,
+ * the directory was moved out of the tree, and ds_moves_expire() removes
+ * it; a move here with no first half is a directory moved into the tree,
+ * which is added as a new one.
+ */
+static void process_dir_change(struct inotify_event *event, ds_dir_t dir)
+{
+	ds_dir_t subdir;
+	inotify_action_t action;
+	const char *fullpath;
+	struct stat sb;
+	ds_dir_t newdir;
+	ds_dir_t moved;
+
+	/*
+	 * Find the directory structure to which this event refers, if
+	 * known.
+	 */
+	subdir = ds_dir_lookup(dir, event->name);
+
+	/*
+	 * Deal with the halves of a move within the tree.
+	 */
+	if ((event->mask & IN_MOVED_TO) && (0 != event->cookie)
+	    && (NULL != (moved = ds_move_take(dir->context, event->cookie)))) {
+		ds_dir_t oldparent = moved->parent;
+		if ((ds_filename_valid(dir->context, event->name) == 0)
+		    || (dir->depth >= dir->context->options.max_dir_depth)
+		    || (ds_path_excluded(dir, event->name, 1))) {
+			debug("%s: %s", ds_dir_path(moved),
+			      "moved somewhere ignored - removing");
+			ds_dir_remove(moved);
+			mark_dir_changed(oldparent);
+			return;
+		}
+		if (!exclude_uses_paths(dir->context->excludes)) {
+			if ((NULL != subdir) && (subdir != moved))
+				ds_dir_remove(subdir);
+			ds_dir_move(moved, dir, event->name);
+			return;
+		}
+		/*
+		 * With patterns that depend on where things are, different
+		 * things under the directory could be excluded in its new
+		 * place, so read it afresh there instead.
+		 */
+		debug("%s: %s", ds_dir_path(moved),
+		      "moved - rescanning in new place");
+		ds_dir_remove(moved);
+		mark_dir_changed(oldparent);
+		subdir = ds_dir_lookup(dir, event->name);
+	}
+	if ((event->mask & IN_MOVED_FROM) && (0 != event->cookie)
+	    && (NULL != subdir)) {
+		debug("%s: %s", ds_dir_path(subdir),
+		      "moved away - waiting to see where to");
+		ds_move_hold(dir->context, subdir, event->cookie);
+		return;
+	}
+
+	/*
+	 * Decide what to do: is this a newly created item, an existing item
+	 * that has been modified, or an existing item that has been
+	 * deleted?
+	 */
+	action = IN_ACTION_NONE;
+	if (event->mask & (IN_ATTRIB | IN_CREATE | IN_MODIFY |
+			   IN_MOVED_TO)) {
+		action = IN_ACTION_CREATE;
+		if (NULL != subdir)
+			action = IN_ACTION_UPDATE;
+	} else if ((event->mask & (IN_DELETE | IN_MOVED_FROM))
+		   && (NULL != subdir)) {
+		action = IN_ACTION_DELETE;
+	}
+
+	/*
+	 * A directory moved in on top of one we know about has replaced it,
+	 * so forget the old one and start again with the new one, rather
+	 * than rescanning it, which would not look under the old one's
+	 * subdirectories.
+	 */
+	if ((IN_ACTION_UPDATE == action) && (event->mask & IN_MOVED_TO)) {
+		debug("%s: %s", ds_dir_path(subdir), "replaced - removing");
+		ds_dir_remove(subdir);
+		mark_dir_changed(dir);
+		subdir = NULL;
+		action = IN_ACTION_CREATE;
+	}
+
+	switch (action) {
+	case IN_ACTION_NONE:
+		break;
+	case IN_ACTION_CREATE:
+		/*
+		 * This a new directory we've not seen before.
+		 */
+
+		/*
+		 * Ignore the directory if it doesn't pass the filename
+		 * filter.
+		 */
+		if (ds_filename_valid(dir->context, event->name) == 0) {
+			break;
+		}
+
+		fullpath = ds_path(dir, event->name, 1);
+
+		/*
+		 * Ignore the directory if it doesn't exist.
+		 */
+		if (lstat(fullpath, &sb) != 0)
+			break;
+
+		/*
+		 * Ignore it if it's not a directory.
+		 */
+		if (!S_ISDIR(sb.st_mode))
+			break;
+
+		/*
+		 * Add the new directory and queue a scan for it.
+		 */
+		debug("%s: %s", fullpath, "adding new subdirectory");
+		newdir = ds_dir_add(NULL, dir, event->name);
+		if (NULL == newdir)
+			break;
+		ds_change_queue_dir_add(newdir, 0);
+
+		/*
+		 * Mark this as a changed path.
+		 */
+		mark_dir_changed(newdir);
+
+		break;
+	case IN_ACTION_UPDATE:
+		/*
+		 * This a directory we've seen before, so queue a rescan for
+		 * it.
+		 */
+		debug("%s: %s", ds_dir_path(subdir), "queueing rescan");
+		ds_change_queue_dir_add(subdir, 0);
+		break;
+	case IN_ACTION_DELETE:
+		/*
+		 * If we've seen this directory before, delete its
+		 * structure.
+		 */
+		debug("%s: %s", ds_dir_path(subdir), "triggering removal");
+		ds_dir_remove(subdir);
+		/*
+		 * Mark the parent directory as a changed path.
+		 */
+		mark_dir_changed(dir);
+		break;
+	}
+}
+
+
+/*
+ * Process a change to a file inside a watched directory.
+ */
+static void process_file_change(struct inotify_event *event, ds_dir_t dir)
+{
+	ds_file_t file;
+	inotify_action_t action;
+	const char *fullpath;
+	struct stat sb;
+	ds_file_t newfile;
+	time_t when;
+
+	/*
+	 * Find the file structure to which this event refers, if known.
+	 */
+	file = ds_file_lookup(dir, event->name);
+
+	/*
+	 * A file that has been closed after writing is checked straight
+	 * away, rather than after the usual delay to let writes settle.
+	 */
+	when = 0;
+	if (event->mask & IN_CLOSE_WRITE) {
+		time(&when);
+		if (NULL != file)
+			file->closed = 1;
+	}
+
+	/*
+	 * Decide what to do: is this a newly created item, an existing item
+	 * that has been modified, or an existing item that has been
+	 * deleted?
+	 */
+	action = IN_ACTION_NONE;
+	if (event->mask & (IN_ATTRIB | IN_CREATE | IN_MODIFY |
+			   IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		action = IN_ACTION_CREATE;
+		if (NULL != file)
+			action = IN_ACTION_UPDATE;
+	} else if ((event->mask & (IN_DELETE | IN_MOVED_FROM))
+		   && (NULL != file)) {
+		action = IN_ACTION_DELETE;
+	}
+
+	switch (action) {
+	case IN_ACTION_NONE:
+		break;
+	case IN_ACTION_CREATE:
+		/*
+		 * This a new file we've not seen before.
+		 */
+
+		/*
+		 * Ignore the file if it doesn't pass the filename filter.
+		 */
+		if (ds_filename_valid(dir->context, event->name) == 0) {
+			break;
+		}
+
+		fullpath = ds_path(dir, event->name, 1);
+
+		/*
+		 * Ignore the file if it doesn't exist or it isn't a regular
+		 * file.
+		 */
+		if (lstat(fullpath, &sb) != 0)
+			break;
+		else if (!S_ISREG(sb.st_mode))
+			break;
+
+		/*
+		 * Add the new file and queue it to be checked.
+		 */
+		debug("%s: %s", fullpath, "adding new file");
+		newfile = ds_file_add(NULL, dir, event->name);
+		if ((NULL != newfile) && (event->mask & IN_CLOSE_WRITE))
+			newfile->closed = 1;
+		ds_change_queue_file_add(newfile, when);
+
+		break;
+	case IN_ACTION_UPDATE:
+		/*
+		 * This a file we've seen before, so queue a check for it.
+		 */
+		ds_change_queue_file_add(file, when);
+		break;
+	case IN_ACTION_DELETE:
+		/*
+		 * If we've seen this file before, delete its structure.
+		 */
+		debug("%s: %s", ds_file_path(file), "triggering removal");
+		/*
+		 * Mark the parent directory as a changed path.
+		 */
+		mark_dir_changed(file->parent);
+		ds_file_remove(file);
+		break;
+	}
+}
+
+
+/*
+ * Deal with the kernel's event queue having overflowed, which means that
+ * changes have been lost.  The overflow is counted, more events are read
+ * in one go for a while so that the queue is kept as short as possible,
+ * and a full scan is queued which reports everything it finds to
+ * be different, checking every file in directories whose timestamps have
+ * not changed.  If a full scan is already in progress, another is started
+ * when it ends, since the directories it has already scanned could have
+ * had changes that were lost.
+ */
+static void ds_events_lost(ds_context_t context)
+{
+	time_t now;
+
+	time(&now);
+
+	context->overflow_times[context->overflow_count % OVERFLOW_HISTORY] =
+	    now;
+	context->overflow_count++;
+	context->drain_events_until = now + OVERFLOW_DRAIN_SECONDS;
+
+	error("%s: %s", context->absolute_path,
+	      "event queue overflowed - rescanning");
+
+	context->events_lost = 1;
+	if (context->rescan_active) {
+		context->rescan_again = 1;
+	} else {
+		ds_change_queue_dir_add(context->topdir, 0);
+	}
+}
+
+
+/*
+ * Return the number of event queue overflows in the last hour, up to
+ * OVERFLOW_HISTORY.
+ */
+static unsigned long ds_overflows_last_hour(ds_context_t context)
+{
+	unsigned long count, idx;
+	time_t now;
+
+	time(&now);
+
+	count = context->overflow_count;
+	if (count > OVERFLOW_HISTORY)
+		count = OVERFLOW_HISTORY;
+
+	for (idx = 0; idx < count; idx++) {
+		if (context->overflow_times
+		    [(context->overflow_count - 1 - idx) % OVERFLOW_HISTORY] <=
+		    now - 3600)
+			break;
+	}
+
+	return idx;
+}
+
+
+/*
+ * Return nonzero if, having already made "reads" reads of events, we should
+ * read again if there are more events waiting, rather than going on to do
+ * other work first.  For a while after an overflow, more reads are allowed,
+ * to keep the queue as short as possible.
+ */
+static int ds_events_draining(ds_context_t context, int reads)
+{
+	if (reads < EVENT_DRAIN_READS)
+		return 1;
+	if ((reads < OVERFLOW_DRAIN_READS)
+	    && (context->drain_events_until > time(NULL)))
+		return 1;
+	return 0;
+}
+
+
+/*
+ * Process a single inotify event, or an event from another source that has
+ * been translated into one; "source" is used in debugging output.
+ */
+static void process_event(ds_context_t context, struct inotify_event *event,
+			  const char *source)
+{
+	ds_dir_t dir = NULL;
+
+	dir = ds_watch_index_lookup(context, event->wd);
+
+#if ENABLE_DEBUGGING
+	if (debugging_enabled) {
+		char flags[1024];
+		flags[0] = 0;
+		if (event->mask & IN_ACCESS)
+			strcat(flags, " IN_ACCESS");
+		if (event->mask & IN_ATTRIB)
+			strcat(flags, " IN_ATTRIB");
+		if (event->mask & IN_CLOSE_WRITE)
+			strcat(flags, " IN_CLOSE_WRITE");
+		if (event->mask & IN_CLOSE_NOWRITE)
+			strcat(flags, " IN_CLOSE_NOWRITE");
+		if (event->mask & IN_CREATE)
+			strcat(flags, " IN_CREATE");
+		if (event->mask & IN_DELETE)
+			strcat(flags, " IN_DELETE");
+		if (event->mask & IN_DELETE_SELF)
+			strcat(flags, " IN_DELETE_SELF");
+		if (event->mask & IN_MODIFY)
+			strcat(flags, " IN_MODIFY");
+		if (event->mask & IN_MOVE_SELF)
+			strcat(flags, " IN_MOVE_SELF");
+		if (event->mask & IN_MOVED_FROM)
+			strcat(flags, " IN_MOVED_FROM");
+		if (event->mask & IN_MOVED_TO)
+			strcat(flags, " IN_MOVED_TO");
+		if (event->mask & IN_OPEN)
+			strcat(flags, " IN_OPEN");
+		if (event->mask & IN_IGNORED)
+			strcat(flags, " IN_IGNORED");
+		if (event->mask & IN_ISDIR)
+			strcat(flags, " IN_ISDIR");
+		if (event->mask & IN_Q_OVERFLOW)
+			strcat(flags, " IN_Q_OVERFLOW");
+		if (event->mask & IN_UNMOUNT)
+			strcat(flags, " IN_UNMOUNT");
+		debug("%s: %d: %s: %.*s:%s", source, event->wd,
+		      NULL == dir ? "(unknown)" : ds_dir_path(dir),
+		      event->len,
+		      NULL == event->name
+		      && 0 < event->len ? "(none)" : event->name, flags);
+	}
+#endif				/* ENABLE_DEBUGGING */
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		ds_events_lost(context);
+		return;
+	}
+
+	/*
+	 * There's nothing we can do if we don't know which directory it
+	 * was.
+	 */
+	if (NULL == dir)
+		return;
+
+	if (event->mask & IN_DELETE_SELF) {
+		ds_dir_remove(dir);
+		return;
+	}
+
+	/*
+	 * If this isn't an event about a named thing in this directory, we
+	 * can't do anything.
+	 */
+	if (NULL == event->name)
+		return;
+	if (0 == event->name[0])
+		return;
+	if (0 >= event->len)
+		return;
+
+	if (event->mask & IN_ISDIR) {
+		process_dir_change(event, dir);
+	} else {
+		process_file_change(event, dir);
+	}
+}
+
+
+/*
+ * Process incoming inotify events, reading until there are none left, or
+ * until ds_events_draining() says to stop so that other work can be done.
+ */
+static void process_inotify_events(ds_context_t context)
+{
+	ssize_t got, pos;
+	int reads;
+
+	if (NULL == context)
+		return;
+
+	for (reads = 0; ds_events_draining(context, reads); reads++) {
+		if (0 > context->fd_inotify)
+			return;
+
+		got =
+		    read(context->fd_inotify, event_buffer,
+			 EVENT_BUFFER_SIZE);
+		if (got <= 0) {
+			if ((0 > got)
+			    && ((EAGAIN == errno) || (EINTR == errno)))
+				return;
+			error("%s: (%d): %s", "inotify read event", got,
+			      strerror(errno));
+			close(context->fd_inotify);
+			context->fd_inotify = -1;
+			return;
+		}
+
+		/*
+		 * Process each event that we've read.
+		 */
+		for (pos = 0; pos < got;) {
+			struct inotify_event *event;
+			event = (struct inotify_event *) &(event_buffer[pos]);
+			pos += sizeof(*event) + event->len;
+			process_event(context, event, "inotify");
+		}
+	}
+}
+
+
+/*
+ * Copy the event "event", read by the reader thread, into the event ring,
+ * waiting for the main thread to make room if the ring is full, during
+ * which time events build up in the kernel's queue instead.  Returns
+ * nonzero if the reader has been told to stop while waiting.
+ */
+static int ds_event_ring_put(ds_event_ring_t ring,
+			     const struct inotify_event *event)
+{
+	size_t length, padding, offset, head, used;
+
+	length = EVENT_RING_PADDED(sizeof(*event) + event->len);
+
+	head = ring->head;
+	offset = head & (EVENT_RING_SIZE - 1);
+	padding = 0;
+	if (offset + length > EVENT_RING_SIZE)
+		padding = EVENT_RING_SIZE - offset;
+
+	/*
+	 * Wait until the main thread has consumed enough for this event to
+	 * fit, including any padding needed to get it to the start.
+	 */
+	used = head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+	if (used + padding + length > EVENT_RING_SIZE) {
+		struct pollfd stop;
+
+		__atomic_store_n(&(ring->full_waits), ring->full_waits + 1,
+				 __ATOMIC_RELAXED);
+
+		memset(&stop, 0, sizeof(stop));
+		stop.fd = ring->fd_stop;
+		stop.events = POLLIN;
+
+		while (used + padding + length > EVENT_RING_SIZE) {
+			if (poll(&stop, 1, EVENT_RING_FULL_WAIT_MSEC) > 0)
+				return 1;
+			used =
+			    head - __atomic_load_n(&(ring->tail),
+						   __ATOMIC_ACQUIRE);
+		}
+	}
+
+	if (0 < padding) {
+		struct inotify_event *pad;
+		pad = (struct inotify_event *) &(ring->buffer[offset]);
+		memset(pad, 0, sizeof(*pad));
+		pad->wd = EVENT_RING_PAD;
+		head += padding;
+		offset = 0;
+	}
+
+	memcpy(&(ring->buffer[offset]), event, sizeof(*event) + event->len);
+	head += length;
+
+	/*
+	 * Publish the event only once it has been copied in.
+	 */
+	__atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+
+	used += padding + length;
+	if (used > ring->high_water)
+		__atomic_store_n(&(ring->high_water), used,
+				 __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+/*
+ * Main function of the inotify reader thread, which does nothing but read
+ * events from the kernel as soon as they arrive, copy them into the event
+ * ring, and wake up the main thread, until it is told to stop or the read
+ * fails.
+ */
+static void *ds_event_ring_reader(void *arg)
+{
+	ds_event_ring_t ring = arg;
+	struct pollfd fds[2];
+	sigset_t signals;
+	char *buffer;
+	uint64_t one = 1;
+
+	/*
+	 * Leave the exit signals to the main thread.
+	 */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	buffer = malloc(EVENT_BUFFER_SIZE);
+	if (NULL == buffer) {
+		error("%s: %s", "malloc", strerror(errno));
+		return NULL;
+	}
+
+	memset(fds, 0, sizeof(fds));
+	fds[0].fd = ring->fd_source;
+	fds[0].events = POLLIN;
+	fds[1].fd = ring->fd_stop;
+	fds[1].events = POLLIN;
+
+	while (1) {
+		ssize_t got, pos;
+
+		if (0 > poll(fds, 2, -1)) {
+			if (EINTR == errno)
+				continue;
+			error("%s: %s", "poll", strerror(errno));
+			break;
+		}
+		if (0 != fds[1].revents)
+			break;
+		if (0 == fds[0].revents)
+			continue;
+
+		got = read(ring->fd_source, buffer, EVENT_BUFFER_SIZE);
+		if (got <= 0) {
+			if ((0 > got)
+			    && ((EAGAIN == errno) || (EINTR == errno)))
+				continue;
+			error("%s: (%d): %s", "inotify read event", got,
+			      strerror(errno));
+			break;
+		}
+
+		for (pos = 0; pos < got;) {
+			struct inotify_event *event;
+			event = (struct inotify_event *) &(buffer[pos]);
+			pos += sizeof(*event) + event->len;
+			if (ds_event_ring_put(ring, event)) {
+				free(buffer);
+				return NULL;
+			}
+		}
+
+		if (write(ring->fd_ready, &one, sizeof(one)) < 0)
+			error("%s: %s", "eventfd write", strerror(errno));
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+
+/*
+ * Start a thread reading the context's inotify events into an event ring,
+ * for the main loop to wait on the ring's "fd_ready" descriptor instead of
+ * the inotify descriptor.  If it can't be started, events are read
+ * directly, as before.
+ */
+static void ds_event_ring_start(ds_context_t context)
+{
+	ds_event_ring_t ring;
+	int rc;
+
+	if (NULL == context)
+		return;
+	if (0 > context->fd_inotify)
+		return;
+
+	ring = calloc(1, sizeof(*ring));
+	if (NULL == ring) {
+		error("%s: %s", "calloc", strerror(errno));
+		return;
+	}
+
+	ring->fd_source = context->fd_inotify;
+	ring->fd_ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->fd_stop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->buffer = malloc(EVENT_RING_SIZE);
+
+	if ((0 > ring->fd_ready) || (0 > ring->fd_stop)) {
+		error("%s: %s", "eventfd", strerror(errno));
+	} else if (NULL == ring->buffer) {
+		error("%s: %s", "malloc", strerror(errno));
+	} else {
+		rc = pthread_create(&(ring->thread), NULL,
+				    ds_event_ring_reader, ring);
+		if (0 == rc) {
+			context->event_ring = ring;
+			return;
+		}
+		error("%s: %s", "pthread_create", strerror(rc));
+	}
+
+	error("%s", "reading events without a separate thread");
+	if (0 <= ring->fd_ready)
+		close(ring->fd_ready);
+	if (0 <= ring->fd_stop)
+		close(ring->fd_stop);
+	free(ring->buffer);
+	free(ring);
+}
+
+
+/*
+ * Stop the context's inotify reader thread, if there is one, and free its
+ * event ring, discarding any events still in it.
+ */
+static void ds_event_ring_stop(ds_context_t context)
+{
+	ds_event_ring_t ring;
+	uint64_t one = 1;
+
+	if (NULL == context)
+		return;
+	if (NULL == context->event_ring)
+		return;
+
+	ring = context->event_ring;
+	context->event_ring = NULL;
+
+	if (write(ring->fd_stop, &one, sizeof(one)) < 0)
+		error("%s: %s", "eventfd write", strerror(errno));
+	pthread_join(ring->thread, NULL);
+
+	close(ring->fd_ready);
+	close(ring->fd_stop);
+	free(ring->buffer);
+	free(ring);
+}
+
+
+/*
+ * Return nonzero if there are events waiting in the context's event ring.
+ */
+static int ds_event_ring_pending(ds_context_t context)
+{
+	ds_event_ring_t ring;
+
+	if (NULL == context)
+		return 0;
+	ring = context->event_ring;
+	if (NULL == ring)
+		return 0;
+
+	return __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) !=
+	    ring->tail ? 1 : 0;
+}
+
+
+/*
+ * Process events from the event ring, in batches of EVENT_RING_BATCH,
+ * until there are none left, or until ds_events_draining() says to stop
+ * so that other work can be done; the main loop comes straight back here
+ * if there are events left over.
+ */
+static void process_ring_events(ds_context_t context)
+{
+	ds_event_ring_t ring;
+	uint64_t count;
+	size_t head, tail;
+	int batches, events;
+
+	if (NULL == context)
+		return;
+	ring = context->event_ring;
+	if (NULL == ring)
+		return;
+
+	/*
+	 * Clear the wakeup first, so that any events added after this are
+	 * sure to wake us again.
+	 */
+	if (read(ring->fd_ready, &count, sizeof(count)) < 0) {
+		if (EAGAIN != errno)
+			error("%s: %s", "eventfd read", strerror(errno));
+	}
+
+	tail = ring->tail;
+
+	for (batches = 0; ds_events_draining(context, batches); batches++) {
+		head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		for (events = 0; (tail != head) && (events < EVENT_RING_BATCH);
+		     events++) {
+			struct inotify_event *event;
+			size_t offset, length;
+
+			offset = tail & (EVENT_RING_SIZE - 1);
+			event = (struct inotify_event *) &(ring->buffer[offset]);
+
+			if (EVENT_RING_PAD == event->wd) {
+				tail += EVENT_RING_SIZE - offset;
+				continue;
+			}
+
+			length =
+			    EVENT_RING_PADDED(sizeof(*event) + event->len);
+
+			process_event(context, event, "inotify");
+			tail += length;
+		}
+
+		/*
+		 * Hand the space back to the reader thread after each
+		 * batch, so it is not kept waiting if the ring is full.
+		 */
+		__atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+	}
+}
+
+
+#ifdef FAN_REPORT_DFID_NAME
+/*
+ * Read and process one buffer of fanotify events.  Each event carries the
+ * file handle of the directory it happened in, and the name of the thing
+ * in it that changed; the handle is looked up to find the directory's
+ * watch descriptor, and the event is translated into an inotify event so
+ * that it can be handled in the same way.  Events in directories we aren't
+ * tracking, which with a filesystem mark is most of them, are ignored.
+ *
+ * Returns nonzero if events were read, so there may be more waiting.
+ */
+static int process_fanotify_read(ds_context_t context)
+{
+	struct fanotify_event_metadata metadata;
+	union {
+		struct inotify_event event;
+		char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	} translated;
+	ssize_t got, pos;
+
+	if (NULL == context)
+		return 0;
+	if (0 > context->fd_fanotify)
+		return 0;
+
+	/*
+	 * Read as many events as we can.
+	 */
+	got = read(context->fd_fanotify, event_buffer, EVENT_BUFFER_SIZE);
+	if (got <= 0) {
+		if ((0 > got) && ((EAGAIN == errno) || (EINTR == errno)))
+			return 0;
+		error("%s: (%d): %s", "fanotify read event", got,
+		      strerror(errno));
+		close(context->fd_fanotify);
+		context->fd_fanotify = -1;
+		return 0;
+	}
+
+	/*
+	 * Process each event that we've read.
+	 */
+	for (pos = 0; pos + (ssize_t) sizeof(metadata) <= got;) {
+		struct fanotify_event_info_header *info;
+		struct file_handle *handle;
+		const char *name;
+		char *info_pos;
+		char *info_end;
+		size_t namelen;
+
+		/*
+		 * Events with names in them are only padded to 4 bytes, so
+		 * the 8-byte aligned metadata structure is copied out.
+		 */
+		memcpy(&metadata, &(event_buffer[pos]), sizeof(metadata));
+		if ((metadata.event_len < sizeof(metadata))
+		    || (pos + (ssize_t) metadata.event_len > got))
+			break;
+		info_pos = (char *) &(event_buffer[pos]) + metadata.metadata_len;
+		info_end = (char *) &(event_buffer[pos]) + metadata.event_len;
+		pos += metadata.event_len;
+
+		if (FANOTIFY_METADATA_VERSION != metadata.vers) {
+			error("%s: %s", "fanotify",
+			      "unexpected metadata version");
+			close(context->fd_fanotify);
+			context->fd_fanotify = -1;
+			return 0;
+		}
+
+		if (0 <= metadata.fd)
+			close(metadata.fd);
+
+		memset(&(translated.event), 0, sizeof(translated.event));
+		translated.event.wd = -1;
+
+		if (metadata.mask & FAN_Q_OVERFLOW) {
+			translated.event.mask = IN_Q_OVERFLOW;
+			process_event(context, &(translated.event),
+				      "fanotify");
+			continue;
+		}
+
+		/*
+		 * Find the directory handle and name.
+		 */
+		handle = NULL;
+		name = NULL;
+		while (info_pos + sizeof(*info) <= info_end) {
+			struct fanotify_event_info_fid *fid;
+
+			info = (struct fanotify_event_info_header *) info_pos;
+			if (0 == info->len)
+				break;
+			info_pos += info->len;
+
+			if (FAN_EVENT_INFO_TYPE_DFID_NAME != info->info_type)
+				continue;
+
+			fid = (struct fanotify_event_info_fid *) info;
+			handle = (struct file_handle *) (fid->handle);
+			name = (char *) (handle->f_handle) + handle->handle_bytes;
+			break;
+		}
+
+		if ((NULL == handle) || (NULL == name))
+			continue;
+
+		/*
+		 * Events about the directory itself have the name ".".
+		 */
+		namelen = strlen(name);
+		if ((0 == namelen) || (NAME_MAX < namelen)
+		    || (0 == strcmp(name, ".")))
+			continue;
+
+		translated.event.wd = ds_handle_index_lookup(context, handle);
+		if (0 > translated.event.wd)
+			continue;
+
+		if (metadata.mask & FAN_CREATE)
+			translated.event.mask |= IN_CREATE;
+		if (metadata.mask & FAN_DELETE)
+			translated.event.mask |= IN_DELETE;
+		if (metadata.mask & FAN_MODIFY)
+			translated.event.mask |= IN_MODIFY;
+		if (metadata.mask & FAN_CLOSE_WRITE)
+			translated.event.mask |= IN_CLOSE_WRITE;
+		if (metadata.mask & FAN_MOVED_FROM)
+			translated.event.mask |= IN_MOVED_FROM;
+		if (metadata.mask & FAN_MOVED_TO)
+			translated.event.mask |= IN_MOVED_TO;
+		if (metadata.mask & FAN_ONDIR)
+			translated.event.mask |= IN_ISDIR;
+
+		translated.event.len = namelen + 1;
+		memcpy(translated.event.name, name, namelen + 1);
+
+		process_event(context, &(translated.event), "fanotify");
+	}
+
+	return 1;
+}
+
+
+/*
+ * Process incoming fanotify events, reading until there are none left, or
+ * until ds_events_draining() says to stop so that other work can be done.
+ */
+static void process_fanotify_events(ds_context_t context)
+{
+	int reads;
+
+	if (NULL == context)
+		return;
+
+	for (reads = 0; ds_events_draining(context, reads); reads++) {
+		if (!process_fanotify_read(context))
+			return;
+	}
+}
+#endif				/* FAN_REPORT_DFID_NAME */
+
+
+/*
+ * Return nonzero if the given directory, or anything under it, is marked
+ * as changed.
+ */
+static int ds_dir_flagged(ds_dir_t dir)
+{
+	if (dir->changed)
+		return 1;
+	if (0 < dir->changed_files)
+		return 1;
+	if (0 < dir->changed_subdirs)
+		return 1;
+	return 0;
+}
+
+
+/*
+ * Return nonzero if a change to something directly inside the given
+ * directory is already covered by the changed paths list, because the
+ * directory itself is listed.  A partial sync copies only the entries
+ * directly inside a listed directory, so nothing further down is covered,
+ * even if the directory is new.
+ */
+static int ds_dir_listed(ds_dir_t dir)
+{
+	return dir->changed ? 1 : 0;
+}
+
+
+/*
+ * Record in the given directory's parents that it has just become flagged
+ * as changed (see ds_dir_flagged), so that dump_changed_paths() can find it
+ * by walking down from the top without visiting anything unchanged.
+ */
+static void ds_dir_flag_parents(ds_dir_t dir)
+{
+	ds_dir_t parent;
+
+	while (NULL != (parent = dir->parent)) {
+		flag_t already_flagged = ds_dir_flagged(parent);
+		parent->changed_subdirs++;
+		if (already_flagged)
+			break;
+		dir = parent;
+	}
+}
+
+
+/*
+ * Mark the given file as changed, so that its path is listed in the next
+ * changed paths file.
+ */
+static void mark_file_changed(ds_file_t file)
+{
+	flag_t parent_flagged;
+
+	if (NULL == file)
+		return;
+	if (NULL == file->parent)
+		return;
+	if (file->changed)
+		return;
+
+	debug("%s: %s", "adding to changed paths", ds_file_path(file));
+
+	parent_flagged = ds_dir_flagged(file->parent);
+	file->changed = 1;
+	file->parent->changed_files++;
+	if (!parent_flagged)
+		ds_dir_flag_parents(file->parent);
+}
+
+
+/*
+ * Mark the given directory as changed, so that its path is listed in the
+ * next changed paths file.
+ */
+static void mark_dir_changed(ds_dir_t dir)
+{
+	flag_t already_flagged;
+
+	if (NULL == dir)
+		return;
+	if (dir->changed)
+		return;
+
+	debug("%s: %s/", "adding to changed paths", ds_dir_path(dir));
+
+	already_flagged = ds_dir_flagged(dir);
+	dir->changed = 1;
+	if (!already_flagged)
+		ds_dir_flag_parents(dir);
+}
+
+
+/*
+ * Structure used to sort the changed items in a directory when writing
+ * them out.
+ */
+struct ds_changed_item_s {
+	const char *leaf;
+	ds_file_t file;
+	ds_dir_t dir;
+};
+
+
+/*
+ * Comparison function for sorting changed items by leafname.
+ */
+static int ds_changed_item_compare(const void *a, const void *b)
+{
+	return strcmp(((struct ds_changed_item_s *) a)->leaf,
+		      ((struct ds_changed_item_s *) b)->leaf);
+}
+
+
+/*
+ * Return a newly allocated array of the items in the given directory which
+ * are marked as changed, filling in *countptr with the array length.
+ */
+static struct ds_changed_item_s *ds_dir_changed_items(ds_dir_t dir,
+						      int *countptr)
+{
+	struct ds_changed_item_s *items;
+	int wanted, count, idx;
+
+	*countptr = 0;
+
+	wanted = dir->changed_files + dir->changed_subdirs;
+	if (0 >= wanted)
+		return NULL;
+
+	items = calloc(wanted, sizeof(items[0]));
+	if (NULL == items) {
+		die("%s: %s", "calloc", strerror(errno));
+		return NULL;
+	}
+
+	count = 0;
+
+	for (idx = 0; (idx < dir->subdir_count) && (count < wanted); idx++) {
+		if (!ds_dir_flagged(dir->subdirs[idx]))
+			continue;
+		items[count].leaf = dir->subdirs[idx]->leaf;
+		items[count].dir = dir->subdirs[idx];
+		count++;
+	}
+
+	for (idx = 0; (idx < dir->file_count) && (count < wanted); idx++) {
+		if (!dir->files[idx]->changed)
+			continue;
+		items[count].leaf = dir->files[idx]->leaf;
+		items[count].file = dir->files[idx];
+		count++;
+	}
+
+	*countptr = count;
+	return items;
+}
+
+
+/*
+ * Return nonzero if the files in the given directory should be listed as
+ * just the directory itself, because so many of them have changed.
+ */
+static int ds_dir_collapsed(ds_dir_t dir)
+{
+	if (0 == dir->context->options.collapse_threshold)
+		return 0;
+	if (dir->changed_files < dir->context->options.collapse_threshold)
+		return 0;
+	return 1;
+}
+
+
+static unsigned long dump_changed_dir(FILE *fptr, ds_dir_t dir,
+				      char **pathbuf, size_t *pathbuf_size,
+				      size_t pathlen);
+
+
+/*
+ * Write out the sorted array of "count" changed items from a directory,
+ * and everything changed under them, to the given stream, returning the
+ * number of lines written.  Changed files are left out if "collapsed" is
+ * set.  The buffer *pathbuf holds the path of the directory relative to
+ * the top level, with a trailing "/" unless it is the top level
+ * directory, and is extended as necessary.
+ */
+static unsigned long dump_changed_items(FILE *fptr,
+					struct ds_changed_item_s *items,
+					int count, flag_t collapsed,
+					char **pathbuf, size_t *pathbuf_size,
+					size_t pathlen)
+{
+	unsigned long written = 0;
+	int idx;
+
+	for (idx = 0; idx < count; idx++) {
+		size_t leaflen;
+
+		if ((NULL != items[idx].file) && (collapsed))
+			continue;
+
+		leaflen = strlen(items[idx].leaf);
+		if (pathlen + leaflen + 2 > *pathbuf_size) {
+			char *newptr;
+			size_t new_size = 2 * (pathlen + leaflen + 2);
+			newptr = realloc(*pathbuf, new_size);
+			if (NULL == newptr) {
+				die("%s: %s", "realloc", strerror(errno));
+				return written;
+			}
+			*pathbuf = newptr;
+			*pathbuf_size = new_size;
+		}
+
+		memcpy(*pathbuf + pathlen, items[idx].leaf, leaflen);
+
+		if (NULL != items[idx].file) {
+			fprintf(fptr, "%.*s\n", (int) (pathlen + leaflen),
+				*pathbuf);
+			written++;
+			continue;
+		}
+
+		(*pathbuf)[pathlen + leaflen] = '/';
+
+		if ((items[idx].dir->changed)
+		    || (ds_dir_collapsed(items[idx].dir))) {
+			fprintf(fptr, "%.*s\n",
+				(int) (pathlen + leaflen + 1), *pathbuf);
+			written++;
+		}
+
+		written +=
+		    dump_changed_dir(fptr, items[idx].dir, pathbuf,
+				     pathbuf_size, pathlen + leaflen + 1);
+	}
+
+	return written;
+}
+
+
+/*
+ * Write out the changed items under the given directory, in sorted order,
+ * to the given stream, returning the number of lines written, with
+ * *pathbuf as for dump_changed_items().
+ */
+static unsigned long dump_changed_dir(FILE *fptr, ds_dir_t dir,
+				      char **pathbuf, size_t *pathbuf_size,
+				      size_t pathlen)
+{
+	struct ds_changed_item_s *items;
+	int count;
+	unsigned long written;
+
+	items = ds_dir_changed_items(dir, &count);
+	if (NULL == items)
+		return 0;
+
+	qsort(items, count, sizeof(items[0]), ds_changed_item_compare);
+
+	written =
+	    dump_changed_items(fptr, items, count, ds_dir_collapsed(dir),
+			       pathbuf, pathbuf_size, pathlen);
+
+	free(items);
+
+	return written;
+}
+
+
+/*
+ * Clear the changed marks on everything under the given directory, and on
+ * the directory itself.
+ */
+static void clear_changed_dir(ds_dir_t dir)
+{
+	struct ds_changed_item_s *items;
+	int count, idx;
+
+	items = ds_dir_changed_items(dir, &count);
+
+	for (idx = 0; idx < count; idx++) {
+		if (NULL != items[idx].file) {
+			items[idx].file->changed = 0;
+		} else {
+			clear_changed_dir(items[idx].dir);
+		}
+	}
+
+	if (NULL != items)
+		free(items);
+
+	dir->changed = 0;
+	dir->changed_files = 0;
+	dir->changed_subdirs = 0;
+}
+
+
+/*
+ * Open a new temporary file for a list of changed paths in "savedir",
+ * filling in *savefileptr with the name it should be renamed to once it is
+ * complete, and *tmpfileptr with its temporary name.  Returns NULL on
+ * error.
+ */
+static FILE *dump_changed_open(const char *savedir, char **savefileptr,
+			       char **tmpfileptr)
+{
+	char *savefile;
+	char *tmpfile;
+	struct tm *tm;
+	time_t t;
+	int tmpfd;
+	FILE *fptr;
+
+	t = time(NULL);
+	tm = localtime(&t);
+
+	if (asprintf
+	    (&savefile, "%s/%04d%02d%02d-%02d%02d%02d.%d", savedir,
+	     tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour,
+	     tm->tm_min, tm->tm_sec, getpid()) < 0) {
 		die("%s: %s", "asprintf", strerror(errno));
+		return NULL;
+	}
+
+	tmpfd = ds_tmpfile(savefile, &tmpfile);
+	if (0 > tmpfd) {
+		free(savefile);
+		return NULL;
+	}
+
+	fptr = fdopen(tmpfd, "w");
+	if (NULL == fptr) {
+		error("%s: %s", tmpfile, strerror(errno));
+		close(tmpfd);
+		remove(tmpfile);
+		free(tmpfile);
+		free(savefile);
+		return NULL;
+	}
+
+	*savefileptr = savefile;
+	*tmpfileptr = tmpfile;
+
+	return fptr;
+}
+
+
+/*
+ * Close a file opened by dump_changed_open(), to which "written" lines
+ * were written, and rename it into place, freeing the file names.
+ * Returns nonzero on error.
+ */
+static int dump_changed_close(FILE *fptr, char *savefile, char *tmpfile,
+			      unsigned long written)
+{
+	int rc = 0;
+
+	fclose(fptr);
+
+	/*
+	 * If nothing was actually written out, for instance because the
+	 * only changed items were removed again, don't leave an empty file.
+	 */
+	if (0 == written) {
+		remove(tmpfile);
+	} else if (rename(tmpfile, savefile) != 0) {
+		error("%s: %s", savefile, strerror(errno));
+		remove(tmpfile);
+		rc = 1;
+	}
+
+	free(tmpfile);
+	free(savefile);
+
+	return rc;
+}
+
+
+/*
+ * Write out a new file containing the current changed paths under the
+ * subdirectory of the context's top level directory described by "view",
+ * relative to that subdirectory, without clearing them.  Nothing is
+ * written if the subdirectory is not in the tree.
+ */
+static void dump_changed_view(ds_context_t context, struct watch_view_s *view)
+{
+	ds_dir_t dir;
+	char *subdir;
+	char *component;
+	char *saveptr;
+	char *savefile;
+	char *tmpfile;
+	FILE *fptr;
+	char *pathbuf;
+	size_t pathbuf_size;
+	unsigned long written;
+
+	dir = context->topdir;
+	subdir = NULL;
+	if ((NULL != view->subdir) && ('\0' != view->subdir[0]))
+		subdir = xstrdup(view->subdir);
+	if (NULL != subdir) {
+		for (component = strtok_r(subdir, "/", &saveptr);
+		     (NULL != component) && (NULL != dir);
+		     component = strtok_r(NULL, "/", &saveptr)) {
+			dir = ds_dir_lookup(dir, component);
+		}
 		free(subdir);
-		return NULL;
-	}
-	if (NULL != dir->topdir) {
-		subdir->path =
-		    &(subdir->absolute_path
-		      [strlen(dir->topdir->absolute_path) + 1]);
-	} else {
-		subdir->path =
-		    &(subdir->absolute_path
-		      [strlen(dir->absolute_path) + 1]);
 	}
-	subdir->leaf = ds_leafname(subdir->absolute_path);
 
-	subdir->wd = -1;
-	subdir->depth = dir->depth + 1;
-	subdir->parent = dir;
-	subdir->topdir = dir->topdir;
-	subdir->seen_in_rescan = 0;
+	if ((NULL == dir) || (!ds_dir_flagged(dir)))
+		return;
 
-	/*
-	 * Add the subdirectory to the directory structure, and mark the
-	 * list as unsorted.
-	 */
-	dir->subdirs[dir->subdir_count] = subdir;
-	dir->subdir_count++;
-	dir->subdirs_unsorted = 1;
+	fptr = dump_changed_open(view->changedpath_dir, &savefile, &tmpfile);
+	if (NULL == fptr)
+		return;
 
-	return subdir;
+	written = 0;
+	if ((dir->changed) || (ds_dir_collapsed(dir))) {
+		fprintf(fptr, "/\n");
+		written++;
+	}
+
+	pathbuf_size = 4096;
+	pathbuf = malloc(pathbuf_size);
+	if (NULL == pathbuf) {
+		die("%s: %s", "malloc", strerror(errno));
+		return;
+	}
+	written +=
+	    dump_changed_dir(fptr, dir, &pathbuf, &pathbuf_size, 0);
+	free(pathbuf);
+
+	dump_changed_close(fptr, savefile, tmpfile, written);
 }
 
 
 /*
- * Free a directory information structure.  This includes all files and
- * directories it contains.
+ * Write out a new file containing the current changed paths list of the
+ * array of "count" contexts, which are the shards of one watch, and clear
+ * the list.  The shards' top level directories are all the same
+ * directory, with each shard holding different things under it, so their
+ * changed items are merged.  Any views of subdirectories that the
+ * context has are written out first - see dump_changed_view().
  *
- * The parent directory's "subdirs" list is updated to remove this
- * subdirectory from it.
+ * The paths are written in sorted order.  Directories are listed with a
+ * trailing "/", and the top level directory is listed as just "/".
  */
-static void ds_dir_remove(ds_dir_t dir)
+static void dump_changed_paths(ds_context_t *contexts, unsigned int count,
+			       const char *savedir)
 {
-	int item;
+	struct ds_changed_item_s *items;
+	int item_count;
+	char *savefile;
+	char *tmpfile;
+	FILE *fptr;
+	char *pathbuf;
+	size_t pathbuf_size;
+	unsigned long written;
+	flag_t flagged, top_listed;
+	unsigned int shard, view;
+
+	flagged = 0;
+	top_listed = 0;
+	item_count = 0;
+	for (shard = 0; shard < count; shard++) {
+		ds_dir_t topdir = contexts[shard]->topdir;
+		if (!ds_dir_flagged(topdir))
+			continue;
+		flagged = 1;
+		item_count += topdir->changed_files + topdir->changed_subdirs;
+		if ((topdir->changed) || (ds_dir_collapsed(topdir)))
+			top_listed = 1;
+	}
 
-	if (NULL == dir)
+	if (!flagged)
 		return;
 
-	/*
-	 * Remove the watch on this directory.
-	 */
-	if ((0 <= dir->wd) && (NULL != dir->topdir)
-	    && (0 <= dir->topdir->fd_inotify)) {
-		debug("%s: %s", dir->path, "removing watch");
-		if (inotify_rm_watch(dir->topdir->fd_inotify, dir->wd) !=
-		    0) {
-			/*
-			 * We can get EINVAL if the directory was deleted,
-			 * so just ignore that.
-			 */
-			if (errno != EINVAL) {
-				error("%s: %s", "inotify_rm_watch",
-				      strerror(errno));
-			}
-		}
-		ds_watch_index_remove(dir->topdir, dir->wd);
-		dir->wd = -1;
+	for (view = 0; view < contexts[0]->view_count; view++)
+		dump_changed_view(contexts[0], &(contexts[0]->views[view]));
+
+	fptr = dump_changed_open(savedir, &savefile, &tmpfile);
+	if (NULL == fptr)
+		return;
+
+	written = 0;
+	if (top_listed) {
+		fprintf(fptr, "/\n");
+		written++;
 	}
 
 	/*
-	 * Remove all files from this directory.
+	 * Gather the changed items from every shard's top level directory
+	 * and sort them together.
 	 */
-	if (NULL != dir->files) {
-		for (item = 0; item < dir->file_count; item++) {
-			/* wipe parent field to avoid wasted work */
-			dir->files[item]->parent = NULL;
-			ds_file_remove(dir->files[item]);
+	items = NULL;
+	if (0 < item_count) {
+		items = calloc(item_count, sizeof(items[0]));
+		if (NULL == items) {
+			die("%s: %s", "calloc", strerror(errno));
+			return;
 		}
-		free(dir->files);
-		dir->files = NULL;
-		dir->file_count = 0;
-		dir->file_array_alloced = 0;
 	}
+	item_count = 0;
+	for (shard = 0; shard < count; shard++) {
+		struct ds_changed_item_s *shard_items;
+		int shard_item_count;
+
+		shard_items =
+		    ds_dir_changed_items(contexts[shard]->topdir,
+					 &shard_item_count);
+		if (NULL == shard_items)
+			continue;
+		memcpy(&(items[item_count]), shard_items,
+		       shard_item_count * sizeof(items[0]));
+		item_count += shard_item_count;
+		free(shard_items);
+	}
+	if (0 < item_count)
+		qsort(items, item_count, sizeof(items[0]),
+		      ds_changed_item_compare);
+
+	pathbuf_size = 4096;
+	pathbuf = malloc(pathbuf_size);
+	if (NULL == pathbuf) {
+		die("%s: %s", "malloc", strerror(errno));
+		return;
+	}
+	written +=
+	    dump_changed_items(fptr, items, item_count,
+			       ds_dir_collapsed(contexts[0]->topdir),
+			       &pathbuf, &pathbuf_size, 0);
+	free(pathbuf);
+	free(items);
+
+	if (dump_changed_close(fptr, savefile, tmpfile, written) != 0)
+		return;
 
-	/*
-	 * Remove all subdirectories from this directory (recursive).
-	 */
-	if (NULL != dir->subdirs) {
-		for (item = 0; item < dir->subdir_count; item++) {
-			dir->subdirs[item]->parent = NULL;
-			ds_dir_remove(dir->subdirs[item]);
+	for (shard = 0; shard < count; shard++)
+		clear_changed_dir(contexts[shard]->topdir);
+}
+
+
+/*
+ * Create the WATCH_OVERFLOW_MARKER file in the changed paths directory, to
+ * tell the sync process that changes were lost from the event queue and
+ * that the changed paths files now include what was found by rescanning.
+ */
+static void write_overflow_marker(const char *savedir)
+{
+	char *markerfile;
+	int fd;
+
+	if (asprintf(&markerfile, "%s/%s", savedir, WATCH_OVERFLOW_MARKER) <
+	    0) {
+		die("%s: %s", "asprintf", strerror(errno));
+		return;
+	}
+
+	fd = open(markerfile, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+		  0644);
+	if (0 > fd) {
+		error("%s: %s", markerfile, strerror(errno));
+	} else {
+		close(fd);
+	}
+
+	free(markerfile);
+}
+
+
+/*
+ * Write the watcher status file, if we have one, in the same "parameter :
+ * value" format as the sync status file, for the array of "count"
+ * contexts that are the shards of one watch, adding up their figures.
+ */
+static void write_watcher_status(ds_context_t *contexts, unsigned int count)
+{
+	int tmpfd;
+	char *temp_filename;
+	FILE *status_fptr;
+	unsigned long file_count, dir_count, memory_used, queue_length;
+	unsigned long last_scan_files, last_scan_dirs, overflow_count;
+	unsigned long overflows_last_hour, rescan_dirs_done, rescan_dirs_left;
+	unsigned long write_watch_count, ring_size, ring_high_water;
+	unsigned long ring_full_waits;
+	const char *status_file;
+	double last_scan_duration;
+	time_t last_scan;
+	flag_t rescan_active;
+	unsigned int shard;
+
+	if ((NULL == contexts) || (1 > count))
+		return;
+	status_file = contexts[0]->options.status_file;
+	if (NULL == status_file)
+		return;
+
+	file_count = 0;
+	dir_count = 0;
+	memory_used = 0;
+	queue_length = 0;
+	last_scan = 0;
+	last_scan_files = 0;
+	last_scan_dirs = 0;
+	last_scan_duration = 0;
+	overflow_count = 0;
+	overflows_last_hour = 0;
+	rescan_active = 0;
+	rescan_dirs_done = 0;
+	rescan_dirs_left = 0;
+	write_watch_count = 0;
+	ring_size = 0;
+	ring_high_water = 0;
+	ring_full_waits = 0;
+
+	for (shard = 0; shard < count; shard++) {
+		ds_context_t context = contexts[shard];
+		ds_event_ring_t ring = context->event_ring;
+
+		file_count += context->store.file_count;
+		dir_count += context->store.dir_count;
+		/* Every shard has its own copy of the top directory. */
+		if (0 < shard)
+			dir_count--;
+		memory_used += context->store.memory_used;
+		queue_length += context->change_queue_length;
+		if (context->last_scan > last_scan)
+			last_scan = context->last_scan;
+		last_scan_files += context->last_scan_files;
+		last_scan_dirs += context->last_scan_dirs;
+		if (context->last_scan_duration > last_scan_duration)
+			last_scan_duration = context->last_scan_duration;
+		overflow_count += context->overflow_count;
+		overflows_last_hour += ds_overflows_last_hour(context);
+		if (context->rescan_active) {
+			rescan_active = 1;
+			rescan_dirs_done += context->rescan.dir_count;
+			rescan_dirs_left += context->rescan_stack_length;
 		}
-		free(dir->subdirs);
-		dir->subdirs = NULL;
-		dir->subdir_count = 0;
-		dir->subdir_array_alloced = 0;
-	}
-
-	/*
-	 * Remove this subdirectory from our parent's directory listing, if
-	 * we have a parent.  Note that when we call ourselves, above, we've
-	 * wiped the parent in the subdirectory, to avoid wasted work.
-	 */
-	if ((NULL != dir->parent) && (NULL != dir->leaf)) {
-		int readidx, writeidx;
-		for (readidx = 0, writeidx = 0;
-		     readidx < dir->parent->subdir_count; readidx++) {
-			if ((NULL != dir->parent->subdirs[readidx]->leaf)
-			    &&
-			    (strcmp
-			     (dir->parent->subdirs[readidx]->leaf,
-			      dir->leaf) == 0)
-			    ) {
-				continue;
-			}
-			if (readidx != writeidx) {
-				dir->parent->subdirs[writeidx] =
-				    dir->parent->subdirs[readidx];
-			}
-			writeidx++;
+		write_watch_count += context->write_watch_count;
+		if (NULL != ring) {
+			unsigned long high_water, full_waits;
+			high_water =
+			    __atomic_load_n(&(ring->high_water),
+					    __ATOMIC_RELAXED);
+			full_waits =
+			    __atomic_load_n(&(ring->full_waits),
+					    __ATOMIC_RELAXED);
+			ring_size = EVENT_RING_SIZE;
+			if (high_water > ring_high_water)
+				ring_high_water = high_water;
+			ring_full_waits += full_waits;
 		}
-		dir->parent->subdir_count = writeidx;
-		dir->parent->subdirs_unsorted = 1;
 	}
 
-	/* Remove the directory from the change queue. */
-	ds_change_queue_dir_remove(dir);
+	tmpfd = ds_tmpfile((char *) status_file, &temp_filename);
+	if (0 > tmpfd)
+		return;
 
-	/*
-	 * Free the memory used by the pathname.
-	 */
-	if (NULL != dir->absolute_path) {
-		debug("%s: %s", dir->path, "removing from directory list");
-		free(dir->absolute_path);
-		dir->absolute_path = NULL;
-		dir->path = NULL;
-		dir->leaf = NULL;
+	status_fptr = fdopen(tmpfd, "w");
+	if (NULL == status_fptr) {
+		error("%s: %s(%d): %s", temp_filename,
+		      "fdopen", tmpfd, strerror(errno));
+		close(tmpfd);
+		remove(temp_filename);
+		free(temp_filename);
+		return;
 	}
 
-	/*
-	 * Free the watch index.
-	 */
-	if (NULL != dir->watch_index) {
-		free(dir->watch_index);
-		dir->watch_index = NULL;
+	fprintf(status_fptr, "watcher process          : %d\n", getpid());
+	fprintf(status_fptr, "directory                : %s\n",
+		contexts[0]->absolute_path);
+	fprintf(status_fptr, "watcher shards           : %u\n", count);
+	fprintf(status_fptr, "files tracked            : %lu\n", file_count);
+	fprintf(status_fptr, "directories tracked      : %lu\n", dir_count);
+	fprintf(status_fptr, "memory used              : %lu\n",
+		memory_used);
+	fprintf(status_fptr, "bytes per file           : %lu\n",
+		file_count > 0 ? memory_used / file_count : 0);
+	fprintf(status_fptr, "change queue length      : %lu\n",
+		queue_length);
+	fprintf(status_fptr, "last full scan           : %s\n",
+		dump_time(last_scan));
+	fprintf(status_fptr, "last full scan files     : %lu\n",
+		last_scan_files);
+	fprintf(status_fptr, "last full scan dirs      : %lu\n",
+		last_scan_dirs);
+	fprintf(status_fptr, "last full scan seconds   : %.3f\n",
+		last_scan_duration);
+	fprintf(status_fptr, "last full scan files/sec : %.0f\n",
+		last_scan_duration >
+		0 ? last_scan_files / last_scan_duration : 0.0);
+	fprintf(status_fptr, "event queue overflows    : %lu\n",
+		overflow_count);
+	fprintf(status_fptr, "overflows in last hour   : %lu\n",
+		overflows_last_hour);
+	fprintf(status_fptr, "full scan running        : %s\n",
+		rescan_active ? "yes" : "no");
+	fprintf(status_fptr, "full scan dirs done      : %lu\n",
+		rescan_dirs_done);
+	fprintf(status_fptr, "full scan dirs left      : %lu\n",
+		rescan_dirs_left);
+	fprintf(status_fptr, "dirs watched for writes  : %lu\n",
+		write_watch_count);
+	fprintf(status_fptr, "event ring size          : %lu\n", ring_size);
+	fprintf(status_fptr, "event ring high water    : %lu\n",
+		ring_high_water);
+	fprintf(status_fptr, "event ring full waits    : %lu\n",
+		ring_full_waits);
+
+	fprintf(status_fptr, "\n");
+
+	fchmod(tmpfd, 0644);
+
+	fclose(status_fptr);
+
+	if (rename(temp_filename, status_file) != 0) {
+		error("%s: %s", status_file, strerror(errno));
 	}
+	remove(temp_filename);
+	free(temp_filename);
+}
 
-	/*
-	 * Free the change queue.
-	 */
-	if (NULL != dir->change_queue) {
-		free(dir->change_queue);
-		dir->change_queue = NULL;
-	}
 
-	/*
-	 * Free the changed paths list.
-	 */
-	if (NULL != dir->changed_paths) {
-		int idx;
-		for (idx = 0; idx < dir->changed_paths_length; idx++) {
-			free(dir->changed_paths[idx]);
-		}
-		free(dir->changed_paths);
-		dir->changed_paths = NULL;
-		dir->changed_paths_length = 0;
-		dir->changed_paths_alloced = 0;
-	}
+/*
+ * Write one record, followed by its padded name, to a snapshot file,
+ * adding its size to the header's "data_size".  Returns nonzero on error.
+ */
+static int ds_snapshot_write_record(FILE *fptr,
+				    struct ds_snapshot_header_s *header,
+				    struct ds_snapshot_record_s *record,
+				    const char *name)
+{
+	static const char padding[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	size_t length, padded;
+
+	length = strlen(name);
+	padded = SNAPSHOT_PADDED(length);
+
+	record->name_length = length;
+
+	if (fwrite(record, sizeof(*record), 1, fptr) != 1)
+		return 1;
+	if ((0 < length) && (fwrite(name, length, 1, fptr) != 1))
+		return 1;
+	if (fwrite(padding, padded - length, 1, fptr) != 1)
+		return 1;
 
-	/* Free the directory structure itself. */
-	free(dir);
+	header->data_size += sizeof(*record) + padded;
+
+	return 0;
 }
 
 
 /*
- * Filter for any filename.
- *
- * Ignore anything ending in .tmp or ~ by default, or if exclude_count is
- * >0, ignore anything matching any of the patterns in excludes[].
- *
- * Returns 1 if the file should be included, 0 if it should be ignored.
+ * Write the record for the directory "dir", whose containing directory's
+ * record number is "parent", to a snapshot file, followed by the records
+ * of its files and then, recursively, its subdirectories.  Returns nonzero
+ * on error.
  */
-static int ds_filename_valid(const char *leafname)
+static int ds_snapshot_write_dir(FILE *fptr,
+				 struct ds_snapshot_header_s *header,
+				 ds_dir_t dir, uint32_t parent)
 {
-	if (leafname[0] == 0)
-		return 0;
-	if ((leafname[0] == '.') && (leafname[1] == 0))
-		return 0;
-	if ((leafname[0] == '.') && (leafname[1] == '.')
-	    && (leafname[2] == 0))
-		return 0;
+	struct ds_snapshot_record_s record;
+	uint32_t dir_record;
+	int item;
+
+	dir_record = header->dir_count++;
+
+	memset(&record, 0, sizeof(record));
+	record.type = SNAPSHOT_DIR;
+	record.dir = parent;
+	record.mtime = dir->mtime.tv_sec;
+	record.mtime_nsec = dir->mtime.tv_nsec;
+	record.ctime = dir->ctime.tv_sec;
+	record.ctime_nsec = dir->ctime.tv_nsec;
+
+	if (ds_snapshot_write_record
+	    (fptr, header, &record,
+	     NULL == dir->parent ? dir->context->absolute_path : dir->leaf))
+		return 1;
+
+	for (item = 0; item < dir->file_count; item++) {
+		ds_file_t file = dir->files[item];
+
+		memset(&record, 0, sizeof(record));
+		record.type = SNAPSHOT_FILE;
+		record.dir = dir_record;
 
-	if (exclude_count > 0) {
 		/*
-		 * If given an exclusion list, use it.
+		 * A file waiting to settle already holds its new size and
+		 * mtime but is not listed yet, so it is saved as if it had
+		 * never been checked, for the next watcher to list it if
+		 * this one doesn't get to.
 		 */
-		int eidx;
-		for (eidx = 0; eidx < exclude_count; eidx++) {
-			if (NULL == excludes[eidx])
-				continue;
-			if (fnmatch(excludes[eidx], leafname, 0) == 0)
-				return 0;
+		if (0 == file->settle_count) {
+			record.size = file->size;
+			record.mtime = file->mtime;
 		}
-	} else {
-		/*
-		 * Default is to exclude *~ and *.tmp
-		 */
-		int namelen;
-		namelen = strlen(leafname);
-		if ((1 <= namelen) && (leafname[namelen - 1] == '~'))
-			return 0;
-		if ((namelen > 4)
-		    && (strcmp(&(leafname[namelen - 4]), ".tmp") == 0))
-			return 0;
+
+		if (ds_snapshot_write_record(fptr, header, &record, file->leaf))
+			return 1;
+		header->file_count++;
 	}
 
-	return 1;
+	for (item = 0; item < dir->subdir_count; item++) {
+		if (ds_snapshot_write_dir
+		    (fptr, header, dir->subdirs[item], dir_record))
+			return 1;
+	}
+
+	return 0;
 }
 
 
 /*
- * Filter for scanning directories - only include filenames we should be
- * processing.
+ * Wake up the thread looking after the shards, if this context is one.
  */
-static int scan_directory_filter(const struct dirent *d)
+static void ds_shard_notify(ds_context_t context)
 {
-	return ds_filename_valid(d->d_name);
+	uint64_t one = 1;
+
+	if (0 > context->fd_shard_notify)
+		return;
+
+	if (write(context->fd_shard_notify, &one, sizeof(one)) < 0)
+		error("%s: %s", "eventfd write", strerror(errno));
 }
 
 
 /*
- * Recursively scan the given directory.  Also checks files for changes. 
- * Returns nonzero if the scan failed, in which case the directory will have
- * been deleted from the lists.
+ * Report that something shown in the watcher status file has changed, so
+ * that the file is rewritten - straight away, or, if this context is one
+ * shard of a watch, by the thread looking after the shards, once it has
+ * woken up and can look at all of them.
+ */
+static void ds_status_changed(ds_context_t context)
+{
+	if (NULL == context)
+		return;
+
+	if (1 < context->shard_count) {
+		context->status_wanted = 1;
+		ds_shard_notify(context);
+		return;
+	}
+
+	write_watcher_status(&context, 1);
+}
+
+
+/*
+ * Save the whole tree to the snapshot file, if we have one, so that the
+ * next watcher to start on this directory can load it instead of building
+ * the tree from scratch.  The file is written under a temporary name and
+ * renamed into place, so a reader only ever sees a complete snapshot.
+ */
+static void ds_snapshot_save(ds_context_t context)
+{
+	struct ds_snapshot_header_s header;
+	int tmpfd;
+	char *temp_filename;
+	FILE *snapshot_fptr;
+	int failed;
+
+	if (NULL == context)
+		return;
+	if (NULL == context->snapshot_file)
+		return;
+
+	tmpfd = ds_tmpfile(context->snapshot_file, &temp_filename);
+	if (0 > tmpfd)
+		return;
+
+	snapshot_fptr = fdopen(tmpfd, "w");
+	if (NULL == snapshot_fptr) {
+		error("%s: %s(%d): %s", temp_filename,
+		      "fdopen", tmpfd, strerror(errno));
+		close(tmpfd);
+		remove(temp_filename);
+		free(temp_filename);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = 0x01020304;
+
+	/*
+	 * Write the header twice - once to leave room for it, and again at
+	 * the end, when the counts in it are known.
+	 */
+	failed = 0;
+	if (fwrite(&header, sizeof(header), 1, snapshot_fptr) != 1)
+		failed = 1;
+	if ((!failed)
+	    && (ds_snapshot_write_dir(snapshot_fptr, &header,
+				      context->topdir, 0) != 0))
+		failed = 1;
+	if ((!failed) && (fseek(snapshot_fptr, 0, SEEK_SET) != 0))
+		failed = 1;
+	if ((!failed)
+	    && (fwrite(&header, sizeof(header), 1, snapshot_fptr) != 1))
+		failed = 1;
+
+	fchmod(tmpfd, 0600);
+
+	if (fclose(snapshot_fptr) != 0)
+		failed = 1;
+
+	if (failed) {
+		error("%s: %s", temp_filename, strerror(errno));
+		remove(temp_filename);
+		free(temp_filename);
+		return;
+	}
+
+	if (rename(temp_filename, context->snapshot_file) != 0) {
+		error("%s: %s", context->snapshot_file, strerror(errno));
+	}
+	remove(temp_filename);
+	free(temp_filename);
+
+	debug("%s: %lu %s, %lu %s", "snapshot saved",
+	      (unsigned long) (header.dir_count), "directories",
+	      (unsigned long) (header.file_count), "files");
+}
+
+
+/*
+ * Load the tree saved by ds_snapshot_save() from the snapshot file, if we
+ * have one and it was saved by a watcher on the same directory, into the
+ * context's top level directory, which should be empty.  The file is
+ * mapped into memory and read in one pass.  Returns nonzero if a snapshot
+ * was loaded.
  *
- * If no_recurse is true, then no subdirectories are scanned, though
- * subdirectories are still added and removed as necessary.
+ * Nothing loaded is checked against the filesystem here; that is left to
+ * the first full scan afterwards (see ds_dir_scan()).  Entries that are
+ * now excluded, or too deep, are left out.
  */
-static int ds_dir_scan(ds_dir_t dir, flag_t no_recurse)
+static int ds_snapshot_load(ds_context_t context)
 {
-	struct dirent **namelist;
-	int namelist_length;
-	int ourpath_length;
-	int diridx, fileidx, itemidx;
-	struct stat dirsb;
+	const struct ds_snapshot_header_s *header;
+	const char *data;
+	const char *problem;
+	struct stat sb;
+	ds_dir_t *dirs;
+	uint64_t dir_records;
+	size_t pos;
+	void *map;
+	int fd;
 
-	if (NULL == dir)
-		return 1;
-	if (NULL == dir->absolute_path)
-		return 1;
+	if (NULL == context)
+		return 0;
+	if (NULL == context->snapshot_file)
+		return 0;
 
-	if (dir->depth > max_directory_depth) {
-		debug("%s: %s: %s", dir->path, "too deep - removing");
-		ds_dir_remove(dir);
-		return 1;
+	fd = open(context->snapshot_file, O_RDONLY | O_CLOEXEC);
+	if (0 > fd) {
+		if (ENOENT != errno)
+			error("%s: %s", context->snapshot_file,
+			      strerror(errno));
+		return 0;
 	}
 
-	if (lstat(dir->absolute_path, &dirsb) != 0) {
-		error("%s: %s: %s", dir->path, "lstat", strerror(errno));
-		ds_dir_remove(dir);
-		return 1;
+	if (fstat(fd, &sb) != 0) {
+		error("%s: %s: %s", context->snapshot_file, "fstat",
+		      strerror(errno));
+		close(fd);
+		return 0;
 	}
 
-	ourpath_length = strlen(dir->absolute_path);
+	if (sb.st_size < (off_t) sizeof(*header)) {
+		error("%s: %s", context->snapshot_file,
+		      "snapshot too short - ignoring");
+		close(fd);
+		return 0;
+	}
 
-	namelist_length =
-	    scandir(dir->absolute_path, &namelist, scan_directory_filter,
-		    alphasort);
-	if (0 > namelist_length) {
-		error("%s: %s: %s", dir->absolute_path, "scandir",
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		error("%s: %s: %s", context->snapshot_file, "mmap",
 		      strerror(errno));
-		ds_dir_remove(dir);
-		return 1;
+		return 0;
+	}
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	header = map;
+	data = (const char *) map + sizeof(*header);
+
+	if ((memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) !=
+	     0) || (SNAPSHOT_VERSION != header->version)
+	    || (0x01020304 != header->byte_order)
+	    || (header->data_size != sb.st_size - sizeof(*header))
+	    || (1 > header->dir_count) || (UINT32_MAX < header->dir_count)) {
+		error("%s: %s", context->snapshot_file,
+		      "not a valid snapshot - ignoring");
+		munmap(map, sb.st_size);
+		return 0;
+	}
+
+	dirs = calloc(header->dir_count, sizeof(dirs[0]));
+	if (NULL == dirs) {
+		die("%s: %s", "calloc", strerror(errno));
+		munmap(map, sb.st_size);
+		return 0;
+	}
+
+	problem = NULL;
+	dir_records = 0;
+	pos = 0;
+
+	while ((NULL == problem) && (pos < header->data_size)) {
+		const struct ds_snapshot_record_s *record;
+		const char *name;
+		size_t padded;
+		ds_dir_t parent;
+
+		if (header->data_size - pos < sizeof(*record)) {
+			problem = "truncated record";
+			break;
+		}
+		record = (const struct ds_snapshot_record_s *) (data + pos);
+		padded = SNAPSHOT_PADDED(record->name_length);
+		if (header->data_size - pos - sizeof(*record) < padded) {
+			problem = "truncated name";
+			break;
+		}
+		name = data + pos + sizeof(*record);
+		if (0 != name[record->name_length]) {
+			problem = "unterminated name";
+			break;
+		}
+		pos += sizeof(*record) + padded;
+
+		if ((SNAPSHOT_DIR == record->type) && (0 == dir_records)) {
+			/*
+			 * The first record is the top level directory.
+			 */
+			if (strcmp(name, context->absolute_path) != 0) {
+				problem = "snapshot is of another directory";
+				break;
+			}
+			context->topdir->mtime.tv_sec = record->mtime;
+			context->topdir->mtime.tv_nsec = record->mtime_nsec;
+			context->topdir->ctime.tv_sec = record->ctime;
+			context->topdir->ctime.tv_nsec = record->ctime_nsec;
+			dirs[dir_records++] = context->topdir;
+			continue;
+		}
+
+		if ((record->dir >= dir_records)
+		    || ((SNAPSHOT_DIR == record->type)
+			&& (dir_records >= header->dir_count))) {
+			problem = "bad directory record number";
+			break;
+		}
+
+		parent = dirs[record->dir];
+
+		if (SNAPSHOT_DIR == record->type) {
+			ds_dir_t dir = NULL;
+			if ((NULL != parent)
+			    && (ds_filename_valid(context, name)))
+				dir = ds_dir_add(NULL, parent, name);
+			if (NULL != dir) {
+				dir->mtime.tv_sec = record->mtime;
+				dir->mtime.tv_nsec = record->mtime_nsec;
+				dir->ctime.tv_sec = record->ctime;
+				dir->ctime.tv_nsec = record->ctime_nsec;
+			}
+			dirs[dir_records++] = dir;
+		} else if (SNAPSHOT_FILE == record->type) {
+			ds_file_t file = NULL;
+			if ((NULL != parent)
+			    && (ds_filename_valid(context, name)))
+				file = ds_file_add(NULL, parent, name);
+			if (NULL != file) {
+				file->mtime = record->mtime;
+				file->size = record->size;
+			}
+		} else {
+			problem = "unknown record type";
+		}
 	}
 
+	if ((NULL == problem) && (dir_records != header->dir_count))
+		problem = "wrong number of directories";
+
+	free(dirs);
+	munmap(map, sb.st_size);
+
 	/*
-	 * Mark all subdirectories and files as having not been seen, so we
-	 * can spot which ones have been removed after we've scanned the
-	 * directory.
+	 * If the snapshot was no good, throw away whatever was loaded from
+	 * it, so we start from scratch as if there had been no snapshot.
 	 */
-	for (diridx = 0; diridx < dir->subdir_count; diridx++) {
-		dir->subdirs[diridx]->seen_in_rescan = 0;
-	}
-	for (fileidx = 0; fileidx < dir->file_count; fileidx++) {
-		dir->files[fileidx]->seen_in_rescan = 0;
+	if (NULL != problem) {
+		ds_dir_t topdir = context->topdir;
+		error("%s: %s - %s", context->snapshot_file, problem,
+		      "ignoring");
+		while (0 < topdir->subdir_count)
+			ds_dir_remove(topdir->subdirs[0]);
+		while (0 < topdir->file_count)
+			ds_file_remove(topdir->files[0]);
+		memset(&(topdir->mtime), 0, sizeof(topdir->mtime));
+		memset(&(topdir->ctime), 0, sizeof(topdir->ctime));
+		return 0;
 	}
 
-	/*
-	 * Go through the directory scan results, adding new items to the
-	 * arrays.
-	 */
-	for (itemidx = 0; itemidx < namelist_length; itemidx++) {
-		char *item_full_path;
-		char *item_leaf;
-		struct stat sb;
+	debug("%s: %lu %s, %lu %s", "snapshot loaded",
+	      context->store.dir_count, "directories",
+	      context->store.file_count, "files");
 
-		if (asprintf(&item_full_path, "%s/%s", dir->absolute_path,
-			     namelist[itemidx]->d_name) < 0) {
-			die("%s: %s", "asprintf", strerror(errno));
-			return 1;
-		}
-		item_leaf = ds_leafname(item_full_path);
+	return 1;
+}
 
-		free(namelist[itemidx]);
 
-		if (ds_filename_valid(item_leaf) == 0) {
-			free(item_full_path);
-			continue;
-		}
+/*
+ * Handler for an exit signal such as SIGTERM - set a flag to trigger an
+ * exit.
+ */
+static void watch_dir_exitsignal(int signum)
+{
+	watch_dir_exit_now = 1;
+}
 
-		if (lstat(item_full_path, &sb) != 0) {
-			free(item_full_path);
-			continue;
-		}
 
-		if (S_ISREG(sb.st_mode)) {
-			ds_file_t file;
-			file = ds_file_add(dir, item_leaf);
-			if (NULL != file)
-				file->seen_in_rescan = 1;
-		} else if (S_ISDIR(sb.st_mode)) {
-			ds_dir_t subdir;
-			if (sb.st_dev == dirsb.st_dev) {
-				subdir = ds_dir_add(dir, item_leaf);
-				if (NULL != subdir)
-					subdir->seen_in_rescan = 1;
-			} else {
-				debug("%s/%s: %s", dir->path, item_leaf,
-				      "skipping - different filesystem");
-			}
-		}
 
-		free(item_full_path);
-	}
 
-	free(namelist);
+/*
+ * Add the descriptor "fd", if it is open, to the epoll set "fd_epoll", to
+ * be waited on for input, tagged with "idx", the index of the context it
+ * belongs to.
+ */
+static void watch_dir_epoll_add(int fd_epoll, int fd, unsigned int idx)
+{
+	struct epoll_event event;
+
+	if (0 > fd)
+		return;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = (((uint64_t) idx) << 32) | (uint32_t) fd;
+
+	if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+		error("%s: %s", "epoll_ctl", strerror(errno));
+}
+
+
+/*
+ * Create the event queue and the context for watching "toplevel_path" as
+ * shard "shard_index" of "shard_count", writing changed paths to
+ * "changedpath_dir", and fill in the tree from the shard's snapshot, if
+ * there is one.  Returns NULL on error.
+ */
+static ds_context_t watch_dir_open(const char *toplevel_path,
+				   const char *changedpath_dir,
+				   struct watch_options_s *options,
+				   unsigned int shard_index,
+				   unsigned int shard_count)
+{
+	int fd_inotify;			 /* fd to watch for inotify on */
+	int fd_fanotify;		 /* fd to watch for fanotify on */
+	ds_context_t context;		 /* top-level directory contents */
 
 	/*
-	 * Delete any subdirectories that we did not see on rescan, and
-	 * recursively scan those that we did.
+	 * If asked to, mark the whole filesystem for fanotify events, which
+	 * saves having to add a watch to every directory; if this fails, we
+	 * fall back to inotify.  A filesystem mark would give every shard
+	 * every event, so shards always use inotify.
 	 */
-	for (diridx = 0; diridx < dir->subdir_count; diridx++) {
-		if (dir->subdirs[diridx]->seen_in_rescan) {
-			if (no_recurse)
-				continue;
-			if (ds_dir_scan(dir->subdirs[diridx], 0) != 0) {
-				/* Go back one, as this diridx has now gone */
-				diridx--;
-			}
-		} else {
-			ds_dir_remove(dir->subdirs[diridx]);
-			/* Go back one, as this diridx has now gone */
-			diridx--;
+	fd_inotify = -1;
+	fd_fanotify = -1;
+	if ((options->use_fanotify) && (2 > shard_count)) {
+#ifdef FAN_REPORT_DFID_NAME
+		fd_fanotify =
+		    fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+				  FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY);
+		if (0 > fd_fanotify) {
+			error("%s: %s", "fanotify_init", strerror(errno));
+		} else if (fanotify_mark
+			   (fd_fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			    options->use_close_write ? DS_FANOTIFY_CLOSE_EVENTS
+			    : DS_FANOTIFY_EVENTS, AT_FDCWD,
+			    toplevel_path) != 0) {
+			error("%s: %s: %s", toplevel_path, "fanotify_mark",
+			      strerror(errno));
+			close(fd_fanotify);
+			fd_fanotify = -1;
 		}
+		if (0 > fd_fanotify)
+			error("%s", "falling back to inotify");
+#else				/* !FAN_REPORT_DFID_NAME */
+		error("%s", "fanotify not supported, using inotify");
+#endif				/* FAN_REPORT_DFID_NAME */
 	}
 
 	/*
-	 * Delete any files that we did not see on rescan.
+	 * Create the inotify event queue.
 	 */
-	for (fileidx = 0; fileidx < dir->file_count; fileidx++) {
-		if (dir->files[fileidx]->seen_in_rescan)
-			continue;
-		ds_file_remove(dir->files[fileidx]);
-		/* Go back one, as this fileidx has now gone */
-		fileidx--;
+	if (0 > fd_fanotify) {
+		fd_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (0 > fd_inotify) {
+			error("%s: %s", "inotify", strerror(errno));
+			return NULL;
+		}
 	}
 
 	/*
-	 * Check all files for changes.
+	 * Create the top-level directory memory structure.
 	 */
-	for (fileidx = 0; fileidx < dir->file_count; fileidx++) {
-		int changed;
-		changed = ds_file_checkchanged(dir->files[fileidx]);
-		if (0 > changed) {
-			ds_file_remove(dir->files[fileidx]);
-			/* Go back one, as this fileidx has now gone */
-			fileidx--;
-		}
+	context = ds_context_create(fd_inotify, fd_fanotify, toplevel_path);
+	if (NULL == context) {
+		if (0 <= fd_inotify)
+			close(fd_inotify);
+		if (0 <= fd_fanotify)
+			close(fd_fanotify);
+		return NULL;
 	}
 
+	context->options = *options;
+	if (1 > context->options.scan_threads)
+		context->options.scan_threads = 1;
+	if (1 > context->options.rescan_sample)
+		context->options.rescan_sample = 1;
+	if (0 < options->exclude_count)
+		context->excludes =
+		    exclude_compile(options->excludes,
+				    options->exclude_count);
+	context->changedpath_dir = changedpath_dir;
+	context->shard_index = shard_index;
+	context->shard_count = shard_count;
+
 	/*
-	 * Add an inotify watch to this directory if there isn't one
-	 * already.
+	 * Each shard keeps its own snapshot, named after the shard and the
+	 * number of shards, so that changing the number of shards can't
+	 * load a tree holding another shard's directories.
 	 */
-	if ((0 > dir->wd) && (NULL != dir->topdir)
-	    && (0 <= dir->topdir->fd_inotify)) {
-		debug("%s: %s", dir->path, "adding watch");
-		dir->wd =
-		    inotify_add_watch(dir->topdir->fd_inotify,
-				      dir->absolute_path,
-				      IN_CREATE | IN_DELETE | IN_MODIFY |
-				      IN_DELETE_SELF | IN_MOVED_FROM |
-				      IN_MOVED_TO);
-		if (0 > dir->wd) {
-			error("%s: %s: %s", dir->path, "inotify_add_watch",
-			      strerror(errno));
+	if (NULL != options->snapshot_file) {
+		int rc;
+		if (1 < shard_count) {
+			rc = asprintf(&(context->snapshot_file), "%s.%u-of-%u",
+				      options->snapshot_file, shard_index + 1,
+				      shard_count);
 		} else {
-			/*
-			 * Add this watch descriptor to the directory index,
-			 * so that we can find this directory structure when
-			 * an inotify event arrives.
-			 */
-			ds_watch_index_add(dir, dir->wd);
+			rc = asprintf(&(context->snapshot_file), "%s",
+				      options->snapshot_file);
+		}
+		if (0 > rc) {
+			die("%s: %s", "asprintf", strerror(errno));
+			context->snapshot_file = NULL;
 		}
 	}
 
-	return 0;
+	/*
+	 * Fill in the tree from the last snapshot, if there is one, so that
+	 * the first full scan only has to look at what has changed since.
+	 */
+	context->snapshot_loaded = ds_snapshot_load(context);
+
+	return context;
 }
 
 
 /*
- * Process queued changes until the given time or until all queue entries
- * we're ready to process have been done.
+ * Free a context made by watch_dir_open(), closing its event queue.
  */
-static void ds_change_queue_process(ds_dir_t topdir, time_t work_until)
+static void watch_dir_close(ds_context_t context)
 {
-	int readidx, writeidx;
+	int fd_inotify, fd_fanotify;
 
-	if (NULL == topdir)
+	if (NULL == context)
 		return;
 
-	if (0 >= topdir->change_queue_length)
-		return;
-
-	debug("%s: %d", "change queue: starting run, queue length",
-	      topdir->change_queue_length);
-
-	for (readidx = 0, writeidx = 0;
-	     readidx < topdir->change_queue_length; readidx++) {
-		ds_change_queue_t entry;
-		time_t now;
-
-		entry = &(topdir->change_queue[readidx]);
-		if ((entry->file == NULL) && (entry->dir == NULL))
-			continue;
+	fd_inotify = context->fd_inotify;
+	fd_fanotify = context->fd_fanotify;
 
-		time(&now);
+	ds_context_destroy(context);
 
-		/*
-		 * Skip if it's not yet time for this item, or if we've
-		 * reached our work_until time.
-		 */
-		if ((entry->when > now) || (now >= work_until)) {
-			if (readidx != writeidx) {
-				memcpy(&(topdir->change_queue[writeidx]),
-				       &(topdir->change_queue[readidx]),
-				       sizeof(*entry));
-				writeidx++;
-			}
-			writeidx++;
-			continue;
-		}
+	if (0 <= fd_inotify)
+		close(fd_inotify);
+	if (0 <= fd_fanotify)
+		close(fd_fanotify);
+}
 
-		if (NULL != entry->file) {
-			int changed;
-			ds_file_t file;
 
-			file = entry->file;
-			entry->file = NULL;
+/*
+ * Free the buffers that the calling thread has used for scanning and
+ * reading events.
+ */
+static void watch_dir_thread_release(void)
+{
+	if (NULL != scan_buffer) {
+		free(scan_buffer);
+		scan_buffer = NULL;
+	}
+	if (NULL != scan_stats) {
+		free(scan_stats);
+		scan_stats = NULL;
+	}
+	if (NULL != event_buffer) {
+		free(event_buffer);
+		event_buffer = NULL;
+	}
 
-			debug("%s: %s", file->path,
-			      "checking for changes");
-			changed = ds_file_checkchanged(file);
-
-			if (0 > changed) {
-				mark_path_changed(file->parent->topdir,
-						  file->parent->path, 1);
-				ds_file_remove(file);
-			} else if (0 < changed) {
-				mark_path_changed(file->parent->topdir,
-						  file->path, 0);
-			}
-		} else if (NULL != entry->dir) {
-			ds_dir_t dir;
+	ds_path_release();
+	statbatch_release();
+}
 
-			dir = entry->dir;
-			entry->dir = NULL;
 
-			debug("%s: %s", dir->path, "triggering scan");
-			ds_dir_scan(dir, 0);
-		}
+/*
+ * Return the time at which the main loop next has something to do for
+ * the given context: the next full scan, the next queue run if anything
+ * in the queue is due by then, and the next dump of changed paths if
+ * there are any.
+ */
+static time_t watch_dir_wake_time(ds_context_t context)
+{
+	time_t wake_at;
+
+	wake_at = context->next_full_scan;
+	if (0 < context->change_queue_length) {
+		time_t due = context->change_queue[0].when;
+		if (due < context->next_change_queue_run)
+			due = context->next_change_queue_run;
+		if (due < wake_at)
+			wake_at = due;
 	}
+	if ((2 > context->shard_count) && (NULL != context->topdir)
+	    && (ds_dir_flagged(context->topdir))
+	    && (context->next_changedpath_dump < wake_at))
+		wake_at = context->next_changedpath_dump;
 
-	topdir->change_queue_length = writeidx;
+	return wake_at;
+}
 
-	debug("%s: %d", "change queue: run ended, queue length",
-	      topdir->change_queue_length);
+
+/*
+ * Return the number of milliseconds the main loop may wait for events
+ * before it has to come back to the given context: not at all if a full
+ * scan is in progress or events were left in the event ring last time,
+ * and otherwise no longer than any directory move can wait for its other
+ * half, or -1 if there is no limit.
+ */
+static int watch_dir_wait_time(ds_context_t context)
+{
+	if ((context->rescan_active) || (ds_event_ring_pending(context)))
+		return 0;
+	return ds_moves_timeout(context);
 }
 
 
 /*
- * Process a change to a directory inside a watched directory.
+ * Do whatever is due for the given context, once the main loop has read
+ * the events that woke it up.
  */
-static void process_dir_change(struct inotify_event *event, ds_dir_t dir)
+static void watch_dir_run_context(ds_context_t context)
 {
-	ds_dir_t subdir;
-	inotify_action_t action;
-	int idx;
-	char *fullpath;
-	struct stat sb;
-	ds_dir_t newdir;
+	struct watch_options_s *options = &(context->options);
+	flag_t sharded;			 /* set if context is a shard */
+	unsigned int idx;
+	time_t now;
+
+	sharded = 1 < context->shard_count ? 1 : 0;
 
 	/*
-	 * Find the directory structure to which this event refers, if
-	 * known.
+	 * Take the next events from the event ring, whether we were woken
+	 * for new ones or some were left over last time.
 	 */
-	subdir = NULL;
-	for (idx = 0; idx < dir->subdir_count; idx++) {
-		if (NULL == dir->subdirs[idx]->leaf)
-			continue;
-		if (strcmp(event->name, dir->subdirs[idx]->leaf) != 0)
-			continue;
-		subdir = dir->subdirs[idx];
-		break;
+	if ((context->ring_ready) || (ds_event_ring_pending(context))) {
+		context->ring_ready = 0;
+		process_ring_events(context);
 	}
 
 	/*
-	 * Decide what to do: is this a newly created item, an existing item
-	 * that has been modified, or an existing item that has been
-	 * deleted?
+	 * Give up on any directory moves that have waited too long for
+	 * their other half.
 	 */
-	action = IN_ACTION_NONE;
-	if (event->mask & (IN_ATTRIB | IN_CREATE | IN_MODIFY |
-			   IN_MOVED_TO)) {
-		action = IN_ACTION_CREATE;
-		if (NULL != subdir)
-			action = IN_ACTION_UPDATE;
-	} else if ((event->mask & (IN_DELETE | IN_MOVED_FROM))
-		   && (NULL != subdir)) {
-		action = IN_ACTION_DELETE;
-	}
-
-	switch (action) {
-	case IN_ACTION_NONE:
-		break;
-	case IN_ACTION_CREATE:
-		/*
-		 * This a new directory we've not seen before.
-		 */
-
-		/*
-		 * Ignore the directory if it doesn't pass the filename
-		 * filter.
-		 */
-		if (ds_filename_valid(event->name) == 0) {
-			break;
-		}
+	ds_moves_expire(context, 0);
 
-		/*
-		 * Make a copy of the full pathname.
-		 */
-		if (asprintf(&fullpath, "%s/%s", dir->absolute_path,
-			     event->name) < 0) {
-			die("%s: %s", "asprintf", strerror(errno));
-			return;
-		}
+	/*
+	 * Carry on with any full scan in progress.
+	 */
+	ds_rescan_continue(context);
 
-		/*
-		 * Ignore the directory if it doesn't exist.
-		 */
-		if (lstat(fullpath, &sb) != 0) {
-			free(fullpath);
-			break;
-		}
+	/*
+	 * Once a scan to recover from lost events has finished, write out
+	 * what it found straight away, and let the sync process know that
+	 * it should sync it soon.  A shard leaves this to
+	 * watch_dir_shards(), which the end of the scan has already woken
+	 * up.
+	 */
+	if ((!sharded) && (context->recovered)) {
+		context->recovered = 0;
+		dump_changed_paths(&context, 1, context->changedpath_dir);
+		write_overflow_marker(context->changedpath_dir);
+		for (idx = 0; idx < context->view_count; idx++)
+			write_overflow_marker(context->views[idx].
+					      changedpath_dir);
+		write_watcher_status(&context, 1);
+	}
 
-		/*
-		 * Ignore it if it's not a directory.
-		 */
-		if (!S_ISDIR(sb.st_mode)) {
-			free(fullpath);
-			break;
-		}
+	time(&now);
 
-		/*
-		 * Add the new directory and queue a scan for it.
-		 */
-		debug("%s: %s", fullpath, "adding new subdirectory");
-		newdir = ds_dir_add(dir, event->name);
-		free(fullpath);
-		ds_change_queue_dir_add(newdir, 0);
+	/*
+	 * Do a full scan periodically.
+	 */
+	if (now >= context->next_full_scan) {
+		context->next_full_scan = now + options->full_scan_interval;
+		ds_change_queue_dir_add(context->topdir, 0);
+	}
 
-		/*
-		 * Mark this as a changed path.
-		 */
-		mark_path_changed(dir->topdir, newdir->path, 1);
+	/*
+	 * Run our change queue.
+	 */
+	if (now >= context->next_change_queue_run) {
+		context->next_change_queue_run =
+		    now + options->queue_run_interval;
+		ds_change_queue_process(context,
+					now + options->queue_run_max_seconds);
+	}
 
-		break;
-	case IN_ACTION_UPDATE:
-		/*
-		 * This a directory we've seen before, so queue a rescan for
-		 * it.
-		 */
-		debug("%s: %s", subdir->path, "queueing rescan");
-		ds_change_queue_dir_add(subdir, 0);
-		break;
-	case IN_ACTION_DELETE:
-		/*
-		 * If we've seen this directory before, delete its
-		 * structure.
-		 */
-		debug("%s: %s", subdir->path, "triggering removal");
-		ds_dir_remove(subdir);
-		/*
-		 * Mark the parent directory as a changed path.
-		 */
-		mark_path_changed(dir->topdir, dir->path, 1);
-		break;
+	/*
+	 * Dump our list of changed paths.
+	 */
+	if ((!sharded) && (now >= context->next_changedpath_dump)) {
+		context->next_changedpath_dump =
+		    now + options->changedpath_dump_interval;
+		dump_changed_paths(&context, 1, context->changedpath_dir);
+		write_watcher_status(&context, 1);
 	}
 }
 
 
 /*
- * Process a change to a file inside a watched directory.
+ * Run the main loop for the "count" contexts in "contexts" until
+ * "fd_stop", which is either the signalfd for the exit signals or an
+ * eventfd written to stop a shard, becomes readable, or until an exit
+ * signal is caught.  Each context's changed paths are written to its own
+ * changed paths directory, unless the context is a shard, in which case
+ * watch_dir_shards() writes them out for all of the shards together.
+ * Returns nonzero on error.
+ *
+ * A shard is always run on its own, and its thread holds the shard's
+ * lock for everything it does except waiting, so that watch_dir_shards()
+ * can look at it in between.
  */
-static void process_file_change(struct inotify_event *event, ds_dir_t dir)
+static int watch_dir_loop(ds_context_t *contexts, unsigned int count,
+			  int fd_stop)
 {
-	ds_file_t file;
-	inotify_action_t action;
-	int idx;
-	char *fullpath;
-	struct stat sb;
-	ds_file_t newfile;
-
-	/*
-	 * Find the file structure to which this event refers, if known.
-	 */
-	file = NULL;
-	for (idx = 0; idx < dir->file_count; idx++) {
-		if (NULL == dir->files[idx]->leaf)
-			continue;
-		if (strcmp(event->name, dir->files[idx]->leaf) != 0)
-			continue;
-		file = dir->files[idx];
-		break;
+	pthread_mutex_t *shard_lock;	 /* lock to hold, if a shard */
+	time_t timer_set_for;		 /* when fd_timer will go off */
+	int fd_epoll;			 /* fd to wait for everything on */
+	int fd_timer;			 /* timerfd for the next deadline */
+	flag_t stop;			 /* set when fd_stop is readable */
+	unsigned int idx;
+
+	shard_lock = NULL;
+	if ((1 == count) && (1 < contexts[0]->shard_count))
+		shard_lock = &(contexts[0]->shard_lock);
+
+	if (NULL == event_buffer) {
+		event_buffer = malloc(EVENT_BUFFER_SIZE);
+		if (NULL == event_buffer) {
+			die("%s: %s", "malloc", strerror(errno));
+			return 1;
+		}
 	}
 
 	/*
-	 * Decide what to do: is this a newly created item, an existing item
-	 * that has been modified, or an existing item that has been
-	 * deleted?
+	 * Set up the descriptors the loop waits on: the event queues, a
+	 * timer for the next thing that is due, and the stop descriptor.
 	 */
-	action = IN_ACTION_NONE;
-	if (event->mask & (IN_ATTRIB | IN_CREATE | IN_MODIFY |
-			   IN_MOVED_TO)) {
-		action = IN_ACTION_CREATE;
-		if (NULL != file)
-			action = IN_ACTION_UPDATE;
-	} else if ((event->mask & (IN_DELETE | IN_MOVED_FROM))
-		   && (NULL != file)) {
-		action = IN_ACTION_DELETE;
+	fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (0 > fd_epoll) {
+		error("%s: %s", "epoll_create1", strerror(errno));
+		return 1;
 	}
 
-	switch (action) {
-	case IN_ACTION_NONE:
-		break;
-	case IN_ACTION_CREATE:
-		/*
-		 * This a new file we've not seen before.
-		 */
+	fd_timer = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (0 > fd_timer) {
+		error("%s: %s", "timerfd_create", strerror(errno));
+		close(fd_epoll);
+		return 1;
+	}
+
+	for (idx = 0; idx < count; idx++) {
+		ds_context_t context = contexts[idx];
 
 		/*
-		 * Ignore the file if it doesn't pass the filename filter.
+		 * Read inotify events in a thread of their own, so that
+		 * they are still read while the main loop is busy; the
+		 * main loop then waits on the event ring instead of the
+		 * inotify descriptor.  This is done after the exit signals
+		 * are blocked, so that the thread never sees them.
+		 *
+		 * When watching several trees at once, their events are
+		 * read directly instead, since a reader thread and ring
+		 * for each one would cost more than a shared watcher saves.
 		 */
-		if (ds_filename_valid(event->name) == 0) {
-			break;
+		if (1 == count)
+			ds_event_ring_start(context);
+
+		if (NULL != context->event_ring) {
+			watch_dir_epoll_add(fd_epoll,
+					    context->event_ring->fd_ready,
+					    idx);
+		} else {
+			watch_dir_epoll_add(fd_epoll, context->fd_inotify,
+					    idx);
 		}
+		watch_dir_epoll_add(fd_epoll, context->fd_fanotify, idx);
+
+		context->next_change_queue_run = 0;
+		context->next_full_scan = 0;
+		context->next_changedpath_dump = 0;
+	}
+
+	watch_dir_epoll_add(fd_epoll, fd_timer, 0);
+	watch_dir_epoll_add(fd_epoll, fd_stop, 0);
+
+	/*
+	 * Enter the main loop.
+	 */
+
+	timer_set_for = 0;
+	stop = 0;
+
+	if (NULL != shard_lock)
+		pthread_mutex_lock(shard_lock);
+
+	while ((!watch_dir_exit_now) && (!stop)) {
+		struct epoll_event ready_events[16];
+		time_t now, wake_at;
+		int ready, ready_idx, timeout;
 
 		/*
-		 * Make a copy of the full pathname.
+		 * Set the timer for the next thing that needs doing for
+		 * any of the contexts.  Nothing else wakes us up, so when
+		 * there is nothing to do, we don't wake at all.
 		 */
-		if (asprintf(&fullpath, "%s/%s", dir->absolute_path,
-			     event->name) < 0) {
-			die("%s: %s", "asprintf", strerror(errno));
-			return;
+		wake_at = watch_dir_wake_time(contexts[0]);
+		for (idx = 1; idx < count; idx++) {
+			time_t context_wake_at;
+			context_wake_at = watch_dir_wake_time(contexts[idx]);
+			if (context_wake_at < wake_at)
+				wake_at = context_wake_at;
+		}
+		if (1 > wake_at)
+			wake_at = 1;
+		if (wake_at != timer_set_for) {
+			struct itimerspec timer_value;
+			memset(&timer_value, 0, sizeof(timer_value));
+			timer_value.it_value.tv_sec = wake_at;
+			if (timerfd_settime
+			    (fd_timer, TFD_TIMER_ABSTIME, &timer_value,
+			     NULL) != 0) {
+				error("%s: %s", "timerfd_settime",
+				      strerror(errno));
+			}
+			timer_set_for = wake_at;
 		}
 
 		/*
-		 * Ignore the file if it doesn't exist or it isn't a regular
-		 * file.
+		 * Wait for something to happen, for no longer than the
+		 * most impatient context can wait.
 		 */
-		if (lstat(fullpath, &sb) != 0) {
-			free(fullpath);
-			break;
-		} else if (!S_ISREG(sb.st_mode)) {
-			free(fullpath);
+		timeout = -1;
+		for (idx = 0; idx < count; idx++) {
+			int context_timeout;
+			context_timeout = watch_dir_wait_time(contexts[idx]);
+			if ((0 <= context_timeout)
+			    && ((0 > timeout) || (context_timeout < timeout)))
+				timeout = context_timeout;
+		}
+
+		if (NULL != shard_lock)
+			pthread_mutex_unlock(shard_lock);
+		ready =
+		    epoll_wait(fd_epoll, ready_events,
+			       sizeof(ready_events) /
+			       sizeof(ready_events[0]), timeout);
+		if (NULL != shard_lock)
+			pthread_mutex_lock(shard_lock);
+		if (0 > ready) {
+			if (EINTR == errno)
+				continue;
+			error("%s: %s", "epoll_wait", strerror(errno));
 			break;
 		}
 
 		/*
-		 * Add the new file and queue it to be checked.
+		 * While a context has no changes to dump, keep moving its
+		 * next dump on, to where it would have been if we had
+		 * woken up for every one, so that changes arriving after a
+		 * quiet spell are still collected together until the next
+		 * one.
 		 */
-		debug("%s: %s", fullpath, "adding new file");
-		newfile = ds_file_add(dir, event->name);
-		ds_change_queue_file_add(newfile, 0);
+		time(&now);
+		for (idx = 0; idx < count; idx++) {
+			ds_context_t context = contexts[idx];
+			unsigned long interval;
+
+			interval = context->options.changedpath_dump_interval;
+			if ((NULL == shard_lock) && (NULL != context->topdir)
+			    && (!ds_dir_flagged(context->topdir))
+			    && (now >= context->next_changedpath_dump)
+			    && (0 < interval)) {
+				context->next_changedpath_dump +=
+				    (1 +
+				     (now -
+				      context->next_changedpath_dump) /
+				     interval) * interval;
+			}
+		}
+
+		for (ready_idx = 0; ready_idx < ready; ready_idx++) {
+			int fd;
+			ds_context_t context;
+
+			fd = watch_dir_epoll_fd(ready_events[ready_idx]);
+			context =
+			    contexts[watch_dir_epoll_idx
+				     (ready_events[ready_idx])];
+
+			if ((fd == fd_stop) && (0 <= fd_stop)) {
+				struct signalfd_siginfo siginfo;
+				if (read(fd_stop, &siginfo, sizeof(siginfo))
+				    > 0)
+					stop = 1;
+			} else if (fd == fd_timer) {
+				uint64_t expirations;
+				if (read(fd_timer, &expirations,
+					 sizeof(expirations)) > 0)
+					timer_set_for = 0;
+			} else if ((NULL != context->event_ring)
+				   && (fd == context->event_ring->fd_ready)) {
+				context->ring_ready = 1;
+			} else if (fd == context->fd_inotify) {
+				process_inotify_events(context);
+#ifdef FAN_REPORT_DFID_NAME
+			} else if (fd == context->fd_fanotify) {
+				process_fanotify_events(context);
+#endif				/* FAN_REPORT_DFID_NAME */
+			}
+		}
 
-		free(fullpath);
+		if ((watch_dir_exit_now) || (stop))
+			break;
 
-		break;
-	case IN_ACTION_UPDATE:
-		/*
-		 * This a file we've seen before, so queue a check for it.
-		 */
-		ds_change_queue_file_add(file, 0);
-		break;
-	case IN_ACTION_DELETE:
-		/*
-		 * If we've seen this file before, delete its structure.
-		 */
-		debug("%s: %s", file->path, "triggering removal");
-		/*
-		 * Mark the parent directory as a changed path.
-		 */
-		mark_path_changed(file->parent->topdir, file->parent->path,
-				  1);
-		ds_file_remove(file);
-		break;
+		for (idx = 0; idx < count; idx++)
+			watch_dir_run_context(contexts[idx]);
 	}
+
+	if (NULL != shard_lock)
+		pthread_mutex_unlock(shard_lock);
+
+	for (idx = 0; idx < count; idx++)
+		ds_event_ring_stop(contexts[idx]);
+
+	close(fd_epoll);
+	close(fd_timer);
+
+	return 0;
 }
 
 
 /*
- * Process incoming inotify events.
+ * Main function of the thread running one shard of a sharded watch, whose
+ * context is "arg".  If the shard's main loop can't be run, the shard is
+ * marked as failed, and watch_dir_shards() is woken up to stop the rest.
  */
-static void process_inotify_events(ds_dir_t topdir)
+static void *watch_dir_shard_run(void *arg)
 {
-	unsigned char readbuf[8192];
-	ssize_t got, pos;
-
-	if (NULL == topdir)
-		return;
-	if (0 > topdir->fd_inotify)
-		return;
-
-	memset(readbuf, 0, sizeof(readbuf));
+	ds_context_t context = arg;
+	sigset_t signals;
 
 	/*
-	 * Read as many events as we can.
+	 * Leave the exit signals to the thread looking after the shards.
 	 */
-	got = read(topdir->fd_inotify, readbuf, sizeof(readbuf));
-	if (got <= 0) {
-		error("%s: (%d): %s", "inotify read event", got,
-		      strerror(errno));
-		close(topdir->fd_inotify);
-		topdir->fd_inotify = -1;
-		return;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if (watch_dir_loop(&context, 1, context->fd_shard_stop) != 0) {
+		pthread_mutex_lock(&(context->shard_lock));
+		context->shard_failed = 1;
+		pthread_mutex_unlock(&(context->shard_lock));
+		ds_shard_notify(context);
 	}
 
-	/*
-	 * Process each event that we've read.
-	 */
-	for (pos = 0; pos < got;) {
-		struct inotify_event *event;
-		ds_dir_t dir = NULL;
-
-		event = (struct inotify_event *) &(readbuf[pos]);
-		dir = ds_watch_index_lookup(topdir, event->wd);
-
-#if ENABLE_DEBUGGING
-		if (debugging_enabled) {
-			char flags[1024];
-			flags[0] = 0;
-			if (event->mask & IN_ACCESS)
-				strcat(flags, " IN_ACCESS");
-			if (event->mask & IN_ATTRIB)
-				strcat(flags, " IN_ATTRIB");
-			if (event->mask & IN_CLOSE_WRITE)
-				strcat(flags, " IN_CLOSE_WRITE");
-			if (event->mask & IN_CLOSE_NOWRITE)
-				strcat(flags, " IN_CLOSE_NOWRITE");
-			if (event->mask & IN_CREATE)
-				strcat(flags, " IN_CREATE");
-			if (event->mask & IN_DELETE)
-				strcat(flags, " IN_DELETE");
-			if (event->mask & IN_DELETE_SELF)
-				strcat(flags, " IN_DELETE_SELF");
-			if (event->mask & IN_MODIFY)
-				strcat(flags, " IN_MODIFY");
-			if (event->mask & IN_MOVE_SELF)
-				strcat(flags, " IN_MOVE_SELF");
-			if (event->mask & IN_MOVED_FROM)
-				strcat(flags, " IN_MOVED_FROM");
-			if (event->mask & IN_MOVED_TO)
-				strcat(flags, " IN_MOVED_TO");
-			if (event->mask & IN_OPEN)
-				strcat(flags, " IN_OPEN");
-			if (event->mask & IN_IGNORED)
-				strcat(flags, " IN_IGNORED");
-			if (event->mask & IN_ISDIR)
-				strcat(flags, " IN_ISDIR");
-			if (event->mask & IN_Q_OVERFLOW)
-				strcat(flags, " IN_Q_OVERFLOW");
-			if (event->mask & IN_UNMOUNT)
-				strcat(flags, " IN_UNMOUNT");
-			debug("%s: %d: %s: %.*s:%s", "inotify", event->wd,
-			      NULL == dir ? "(unknown)" : dir->path,
-			      event->len,
-			      NULL == event->name
-			      && 0 < event->len ? "(none)" : event->name,
-			      flags);
-		}
-#endif				/* ENABLE_DEBUGGING */
-
-		pos += sizeof(*event) + event->len;
-
-		/*
-		 * There's nothing we can do if we don't know which
-		 * directory it was.
-		 */
-		if (NULL == dir)
-			continue;
-
-		if (event->mask & IN_DELETE_SELF) {
-			ds_dir_remove(dir);
-			continue;
-		}
-
-		/*
-		 * If this isn't an event about a named thing in this
-		 * directory, we can't do anything.
-		 */
-		if (NULL == event->name)
-			continue;
-		if (0 == event->name[0])
-			continue;
-		if (0 >= event->len)
-			continue;
+	watch_dir_thread_release();
 
-		if (event->mask & IN_ISDIR) {
-			process_dir_change(event, dir);
-		} else {
-			process_file_change(event, dir);
-		}
-	}
+	return NULL;
 }
 
 
 /*
- * Add a path to the list of changed paths.
+ * Watch "toplevel_path" as "shard_count" shards, each with its own event
+ * queue, tree, change queue, and thread running the main loop, so that
+ * the work of a busy tree is spread over several processors.  Each
+ * subdirectory of the top level belongs to one shard, chosen by hashing
+ * its name, and the files in the top level belong to the first shard;
+ * every shard watches the top level itself, and ignores whatever in it
+ * belongs to the others.
+ *
+ * This thread only waits for exit signals on "fd_signal", and for the
+ * shards to ask for attention; it writes out the changed paths of all of
+ * the shards together every dump interval, or as soon as a shard has
+ * recovered from lost events, and writes the status file for them all.
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE on error.
  */
-static void mark_path_changed(ds_dir_t topdir, const char *path,
-			      flag_t isdir)
+static int watch_dir_shards(const char *toplevel_path,
+			    const char *changedpath_dir,
+			    struct watch_options_s *options,
+			    unsigned int shard_count, int fd_signal)
 {
-	char *savepath;
-	int idx;
-
-	if (NULL == topdir)
-		return;
+	ds_context_t *shards;		 /* the contexts of the shards */
+	unsigned int started;		 /* number of shard threads running */
+	time_t next_changedpath_dump;	 /* when to next dump changed paths */
+	int fd_epoll;			 /* fd to wait for everything on */
+	int fd_notify;			 /* eventfd the shards wake us with */
+	flag_t stop;			 /* set when an exit signal arrives */
+	unsigned int idx;
+	int rc;
+
+	shards = calloc(shard_count, sizeof(shards[0]));
+	if (NULL == shards) {
+		die("%s: %s", "calloc", strerror(errno));
+		return EXIT_FAILURE;
+	}
 
-	if (NULL == path)
-		return;
+	fd_notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (0 > fd_notify) {
+		error("%s: %s", "eventfd", strerror(errno));
+		free(shards);
+		return EXIT_FAILURE;
+	}
 
-	if (asprintf(&savepath, "%s%s", path, isdir ? "/" : "") < 0) {
-		die("%s: %s", "asprintf", strerror(errno));
-		return;
+	fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (0 > fd_epoll) {
+		error("%s: %s", "epoll_create1", strerror(errno));
+		close(fd_notify);
+		free(shards);
+		return EXIT_FAILURE;
 	}
 
+	watch_dir_epoll_add(fd_epoll, fd_signal, 0);
+	watch_dir_epoll_add(fd_epoll, fd_notify, 0);
+
+	rc = EXIT_SUCCESS;
+
 	/*
-	 * Check the path isn't already listed - don't list it twice.
+	 * Set up every shard before starting any of them, so that an error
+	 * leaves nothing running.
 	 */
-	for (idx = 0; idx < topdir->changed_paths_length; idx++) {
-		if (strcmp(topdir->changed_paths[idx], savepath) == 0) {
-			free(savepath);
-			return;
+	for (idx = 0; idx < shard_count; idx++) {
+		ds_context_t context;
+
+		context =
+		    watch_dir_open(toplevel_path, NULL, options, idx,
+				   shard_count);
+		if (NULL == context) {
+			rc = EXIT_FAILURE;
+			break;
+		}
+		shards[idx] = context;
+
+		pthread_mutex_init(&(context->shard_lock), NULL);
+		context->fd_shard_notify = fd_notify;
+		context->fd_shard_stop =
+		    eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (0 > context->fd_shard_stop) {
+			error("%s: %s", "eventfd", strerror(errno));
+			rc = EXIT_FAILURE;
+			break;
 		}
 	}
 
-	/*
-	 * Extend the array if necessary.
-	 */
-	if (topdir->changed_paths_length >= topdir->changed_paths_alloced) {
-		int new_size;
-		char **newptr;
-		new_size =
-		    topdir->changed_paths_alloced +
-		    CHANGEDPATH_ALLOC_CHUNK;
-		newptr =
-		    realloc(topdir->changed_paths,
-			    new_size * sizeof(topdir->changed_paths[0]));
-		if (NULL == newptr) {
-			die("%s: %s", "realloc", strerror(errno));
-			return;
+	started = 0;
+	while ((EXIT_SUCCESS == rc) && (started < shard_count)) {
+		int thread_rc;
+		thread_rc =
+		    pthread_create(&(shards[started]->shard_thread), NULL,
+				   watch_dir_shard_run, shards[started]);
+		if (0 != thread_rc) {
+			error("%s: %s", "pthread_create",
+			      strerror(thread_rc));
+			rc = EXIT_FAILURE;
+			break;
 		}
-		topdir->changed_paths = newptr;
-		topdir->changed_paths_alloced = new_size;
+		started++;
 	}
 
-	debug("%s: %s", "adding to changed paths", savepath);
+	debug("%s: %u", "shards started", started);
 
-	/*
-	 * Add the new entry, and extend the length of the array.
-	 */
-	topdir->changed_paths[topdir->changed_paths_length] = savepath;
-	topdir->changed_paths_length++;
-}
+	next_changedpath_dump =
+	    time(NULL) + options->changedpath_dump_interval;
+	stop = 0;
 
+	while ((EXIT_SUCCESS == rc) && (!watch_dir_exit_now) && (!stop)) {
+		struct epoll_event ready_events[2];
+		flag_t recovered, status_wanted;
+		time_t now;
+		int ready, timeout;
+		int ready_idx;
 
-/*
- * Write out a new file containing the current changed paths list, and clear
- * the list.
- */
-static void dump_changed_paths(ds_dir_t topdir, const char *savedir)
-{
-	char *savefile;
-	char *tmpfile;
-	struct tm *tm;
-	time_t t;
-	int tmpfd;
-	FILE *fptr;
-	int idx;
+		/*
+		 * Sleep until the next dump is due, or until a shard or a
+		 * signal wakes us.
+		 */
+		time(&now);
+		timeout = 0;
+		if (next_changedpath_dump > now)
+			timeout = 1000 * (next_changedpath_dump - now);
+
+		ready =
+		    epoll_wait(fd_epoll, ready_events,
+			       sizeof(ready_events) /
+			       sizeof(ready_events[0]), timeout);
+		if (0 > ready) {
+			if (EINTR == errno)
+				continue;
+			error("%s: %s", "epoll_wait", strerror(errno));
+			break;
+		}
 
-	if (NULL == topdir->changed_paths)
-		return;
-	if (0 >= topdir->changed_paths_length)
-		return;
+		for (ready_idx = 0; ready_idx < ready; ready_idx++) {
+			int fd = watch_dir_epoll_fd(ready_events[ready_idx]);
+
+			if ((fd == fd_signal) && (0 <= fd_signal)) {
+				struct signalfd_siginfo siginfo;
+				if (read(fd_signal, &siginfo, sizeof(siginfo))
+				    > 0)
+					stop = 1;
+			} else if (fd == fd_notify) {
+				uint64_t count;
+				if (read(fd_notify, &count, sizeof(count)) <
+				    0)
+					error("%s: %s", "eventfd read",
+					      strerror(errno));
+			}
+		}
 
-	t = time(NULL);
-	tm = localtime(&t);
+		if ((watch_dir_exit_now) || (stop))
+			break;
 
-	if (asprintf
-	    (&savefile, "%s/%04d%02d%02d-%02d%02d%02d.%d", savedir,
-	     tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour,
-	     tm->tm_min, tm->tm_sec, getpid()) < 0) {
-		die("%s: %s", "asprintf", strerror(errno));
-		return;
-	}
+		/*
+		 * Hold every shard still while looking at them all together,
+		 * taking the locks in the same order every time.
+		 */
+		for (idx = 0; idx < shard_count; idx++)
+			pthread_mutex_lock(&(shards[idx]->shard_lock));
+
+		recovered = 0;
+		status_wanted = 0;
+		for (idx = 0; idx < shard_count; idx++) {
+			if (shards[idx]->shard_failed)
+				rc = EXIT_FAILURE;
+			if (shards[idx]->recovered) {
+				shards[idx]->recovered = 0;
+				recovered = 1;
+			}
+			if (shards[idx]->status_wanted) {
+				shards[idx]->status_wanted = 0;
+				status_wanted = 1;
+			}
+		}
 
-	tmpfd = ds_tmpfile(savefile, &tmpfile);
-	if (0 > tmpfd) {
-		free(savefile);
-		return;
-	}
+		time(&now);
+		if ((recovered) || (now >= next_changedpath_dump)) {
+			next_changedpath_dump =
+			    now + options->changedpath_dump_interval;
+			dump_changed_paths(shards, shard_count,
+					   changedpath_dir);
+			if (recovered)
+				write_overflow_marker(changedpath_dir);
+			status_wanted = 1;
+		}
 
-	fptr = fdopen(tmpfd, "w");
-	if (NULL == fptr) {
-		error("%s: %s", tmpfile, strerror(errno));
-		close(tmpfd);
-		remove(tmpfile);
-		free(tmpfile);
-		free(savefile);
-		return;
-	}
+		if (status_wanted)
+			write_watcher_status(shards, shard_count);
 
-	for (idx = 0; idx < topdir->changed_paths_length; idx++) {
-		fprintf(fptr, "%s\n", topdir->changed_paths[idx]);
+		for (idx = 0; idx < shard_count; idx++)
+			pthread_mutex_unlock(&(shards[idx]->shard_lock));
 	}
 
-	fclose(fptr);
-
-	if (rename(tmpfile, savefile) != 0) {
-		error("%s: %s", savefile, strerror(errno));
-		remove(tmpfile);
-		free(tmpfile);
-		free(savefile);
-		return;
+	/*
+	 * Stop the shards and wait for them to finish.
+	 */
+	for (idx = 0; idx < started; idx++) {
+		uint64_t one = 1;
+		if (write(shards[idx]->fd_shard_stop, &one, sizeof(one)) < 0)
+			error("%s: %s", "eventfd write", strerror(errno));
 	}
+	for (idx = 0; idx < started; idx++)
+		pthread_join(shards[idx]->shard_thread, NULL);
 
-	free(tmpfile);
-	free(savefile);
+	/*
+	 * Save a snapshot of each shard for the next watcher to start from,
+	 * first writing out any changes still waiting to be listed, as in
+	 * watch_dirs().
+	 */
+	if ((shard_count == started) && (NULL != options->snapshot_file)) {
+		dump_changed_paths(shards, shard_count, changedpath_dir);
+		for (idx = 0; idx < shard_count; idx++)
+			ds_snapshot_save(shards[idx]);
+	}
 
-	for (idx = 0; idx < topdir->changed_paths_length; idx++) {
-		free(topdir->changed_paths[idx]);
+	for (idx = 0; idx < shard_count; idx++) {
+		if (NULL == shards[idx])
+			break;
+		if (0 <= shards[idx]->fd_shard_stop)
+			close(shards[idx]->fd_shard_stop);
+		pthread_mutex_destroy(&(shards[idx]->shard_lock));
+		watch_dir_close(shards[idx]);
 	}
 
-	free(topdir->changed_paths);
-	topdir->changed_paths = NULL;
-	topdir->changed_paths_length = 0;
-	topdir->changed_paths_alloced = 0;
+	close(fd_epoll);
+	close(fd_notify);
+	free(shards);
+
+	return rc;
 }
 
 
-/*
- * Handler for an exit signal such as SIGTERM - set a flag to trigger an
- * exit.
- */
-static void watch_dir_exitsignal(int signum)
-{
-	watch_dir_exit_now = 1;
-}
 
 
 /*
- * Main entry point.  Set everything up and enter the main loop, which does
- * the following:
+ * Main entry point.  Set everything up for watching each of the "count"
+ * directory trees in "roots", and enter the main loop, which does the
+ * following for each one:
  *
  *   - A periodic rescan from the top level directory down.
  *   - Processing of inotify events from all known directories.
@@ -1738,29 +7121,53 @@ static void watch_dir_exitsignal(int signum)
  * with duplicates being ignored, and then the change queue is processed in
  * chunks to avoid starvation caused by inotify events from one file
  * changing rapidly.
+ *
+ * The loop sleeps in epoll_wait() until there are events to read, a
+ * signal arrives, or a timerfd set for the next of the above that is due
+ * goes off, so an idle watcher does not wake up at all.  All of the trees
+ * share the one loop, so watching many of them costs one process and one
+ * wakeup per burst of activity rather than one for each tree.
+ *
+ * If only one tree is given and more than one shard is asked for, the
+ * tree is split between that many main loops, each in its own thread -
+ * see watch_dir_shards().
  */
-int watch_dir(const char *toplevel_path, const char *changedpath_dir,
-	      unsigned long full_scan_interval,
-	      unsigned long queue_run_interval,
-	      unsigned long queue_run_max_seconds,
-	      unsigned long changedpath_dump_interval,
-	      unsigned int max_dir_depth, char **excl,
-	      unsigned int excl_count)
+int watch_dirs(struct watch_root_s *roots, unsigned int count)
 {
-	int fd_inotify;			 /* fd to watch for inotify on */
-	time_t next_full_scan;		 /* when to run next full scan */
-	ds_dir_t topdir;		 /* top-level directory contents */
-	time_t next_change_queue_run;	 /* when to next run changes */
-	time_t next_changedpath_dump;	 /* when to next dump changed paths */
+	ds_context_t *contexts;		 /* contents of each tree */
+	unsigned int shard_count;	 /* number of shards to split into */
+	flag_t use_io_uring;		 /* set if any tree wants io_uring */
+	int fd_signal;			 /* signalfd for exit signals */
+	sigset_t exit_signals;		 /* signals read from fd_signal */
+	sigset_t old_signals;		 /* signal mask to restore on exit */
 	struct sigaction sa;
-	flag_t first_run;
+	unsigned int idx;
+	int rc;
+
+	if (1 > count)
+		return EXIT_SUCCESS;
 
-	max_directory_depth = max_dir_depth;
-	excludes = excl;
-	exclude_count = excl_count;
+	use_io_uring = 0;
+	for (idx = 0; idx < count; idx++) {
+		if (roots[idx].options.use_io_uring)
+			use_io_uring = 1;
+	}
+	statbatch_enable(use_io_uring);
+
+	shard_count = roots[0].options.shards;
+	if (1 > shard_count)
+		shard_count = 1;
+	if ((1 < shard_count)
+	    && ((1 < count) || (0 < roots[0].view_count))) {
+		error("%s", "shards can't be used with several trees, ignoring");
+		shard_count = 1;
+	}
+	if ((1 < shard_count) && (roots[0].options.use_fanotify))
+		error("%s", "fanotify can't be used with shards, using inotify");
 
 	/*
-	 * Set up the signal handlers.
+	 * Set up the signal handlers, which are only used if a signalfd
+	 * can't be made for the main loop.
 	 */
 	sa.sa_handler = watch_dir_exitsignal;
 	sigemptyset(&(sa.sa_mask));
@@ -1773,102 +7180,102 @@ int watch_dir(const char *toplevel_path, const char *changedpath_dir,
 	sigaction(SIGINT, &sa, NULL);
 
 	/*
-	 * Create the inotify event queue.
+	 * If it can be made, use a signalfd for the exit signals, which are
+	 * then blocked so that they are only seen through it.
 	 */
-	fd_inotify = inotify_init();
-	if (0 > fd_inotify) {
-		error("%s: %s", "inotify", strerror(errno));
-		return EXIT_FAILURE;
+	sigemptyset(&exit_signals);
+	sigaddset(&exit_signals, SIGTERM);
+	sigaddset(&exit_signals, SIGINT);
+	sigprocmask(SIG_BLOCK, &exit_signals, &old_signals);
+	fd_signal = signalfd(-1, &exit_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (0 > fd_signal) {
+		error("%s: %s", "signalfd", strerror(errno));
+		sigprocmask(SIG_SETMASK, &old_signals, NULL);
 	}
 
-	/*
-	 * Create the top-level directory memory structure.
-	 */
-	topdir = ds_dir_toplevel(fd_inotify, toplevel_path);
-	if (NULL == topdir)
-		return EXIT_FAILURE;
-
-	/*
-	 * Enter the main loop.
-	 */
-
-	next_change_queue_run = 0;
-	next_full_scan = 0;
-	next_changedpath_dump = 0;
-	first_run = 1;
-
-	while (!watch_dir_exit_now) {
-		time_t now;
+	if (1 < shard_count) {
+		rc = watch_dir_shards(roots[0].toplevel_path,
+				      roots[0].changedpath_dir,
+				      &(roots[0].options), shard_count,
+				      fd_signal);
+	} else {
+		contexts = calloc(count, sizeof(contexts[0]));
+		if (NULL == contexts) {
+			die("%s: %s", "calloc", strerror(errno));
+			return EXIT_FAILURE;
+		}
 
-		/*
-		 * Process new inotify events.
-		 */
-		if (0 <= fd_inotify) {
-			fd_set readfds;
-			struct timeval timeout;
-			int ready;
-
-			FD_ZERO(&readfds);
-			FD_SET(fd_inotify, &readfds);
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 100000;
-
-			ready =
-			    select(1 + fd_inotify, &readfds, NULL,
-				   NULL, &timeout);
-
-			if (0 > ready) {
-				if (errno != EINTR)
-					error("%s: %s", "select",
-					      strerror(errno));
-				watch_dir_exit_now = 1;
+		rc = EXIT_SUCCESS;
+		for (idx = 0; idx < count; idx++) {
+			contexts[idx] =
+			    watch_dir_open(roots[idx].toplevel_path,
+					   roots[idx].changedpath_dir,
+					   &(roots[idx].options), 0, 1);
+			if (NULL == contexts[idx]) {
+				rc = EXIT_FAILURE;
 				break;
-			} else if ((0 < ready)
-				   && FD_ISSET(fd_inotify, &readfds)) {
-				process_inotify_events(topdir);
 			}
-		} else {
-			sleep(1);
+			contexts[idx]->views = roots[idx].views;
+			contexts[idx]->view_count = roots[idx].view_count;
 		}
 
-		time(&now);
+		if (EXIT_SUCCESS == rc) {
+			if (watch_dir_loop(contexts, count, fd_signal) != 0)
+				rc = EXIT_FAILURE;
 
-		/*
-		 * Do a full scan periodically.
-		 */
-		if (now >= next_full_scan) {
-			next_full_scan = now + full_scan_interval;
-			ds_change_queue_dir_add(topdir, 0);
+			/*
+			 * Save a snapshot of each tree for the next watcher
+			 * to start from, first writing out any changes
+			 * still waiting to be listed, since the snapshot
+			 * will not show them as changes when it is loaded.
+			 */
+			for (idx = 0; idx < count; idx++) {
+				if (NULL == contexts[idx]->snapshot_file)
+					continue;
+				dump_changed_paths(&(contexts[idx]), 1,
+						   contexts[idx]->
+						   changedpath_dir);
+				ds_snapshot_save(contexts[idx]);
+			}
 		}
 
-		/*
-		 * Run our change queue.
-		 */
-		if (now >= next_change_queue_run) {
-			next_change_queue_run = now + queue_run_interval;
-			ds_change_queue_process(topdir,
-						now +
-						queue_run_max_seconds);
-		}
+		for (idx = 0; idx < count; idx++)
+			watch_dir_close(contexts[idx]);
+		free(contexts);
+	}
 
-		/*
-		 * Dump our list of changed paths.
-		 */
-		if (now >= next_changedpath_dump) {
-			next_changedpath_dump =
-			    now + changedpath_dump_interval;
-			dump_changed_paths(topdir, changedpath_dir);
-		}
+	if (0 <= fd_signal) {
+		close(fd_signal);
+		sigprocmask(SIG_SETMASK, &old_signals, NULL);
+	}
 
-		first_run = 0;
+	for (idx = 0; idx < count; idx++) {
+		if (NULL != roots[idx].options.status_file)
+			remove(roots[idx].options.status_file);
 	}
 
-	ds_dir_remove(topdir);
+	watch_dir_thread_release();
 
-	if (0 <= fd_inotify)
-		close(fd_inotify);
+	return rc;
+}
+
+
+/*
+ * Watch the single directory tree "toplevel_path", writing lists of
+ * changed paths to "changedpath_dir" - see watch_dirs().
+ */
+int watch_dir(const char *toplevel_path, const char *changedpath_dir,
+	      struct watch_options_s *options)
+{
+	struct watch_root_s root;
+
+	root.toplevel_path = toplevel_path;
+	root.changedpath_dir = changedpath_dir;
+	root.options = *options;
+	root.views = NULL;
+	root.view_count = 0;
 
-	return EXIT_SUCCESS;
+	return watch_dirs(&root, 1);
 }
 
 /* EOF */
@@ -0,0 +1,68 @@
+/*
+ * Header for the directory watcher.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H 1
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+/*
+ * File created by watch_dir() in the changed paths directory once it has
+ * rescanned the tree after changes were lost from the event queue.
+ */
+#define WATCH_OVERFLOW_MARKER ".overflow"
+
+/*
+ * Structure describing how watch_dir() should watch a directory.
+ */
+struct watch_options_s {
+	unsigned long full_scan_interval;    /* seconds between full scans */
+	unsigned long queue_run_interval;    /* seconds between queue runs */
+	unsigned long queue_run_max_seconds; /* max time per queue run */
+	unsigned long changedpath_dump_interval; /* seconds between dumps */
+	unsigned int max_dir_depth;	     /* max depth to descend */
+	char **excludes;		     /* glob patterns to exclude */
+	unsigned int exclude_count;	     /* number of exclude patterns */
+	unsigned long collapse_threshold;    /* changed files to list dir */
+	const char *status_file;	     /* watcher status file, or NULL */
+	const char *snapshot_file;	     /* tree snapshot file, or NULL */
+	unsigned int scan_threads;	     /* threads for initial scan */
+	unsigned int rescan_sample;	     /* stat 1 in N unchanged files */
+	flag_t use_io_uring;		     /* batch stat() calls in io_uring */
+	flag_t use_fanotify;		     /* use a fanotify filesystem mark */
+	flag_t use_close_write;		     /* check files when closed */
+	unsigned int shards;		     /* threads to split tree between */
+};
+
+/*
+ * Structure describing a subdirectory of a watched tree whose changes are
+ * also listed in a changed paths directory of its own, relative to the
+ * subdirectory, as if it were being watched on its own.
+ */
+struct watch_view_s {
+	const char *subdir;		     /* path under the top level */
+	const char *changedpath_dir;	     /* where to list changes */
+};
+
+/*
+ * Structure describing one of several directory trees for watch_dirs() to
+ * watch together.
+ */
+struct watch_root_s {
+	const char *toplevel_path;	     /* directory to watch */
+	const char *changedpath_dir;	     /* where to list changed paths */
+	struct watch_options_s options;	     /* how to watch it */
+	struct watch_view_s *views;	     /* subdirs listed apart */
+	unsigned int view_count;	     /* number of entries in views */
+};
+
+int watch_dir(const char *toplevel_path, const char *changedpath_dir,
+	      struct watch_options_s *options);
+int watch_dirs(struct watch_root_s *roots, unsigned int count);
+
+#endif	/* WATCH_H */
+
+/* EOF */
@@ -9,18 +9,10 @@
 #include <errno.h>
 #include <getopt.h>
 #include "common.h"
+#include "watch.h"
 
 #define MAX_EXCLUDES 1000
 
-extern int watch_dir(const char *toplevel_path,
-		     const char *changedpath_dir,
-		     unsigned long full_scan_interval,
-		     unsigned long queue_run_interval,
-		     unsigned long queue_run_max_seconds,
-		     unsigned long changedpath_dump_interval,
-		     unsigned int max_dir_depth, char **excludes,
-		     unsigned int exclude_count);
-
 /* List of command line parameters after options. */
 static char **parameters = NULL;
 static int parameter_count = 0;
@@ -33,6 +25,15 @@ static unsigned long changedpath_dump_interval = 30;
 static unsigned int max_dir_depth = 20;
 static char *excludes[MAX_EXCLUDES];
 static unsigned int exclude_count = 0;
+static unsigned long collapse_threshold = 0;
+static char *status_file = NULL;
+static char *snapshot_file = NULL;
+static unsigned int scan_threads = 1;
+static unsigned int rescan_sample = 1;
+static unsigned int shards = 1;
+static flag_t use_io_uring = 0;
+static flag_t use_fanotify = 0;
+static flag_t use_close_write = 0;
 
 
 /*
@@ -63,6 +64,28 @@ static void usage(void)
 	printf("  -m, --queue-run-max %s (%lu)\n",
 	       _("SEC       max time to spend processing queue"),
 	       queue_run_max_seconds);
+	printf("  -c, --collapse %s (%lu)\n",
+	       _("NUM            list dir if NUM files in it change"),
+	       collapse_threshold);
+	printf("  -s, --status-file %s\n",
+	       _("FILE        write watcher status to FILE"));
+	printf("  -S, --snapshot %s\n",
+	       _("FILE           keep a snapshot of the tree in FILE"));
+	printf("  -t, --scan-threads %s (%u)\n",
+	       _("NUM        threads to use for initial scan"),
+	       scan_threads);
+	printf("  -R, --rescan-sample %s (%u)\n",
+	       _("NUM       full rescans check 1 in NUM files"),
+	       rescan_sample);
+	printf("  -N, --shards %s (%u)\n",
+	       _("NUM              split the tree between NUM threads"),
+	       shards);
+	printf("  -u, --io-uring %s\n",
+	       _("               batch stat() calls using io_uring"));
+	printf("  -F, --fanotify %s\n",
+	       _("               watch the filesystem using fanotify"));
+	printf("  -W, --close-write %s\n",
+	       _("            check files when closed, not on every write"));
 	printf("\n");
 	printf("  -h, --help     %s\n", _("display this help and exit"));
 	printf("  -V, --version  %s\n",
@@ -98,13 +121,22 @@ static int parse_options(int argc, char **argv)
 		{"dump-interval", 1, 0, 'i'},
 		{"interval", 1, 0, 'i'},
 		{"depth", 1, 0, 'r'},
+		{"collapse", 1, 0, 'c'},
+		{"status-file", 1, 0, 's'},
+		{"snapshot", 1, 0, 'S'},
+		{"scan-threads", 1, 0, 't'},
+		{"rescan-sample", 1, 0, 'R'},
+		{"shards", 1, 0, 'N'},
+		{"io-uring", 0, 0, 'u'},
+		{"fanotify", 0, 0, 'F'},
+		{"close-write", 0, 0, 'W'},
 #if ENABLE_DEBUGGING
 		{"debug", 0, 0, 'd'},
 #endif
 		{0, 0, 0, 0}
 	};
 	int option_index = 0;
-	char *short_options = "hVf:e:r:q:m:i:"
+	char *short_options = "hVf:e:r:q:m:i:c:s:S:t:R:N:uFW"
 #if ENABLE_DEBUGGING
 	    "d"
 #endif
@@ -160,11 +192,30 @@ static int parse_options(int argc, char **argv)
 			}
 			excludes[exclude_count++] = xstrdup(optarg);
 			break;
+		case 's':
+			status_file = optarg;
+			break;
+		case 'S':
+			snapshot_file = optarg;
+			break;
+		case 'u':
+			use_io_uring = 1;
+			break;
+		case 'F':
+			use_fanotify = 1;
+			break;
+		case 'W':
+			use_close_write = 1;
+			break;
 		case 'f':
 		case 'r':
 		case 'q':
 		case 'm':
 		case 'i':
+		case 'c':
+		case 't':
+		case 'R':
+		case 'N':
 			errno = 0;
 			param = strtoul(optarg, NULL, 10);
 			if (0 != errno) {
@@ -190,6 +241,18 @@ static int parse_options(int argc, char **argv)
 			case 'i':
 				changedpath_dump_interval = param;
 				break;
+			case 'c':
+				collapse_threshold = param;
+				break;
+			case 't':
+				scan_threads = param;
+				break;
+			case 'R':
+				rescan_sample = param;
+				break;
+			case 'N':
+				shards = param;
+				break;
 			}
 			break;
 		default:
@@ -233,6 +296,7 @@ int main(int argc, char **argv)
 {
 	char *toplevel_path;		 /* full path to watched dir */
 	char *changedpath_dir;		 /* full path to output queue dir */
+	struct watch_options_s options;
 	int rc;
 	int eidx;
 
@@ -259,10 +323,25 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	rc = watch_dir(toplevel_path, changedpath_dir, full_scan_interval,
-		       queue_run_interval, queue_run_max_seconds,
-		       changedpath_dump_interval, max_dir_depth, excludes,
-		       exclude_count);
+	memset(&options, 0, sizeof(options));
+	options.full_scan_interval = full_scan_interval;
+	options.queue_run_interval = queue_run_interval;
+	options.queue_run_max_seconds = queue_run_max_seconds;
+	options.changedpath_dump_interval = changedpath_dump_interval;
+	options.max_dir_depth = max_dir_depth;
+	options.excludes = excludes;
+	options.exclude_count = exclude_count;
+	options.collapse_threshold = collapse_threshold;
+	options.status_file = status_file;
+	options.snapshot_file = snapshot_file;
+	options.scan_threads = scan_threads;
+	options.rescan_sample = rescan_sample;
+	options.shards = shards;
+	options.use_io_uring = use_io_uring;
+	options.use_fanotify = use_fanotify;
+	options.use_close_write = use_close_write;
+
+	rc = watch_dir(toplevel_path, changedpath_dir, &options);
 
 	free(toplevel_path);
 	free(changedpath_dir);